@@ -0,0 +1,18 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <iostream>
+#include "memory.h"
+
+// Translating the program loaded into memory into a standalone C++ program, to be compiled
+// by the system compiler. Every instruction found by the control flow graph becomes a label
+// followed by the code of its command in one of the functions of consecutive blocks. Jumps
+// with known targets in the same function become gotos, the other transitions return the next
+// address to the loop in main, which calls the function of that address.
+// The translated program keeps the cells, address registers and flags as the processor does,
+// so it prints the same values as Processor::run. It stops with an error if the program executes
+// an instruction it has changed or jumps to an address that wasn't translated.
+// Returns the number of translated instructions
+size_t translate_to_cpp(const Memory& memory, uint16_t entry, std::ostream& out);
+
+#endif // AOT_H
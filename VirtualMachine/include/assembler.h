@@ -0,0 +1,65 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include "processor.h"
+
+// Error in the assembler source
+struct AsmError
+{
+    size_t line;
+    std::string message;
+};
+
+// Word of the assembled program with its address
+struct AsmWord
+{
+    uint16_t address;
+    Word word;
+    char kind;          // 'k' for commands, 'i', 'u' or 'f' for variables
+    std::string label;  // Label defined at the address (for listings)
+};
+
+// Program with all labels resolved into addresses
+struct AssembledProgram
+{
+    uint16_t entry = 0;          // Address of the first command to execute
+    std::vector<AsmWord> words;  // Sorted by address
+
+    // Writing the program into memory
+    void load(Processor& cpu) const;
+
+    // Writing the program in the text bytecode format
+    void write_text(std::ostream& out) const;
+
+    // Writing the program as a binary image (see load_image in loader.h)
+    void write_binary(std::ostream& out) const;
+};
+
+// Assembling the source with mnemonics, labels and named variables:
+//
+//     .entry main          # program starts at label main
+//     .data
+//     n:      .uint 10     # named variables: .int, .uint, .float
+//     zero:   .uint 0
+//     .text
+//     main:   LOAD r1, n
+//             LOAD r2, zero
+//     loop:   DEC r1
+//             CMP r1, r2
+//             JNE loop
+//             HALT
+//
+// Directives: .org address, .align cells, .equ name value, .text and .data sections.
+// Data is placed right after the code, so the variables stay close to the commands using them.
+// Jumps and calls get absolute addresses, [name] makes a memory-indirect jump, a pair of
+// registers makes a register-indirect one.
+bool assemble(const char* begin, const char* end, AssembledProgram& program, AsmError& error);
+
+// Collecting the program loaded into memory: the instructions reachable from the entry
+// become commands, other nonzero words become unsigned variables
+AssembledProgram program_from_memory(const Memory& memory, uint16_t entry);
+
+#endif // ASSEMBLER_H
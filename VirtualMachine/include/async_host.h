@@ -0,0 +1,84 @@
+#ifndef ASYNC_HOST_H
+#define ASYNC_HOST_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "assembler.h"
+#include "numa_topology.h"
+#include "processor_pool.h"
+
+// Host running many interactive guests with a few threads. Every guest reads from and prints
+// to its own descriptor (a connected socket or a pipe). A guest waiting in READ doesn't hold
+// a thread: it stops with Trap::NEEDS_INPUT, and one epoll loop puts it back into the run
+// queue when the data arrives. The worker threads run the guests from the queue.
+// The processors of the guests are taken from a pool of max_guests processors.
+//
+// The workers are pinned to CPUs spread over the NUMA nodes, and there is a pool for every node.
+// A guest belongs to a worker and gets its processor from the pool of the worker's node, so its
+// memory and registers are local. A resumed guest returns to the queue of its worker. A worker
+// with nothing to run takes a guest waiting for a busy worker (of its own node first), and the
+// guest stays with it
+class AsyncHost final
+{
+public:
+    AsyncHost(size_t threads, size_t max_guests);
+    ~AsyncHost();
+
+    AsyncHost(const AsyncHost&) = delete;
+    AsyncHost& operator=(const AsyncHost&) = delete;
+
+    // Modes of the processors of the new guests (see Processor::set_extended_stack, set_fast_float
+    // and set_data_stack)
+    size_t call_stack_limit = 0;
+    bool fast_float = false;
+    uint32_t data_stack_limit = 0;
+
+    // Running the program in a new guest connected to the descriptor.
+    // The host closes the descriptor when the guest stops, or at once if there are already max_guests guests
+    bool add_guest(const AssembledProgram& program, int fd);
+
+    // Starting a new guest with the program for every connection to the Unix domain socket
+    bool listen(const std::string& path, const AssembledProgram& program);
+
+    // Serving the guests until all of them stop, or forever when listening
+    void run();
+
+private:
+    struct Guest;
+
+    struct Worker
+    {
+        size_t node; // Index in the topology
+        int cpu;
+        std::deque<Guest*> queue;
+        std::condition_variable wake;
+        bool idle = false; // Waiting for wake
+    };
+
+    NumaTopology topology;
+    std::vector<std::unique_ptr<ProcessorPool>> pools; // By node
+    std::vector<std::unique_ptr<Worker>> workers;
+    int epoll_fd;
+    int wake_fd;        // eventfd waking the loop when the last guest stops
+    int listen_fd = -1;
+    std::string listen_path;
+    AssembledProgram listen_program;
+
+    std::mutex mutex;
+    size_t next_worker = 0; // Of the next new guest
+    size_t guests = 0;   // Guests not stopped yet
+    bool stopping = false;
+
+    void schedule(Guest* guest);
+    Guest* take(size_t worker);
+    void worker(size_t index);
+    void suspend(Guest* guest);
+    void finish(Guest* guest);
+};
+
+#endif // ASYNC_HOST_H
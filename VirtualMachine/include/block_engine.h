@@ -0,0 +1,101 @@
+#ifndef BLOCK_ENGINE_H
+#define BLOCK_ENGINE_H
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <iostream>
+#include "processor.h"
+
+// Hit statistics of an indirect jump site (jump modes 1 and 2)
+struct InlineCacheStats
+{
+    uint8_t mode;        // Jump mode of the site
+    uint16_t target;     // Last target
+    uint64_t hits;       // Target was equal to the cached one
+    uint64_t misses;     // Target changed and the block had to be looked up
+};
+
+struct DecodedBlock;
+
+// Successor of a block remembered after the first transition to it
+struct BlockLink
+{
+    uint16_t ip;
+    DecodedBlock* block;
+};
+
+// Instruction with the command already selected by the operation code (and the addressing mode for jumps)
+struct DecodedInsn
+{
+    const Command* command;
+    Word word;
+};
+
+// Kinds of the last instruction of a block
+enum class BlockExit : uint8_t
+{
+    HALT,     // Zero or unknown operation code, the processor stops
+    JUMP,     // Jump with the target known before execution (modes 0 and 3)
+    INDIRECT, // Jump with the target taken from memory or registers (modes 1 and 2)
+    CALL,
+    ENDP
+};
+
+// Sequence of instructions up to the first jump, CALL, ENDP or halt
+struct DecodedBlock
+{
+    uint16_t start;                 // Address of the first instruction
+    uint16_t exit_address;          // Address of the last instruction
+    BlockExit exit;
+    JumpMask condition;             // Condition of the jump ending the block
+    std::vector<DecodedInsn> body;  // Instructions before the last one
+    DecodedInsn last;               // Last instruction (not executed for HALT)
+
+    // Cached successors: the jump target (or the last target of an indirect jump) and the next instruction
+    BlockLink links[2];
+    InlineCacheStats* cache;        // Statistics of an indirect jump site
+};
+
+// Execution engine running the program by decoded blocks instead of single instructions.
+// Blocks are decoded on the first execution and chained with their successors,
+// indirect jumps keep the last target in an inline cache, and ENDP takes the block
+// following the CALL from the shadow return stack.
+// Writing into the cells of decoded instructions drops all blocks, so the result
+// is the same as of Processor::run.
+class BlockEngine final
+{
+public:
+    explicit BlockEngine(Processor& proc);
+
+    // Starting the processor
+    void run(uint16_t start_address);
+
+    // Dropping all decoded blocks
+    void flush() noexcept;
+
+    // Start addresses of the decoded blocks, in the order of decoding
+    std::vector<uint16_t> block_starts() const;
+
+    // Decoding the blocks before the run (e.g. the ones decoded by an earlier run of the program)
+    void predecode(const std::vector<uint16_t>& starts);
+
+    // Statistics of the indirect jump sites by address
+    const std::map<uint16_t, InlineCacheStats>& inline_cache_stats() const noexcept { return ic_stats; }
+    void print_inline_cache_stats(std::ostream& out) const;
+
+private:
+    static constexpr size_t SHADOW_STACK_SIZE = 4096;
+
+    Processor& proc;
+    std::vector<std::unique_ptr<DecodedBlock>> blocks;
+    std::vector<BlockLink*> shadow_stack; // Return points of the active CALLs
+    std::vector<DecodedBlock*> block_at; // Decoded blocks by start address
+    std::map<uint16_t, InlineCacheStats> ic_stats;
+
+    DecodedBlock* find_block(uint16_t address);
+    DecodedBlock* decode(uint16_t address);
+    DecodedBlock* execute(DecodedBlock* block);
+};
+
+#endif // BLOCK_ENGINE_H
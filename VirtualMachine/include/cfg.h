@@ -0,0 +1,103 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include "command.h"
+#include "memory.h"
+
+// Kinds of transitions between basic blocks
+enum class EdgeKind : uint8_t
+{
+    FALLTHROUGH, // Next instruction, the not taken branch of a jump or the return point after CALL
+    JUMP,        // Direct (mode 0) or relative (mode 3) jump
+    INDIRECT,    // Memory-indirect jump (mode 1), the target is the value currently in the image
+    CALL,        // Subroutine call
+    RETURN       // ENDP to the instruction following a CALL of the subroutine
+};
+
+struct CfgEdge
+{
+    int from;
+    int to;
+    EdgeKind kind;
+};
+
+struct BasicBlock
+{
+    uint16_t start; // Address of the first instruction
+    uint16_t last;  // Address of the last instruction
+    int proc;       // Index of the subroutine the block belongs to
+    int idom;       // Immediate dominator (-1 for subroutine entries)
+    int loop;       // Innermost loop containing the block (-1 if none)
+    int loop_depth; // Number of loops containing the block
+
+    int first_succ, succ_count; // Range in ControlFlowGraph::succs()
+    int first_pred, pred_count; // Range in ControlFlowGraph::preds()
+
+    bool unknown_target; // Ends with a register-indirect jump (mode 2)
+    bool leaves_image;   // Has a transition outside the memory
+};
+
+struct Procedure
+{
+    uint16_t entry; // Address of the first instruction
+    int block;      // Entry block
+};
+
+struct Loop
+{
+    int header;             // Block with the back edges
+    int parent;             // Enclosing loop (-1 for outermost)
+    int depth;              // 1 for outermost loops
+    std::vector<int> blocks; // Blocks of the loop body including the header
+};
+
+// Control flow graph of a program loaded into memory.
+// Instructions are decoded starting from the entry address and from all CALL targets,
+// so the variables placed between the instructions are never treated as code.
+// The roots are more addresses to decode from, e.g. the targets of register-indirect jumps
+class ControlFlowGraph final
+{
+public:
+    ControlFlowGraph(const Memory& memory, uint16_t entry, const std::vector<uint16_t>& roots = {});
+
+    const std::vector<BasicBlock>& blocks() const noexcept { return blocks_; }
+    const std::vector<Procedure>& procedures() const noexcept { return procs_; }
+    const std::vector<Loop>& loops() const noexcept { return loops_; }
+    const std::vector<CfgEdge>& succs() const noexcept { return succs_; }
+    const std::vector<CfgEdge>& preds() const noexcept { return preds_; }
+
+    // Index of the block containing the instruction at the address (-1 if not code)
+    int block_at(uint16_t address) const noexcept;
+
+    // Whether block a dominates block b
+    bool dominates(int a, int b) const noexcept;
+
+    // Displaying blocks, edges, dominators and loops
+    void dump(std::ostream& out) const;
+
+private:
+    const Memory& memory;
+    std::vector<BasicBlock> blocks_;
+    std::vector<Procedure> procs_;
+    std::vector<Loop> loops_;
+    std::vector<CfgEdge> succs_;
+    std::vector<CfgEdge> preds_;
+    std::vector<int> block_of; // Block index by instruction address
+    std::vector<uint8_t> marks; // Decoding marks by address
+    std::vector<int> dom_in, dom_out; // Dominator tree numbering
+
+    void decode(uint16_t entry, const std::vector<uint16_t>& roots);
+    void build_blocks();
+    void build_edges();
+    void find_procedures(uint16_t entry);
+    void find_dominators();
+    void find_loops();
+};
+
+// Text representation of a command, e.g. "JGU 3 8"
+std::string disassemble(Word word);
+
+#endif // CFG_H
@@ -0,0 +1,42 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+// Bounded queue of words from one processor to another (one producer, one consumer) without locks.
+// Each side keeps the last index it saw of the other one, so the shared indices are read only
+// when the buffer looks full or empty. A processor closes its channels when it halts: the other
+// side receives what is left and then sees the end, or its words are dropped
+class Channel final
+{
+public:
+    // The capacity is rounded up to a power of two
+    explicit Channel(size_t capacity);
+
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    // Adding the words that fit. Returns their number (0 if the channel is full). Producer only
+    size_t send(const uint32_t* words, size_t count) noexcept;
+
+    // Taking up to count words. Returns their number (0 if the channel is empty). Consumer only
+    size_t receive(uint32_t* words, size_t count) noexcept;
+
+    void close() noexcept { closed.store(true, std::memory_order_release); }
+    bool is_closed() const noexcept { return closed.load(std::memory_order_acquire); }
+
+private:
+    std::vector<uint32_t> buffer;
+    size_t mask;
+
+    alignas(64) std::atomic<size_t> head { 0 }; // Next word to receive, written by the consumer
+    size_t cached_tail = 0;                     // Consumer's copy of tail
+    alignas(64) std::atomic<size_t> tail { 0 }; // Next free place, written by the producer
+    size_t cached_head = 0;                     // Producer's copy of head
+    alignas(64) std::atomic<bool> closed { false };
+};
+
+#endif // CHANNEL_H
@@ -0,0 +1,46 @@
+#ifndef CODE_CACHE_H
+#define CODE_CACHE_H
+
+#include <string>
+#include <vector>
+#include "processor.h"
+
+// Programs prepared for running, kept in a local directory between runs: the memory image
+// after loading (and optimization) and the starts of the blocks decoded by the block engine.
+// A run of the same program with the same options loads the image instead of parsing,
+// assembling and optimizing it, and decodes the blocks before starting
+class CodeCache final
+{
+public:
+    // Changed whenever the preparation of the programs or the cache format changes
+    static constexpr const char* VERSION = "VM9 cache 1";
+
+    // Prepared program
+    struct Entry
+    {
+        std::string image;            // Binary image with the entry address (see load_image in loader.h)
+        std::vector<uint16_t> blocks; // Starts of the decoded blocks
+    };
+
+    // The directory is created on the first store. Without a directory
+    // $XDG_CACHE_HOME/vm9 or ~/.cache/vm9 is used
+    explicit CodeCache(const std::string& directory = std::string());
+
+    // Key of the program file prepared with the options (FNV-1a of the VM version, the options and the file)
+    static uint64_t key(const std::string& file, const std::string& options) noexcept;
+
+    // Image of the program loaded into memory, words with nonzero cells only
+    static std::string image_of(const Memory& memory, uint16_t entry);
+
+    bool load(uint64_t key, Entry& entry) const;
+    bool store(uint64_t key, const Entry& entry) const;
+
+    const std::string& path() const noexcept { return directory; }
+
+private:
+    std::string directory;
+
+    std::string file_of(uint64_t key) const;
+};
+
+#endif // CODE_CACHE_H
@@ -2,12 +2,43 @@
 #define COMMAND_H
 
 #include <stdint.h>
+#include <array>
 #include <cmath>
+#include <utility>
 #include <iostream>
 
 class Processor;
 union Word;
 
+// Operation codes of the processor commands (index in Processor::commands)
+enum Opcode : uint8_t
+{
+    OP_HALT, OP_JMP, OP_JE, OP_JEU, OP_JEF, OP_JG, OP_JGU, OP_JGF, OP_JL, OP_JLU, OP_JLF,
+    OP_JNE, OP_JNEU, OP_JNEF, OP_JGE, OP_JGEU, OP_JGEF, OP_JLE, OP_JLEU, OP_JLEF,
+    OP_PRINT, OP_PRINTU, OP_PRINTF, OP_LOAD, OP_NEG, OP_NEGF, OP_CMP, OP_CMPU, OP_CMPF,
+    OP_ADD, OP_ADDF, OP_SUB, OP_SUBF, OP_MUL, OP_MULF, OP_DIVU, OP_DIV, OP_DIVF, OP_MODU, OP_MOD,
+    OP_INC, OP_DEC, OP_READ, OP_READU, OP_READF, OP_AND, OP_OR, OP_XOR, OP_NOT,
+    OP_LOADR, OP_LOADRV, OP_CALL, OP_LOADF, OP_SETF, OP_ENDP,
+    OP_SPAWN, OP_JOIN, OP_XADD, OP_CAS, OP_FENCE, OP_SEND, OP_RECV, OP_PUSHV, OP_POPV, OP_FRAME,
+    OPCODES_COUNT
+};
+
+// Breakpoint written over an instruction by the debugger while the program runs.
+// It has a handler but no mnemonic, so programs can't contain it
+constexpr uint8_t OP_BREAK = OPCODES_COUNT;
+
+// Mnemonics of the commands, indexed by operation code
+extern const char* const OPCODE_NAMES[OPCODES_COUNT];
+
+// Jump commands (unconditional and conditional) have codes 1 to 19
+inline bool is_jump(uint8_t cmd) noexcept { return cmd >= OP_JMP && cmd <= OP_JLEF; }
+
+// Commands of the data stack, PUSHV, POPV and FRAME
+inline bool is_stack_command(uint8_t cmd) noexcept { return cmd >= OP_PUSHV && cmd <= OP_FRAME; }
+
+// Commands working with other guests: SPAWN, JOIN, the atomic commands, the fence and the channels
+inline bool is_concurrent_command(uint8_t cmd) noexcept { return cmd >= OP_SPAWN && cmd <= OP_RECV; }
+
 // Base abstract command class
 class Command
 {
@@ -33,26 +64,20 @@ public:
 };
 
 
-// Printing the integer value pointed to by the address register
-class PrintCm : public Command
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+// Types of the values the commands work with
+enum class NumType : uint8_t { INT, UINT, FLOAT };
 
-// Print the unsigned integer value pointed to by the address register
-class PrintUCm : public Command
+// Printing the value of the type pointed to by the address register
+template <NumType T>
+class PrintValueCm final : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Printing the fractional value pointed to by the address register
-class PrintFCm : public Command
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+using PrintCm = PrintValueCm<NumType::INT>;
+using PrintUCm = PrintValueCm<NumType::UINT>;
+using PrintFCm = PrintValueCm<NumType::FLOAT>;
 
 
 // Abstract class for arithmetic operations
@@ -61,109 +86,59 @@ class ArithCm : public Command
 public:
     virtual void operator()(Word word, Processor& proc) const noexcept = 0;
 
-    // Addition with setting flags (for subtraction, pass the argument is_sub = true)
-    Word add_int_check_overflow(uint8_t reg1, uint8_t reg2, Processor& proc, bool is_sub = false) const noexcept;
-    Word add_float_check_overflow(uint8_t reg1, uint8_t reg2, Processor& proc, bool is_sub = false) const noexcept;
-
-    // Multiplying with setting flags
-    Word mul_int_check_overflow(uint8_t reg1, uint8_t reg2, Processor& proc) const noexcept;
-    Word mul_float_check_overflow(uint8_t reg1, uint8_t reg2, Processor& proc) const noexcept;
-
     // Increment and decrement with setting flags
     Word inc_check_overflow(Word word, Processor& proc) const noexcept;
     Word dec_check_overflow(Word word, Processor& proc) const noexcept;
 };
 
-// Addition of integers
-class AddCm : public ArithCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
-
-// Adding fractions
-class AddFCm : public ArithCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+// Arithmetic operations with two operands
+enum class ArithOp : uint8_t { ADD, SUB, MUL, DIV, MOD };
 
-// Subtracting Integers
-class SubCm : public ArithCm
+// Arithmetic command reg1 = reg2 op reg3 specialized on the operation and the type,
+// so the overflow and flag checks are chosen at compile time
+template <ArithOp Op, NumType T>
+class BinaryCm final : public ArithCm
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Subtracting fractions
-class SubFCm : public ArithCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+using AddCm = BinaryCm<ArithOp::ADD, NumType::INT>;
+using AddFCm = BinaryCm<ArithOp::ADD, NumType::FLOAT>;
+using SubCm = BinaryCm<ArithOp::SUB, NumType::INT>;
+using SubFCm = BinaryCm<ArithOp::SUB, NumType::FLOAT>;
+using MulCm = BinaryCm<ArithOp::MUL, NumType::INT>;
+using MulFCm = BinaryCm<ArithOp::MUL, NumType::FLOAT>;
+using DivUCm = BinaryCm<ArithOp::DIV, NumType::UINT>;
+using DivCm = BinaryCm<ArithOp::DIV, NumType::INT>;
+using DivFCm = BinaryCm<ArithOp::DIV, NumType::FLOAT>;
+using ModUCm = BinaryCm<ArithOp::MOD, NumType::UINT>;
+using ModCm = BinaryCm<ArithOp::MOD, NumType::INT>;
 
-// Multiplying Integers
-class MulCm : public ArithCm
+// Fraction arithmetic of the fast float mode: a single host operation without flags.
+// The IEEE exceptions it raises are turned into flags by Processor::collect_float_exceptions
+template <ArithOp Op>
+class FastFloatCm final : public ArithCm
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Multiplying fractions
-class MulFCm : public ArithCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
-
-// Division of unsigned integers
-class DivUCm : public ArithCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
-
-// Dividing signed integers
-class DivCm : public ArithCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
-
-// Division of fractional numbers
-class DivFCm : public ArithCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
-
-// Taking the remainder when dividing signed integers
-class ModCm : public ArithCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
-
-// Taking the remainder of division of unsigned integers
-class ModUCm : public ArithCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+using FastAddFCm = FastFloatCm<ArithOp::ADD>;
+using FastSubFCm = FastFloatCm<ArithOp::SUB>;
+using FastMulFCm = FastFloatCm<ArithOp::MUL>;
+using FastDivFCm = FastFloatCm<ArithOp::DIV>;
 
 // Sign conversion
-class NegCm : public ArithCm
+template <NumType T>
+class NegateCm final : public ArithCm
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Fractional sign conversion
-class NegFCm : public ArithCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+using NegCm = NegateCm<NumType::INT>;
+using NegFCm = NegateCm<NumType::FLOAT>;
 
 // Increment
 class IncCm : public ArithCm
@@ -180,24 +155,21 @@ public:
 };
 
 
-// Comparison of signed integers
-class CmpCm : public Command
+// Comparison of the values of the type, sets the equality and "greater" flags of the type
+template <NumType T>
+class CompareCm final : public Command
 {
+public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
+using CmpCm = CompareCm<NumType::INT>;
+using CmpUCm = CompareCm<NumType::UINT>;
+using CmpFCm = CompareCm<NumType::FLOAT>;
 
-// Comparison without signed integers
-class CmpUCm : public Command
-{
-    void operator()(Word word, Processor& proc) const noexcept;
-};
 
-// Comparison of fractional numbers
-class CmpFCm : public Command
-{
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+// Jump addressing modes (regs[0] of the command). JUMP_ANY takes the mode from the command
+enum JumpMode : uint8_t { JUMP_DIRECT, JUMP_MEMORY, JUMP_REGISTERS, JUMP_RELATIVE, JUMP_ANY };
 
 // Abstract class for jump commands
 class TransCm : public Command
@@ -209,236 +181,288 @@ public:
     uint16_t calc_instraction_pointer(Word word, Processor& proc) const noexcept;
 };
 
-// Unconditional jump command
-class JumpCm : public TransCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+// Conditions of the jumps on the flags set by CMP, CMPU and CMPF
+enum class JumpCond : uint8_t { ALWAYS, EQ, GT, LT, NE, GE, LE };
+
+// Jump command specialized on the condition, the type of the compared values and the addressing mode
+template <JumpCond C, NumType T, JumpMode M = JUMP_ANY>
+class JumpIfCm final : public TransCm
+{
+public:
+    void operator()(Word word, Processor& proc) const noexcept;
+};
 
-// Signed conditional jump command val1 == val2
-class JEqCm : public TransCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
+// Condition and type of the jump commands by operation code
+struct JumpKind
+{
+    JumpCond cond;
+    NumType type;
 };
 
-// Conditional jump command for unsigned val1 == val2
-class JEqUCm : public TransCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+constexpr JumpKind JUMP_KINDS[OP_JLEF + 1] = {
+    { JumpCond::ALWAYS, NumType::INT }, // HALT, not a jump
+    { JumpCond::ALWAYS, NumType::INT },
+    { JumpCond::EQ, NumType::INT }, { JumpCond::EQ, NumType::UINT }, { JumpCond::EQ, NumType::FLOAT },
+    { JumpCond::GT, NumType::INT }, { JumpCond::GT, NumType::UINT }, { JumpCond::GT, NumType::FLOAT },
+    { JumpCond::LT, NumType::INT }, { JumpCond::LT, NumType::UINT }, { JumpCond::LT, NumType::FLOAT },
+    { JumpCond::NE, NumType::INT }, { JumpCond::NE, NumType::UINT }, { JumpCond::NE, NumType::FLOAT },
+    { JumpCond::GE, NumType::INT }, { JumpCond::GE, NumType::UINT }, { JumpCond::GE, NumType::FLOAT },
+    { JumpCond::LE, NumType::INT }, { JumpCond::LE, NumType::UINT }, { JumpCond::LE, NumType::FLOAT } };
 
-// Conditional jump command for fractional numbers val1 == val2
-class JEqFCm : public TransCm
+// Condition of a jump as a truth table of the two flags of the compared type:
+// the flags are shifted to bits 0 (equality) and 1 ("greater"), and the bit of the table
+// at this index tells if the jump is taken. So any condition is checked without branches
+struct JumpMask
 {
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
+    uint8_t shift;
+    uint8_t table;
 };
 
-// Signed conditional jump command val1 > val2
-class JGrCm : public TransCm
+constexpr JumpMask jump_mask(JumpKind kind) noexcept
 {
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+    uint8_t table = 0;
+    for (uint8_t flags = 0; flags < 4; flags++)
+    {
+        bool equal = flags & 1, greater = flags & 2, taken = true;
+        switch (kind.cond)
+        {
+        case JumpCond::ALWAYS: taken = true; break;
+        case JumpCond::EQ: taken = equal; break;
+        case JumpCond::NE: taken = !equal; break;
+        case JumpCond::GT: taken = kind.type == NumType::FLOAT ? !equal && greater : greater; break;
+        case JumpCond::LT: taken = !equal && !greater; break;
+        case JumpCond::GE: taken = greater || equal; break;
+        case JumpCond::LE: taken = !greater; break;
+        }
+        table |= taken << flags;
+    }
+    return JumpMask { uint8_t(2 + 2 * uint8_t(kind.type)), table };
+}
 
-// Unsigned conditional jump command val1 > val2
-class JGrUCm : public TransCm
+template <size_t... Cmd>
+constexpr std::array<JumpMask, sizeof...(Cmd)> make_jump_masks(std::index_sequence<Cmd...>) noexcept
 {
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+    return { { jump_mask(JUMP_KINDS[Cmd])... } };
+}
 
-// Conditional fractional transition command val1 > val2
-class JGrFCm : public TransCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+// Conditions of the jump commands by operation code
+constexpr std::array<JumpMask, OP_JLEF + 1> JUMP_MASKS = make_jump_masks(std::make_index_sequence<OP_JLEF + 1>());
 
-// Signed conditional jump command val1 < val2
-class JLsCm : public TransCm
+inline bool jump_taken(JumpMask mask, uint16_t flags) noexcept
 {
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+    return (mask.table >> ((flags >> mask.shift) & 3)) & 1;
+}
 
-// Unsigned conditional jump instruction val1 < val2
-class JLsUCm : public TransCm
+// Flags the condition depends on: the ones whose change flips a bit of the table
+constexpr uint16_t jump_flags(JumpMask mask) noexcept
 {
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+    uint16_t flags = 0;
+    for (uint8_t bit = 0; bit < 2; bit++)
+        for (uint8_t index = 0; index < 4; index++)
+            if (((mask.table >> index) ^ (mask.table >> (index ^ (1 << bit)))) & 1) flags |= 1 << (mask.shift + bit);
+    return flags;
+}
 
-// Conditional fractional jump command val1 < val2
-class JLsFCm : public TransCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+// Jump command of the operation code
+template <uint8_t Cmd, JumpMode M = JUMP_ANY>
+using JumpOpCm = JumpIfCm<JUMP_KINDS[Cmd].cond, JUMP_KINDS[Cmd].type, M>;
 
-// Signed conditional jump command val1 != val2
-class JNEqCm : public TransCm
-{
-public:
-    void operator()(Word word, Processor& proc) const noexcept;
-};
+using JumpCm = JumpOpCm<OP_JMP>;
+using JEqCm = JumpOpCm<OP_JE>;
+using JEqUCm = JumpOpCm<OP_JEU>;
+using JEqFCm = JumpOpCm<OP_JEF>;
+using JGrCm = JumpOpCm<OP_JG>;
+using JGrUCm = JumpOpCm<OP_JGU>;
+using JGrFCm = JumpOpCm<OP_JGF>;
+using JLsCm = JumpOpCm<OP_JL>;
+using JLsUCm = JumpOpCm<OP_JLU>;
+using JLsFCm = JumpOpCm<OP_JLF>;
+using JNEqCm = JumpOpCm<OP_JNE>;
+using JNEqUCm = JumpOpCm<OP_JNEU>;
+using JNEqFCm = JumpOpCm<OP_JNEF>;
+using JGEqCm = JumpOpCm<OP_JGE>;
+using JGEqUCm = JumpOpCm<OP_JGEU>;
+using JGEqFCm = JumpOpCm<OP_JGEF>;
+using JLEqCm = JumpOpCm<OP_JLE>;
+using JLEqUCm = JumpOpCm<OP_JLEU>;
+using JLEqFCm = JumpOpCm<OP_JLEF>;
+
+// Jump command specialized on the addressing mode of the instruction, for decoders choosing
+// a handler per instruction. Returns nullptr if the instruction isn't a jump
+const Command* jump_command(Word word) noexcept;
 
-// Conditional jump command for unsigned val1 != val2
-class JNEqUCm : public TransCm
+
+// Command to read a value of the type from the console
+template <NumType T>
+class ReadValueCm final : public Command
+{
+public:
+    void operator()(Word word, Processor& proc) const noexcept;
+};
+
+using ReadCm = ReadValueCm<NumType::INT>;
+using ReadUCm = ReadValueCm<NumType::UINT>;
+using ReadFCm = ReadValueCm<NumType::FLOAT>;
+
+
+// Abstract class for bitwise operations
+class BitCm : public Command
 {
 public:
-    void operator()(Word word, Processor& proc) const noexcept;
+    virtual void operator()(Word word, Processor& proc) const noexcept = 0;
 };
 
-// Conditional jump command for fractional numbers val1 != val2
-class JNEqFCm : public TransCm
+// Bitwise AND instruction
+class AndCm : public BitCm
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Signed conditional jump command val1 >= val2
-class JGEqCm : public TransCm
+// Bitwise OR instruction
+class OrCm : public BitCm
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Conditional jump command for unsigned val1 >= val2
-class JGEqUCm : public TransCm
+// Bitwise Exclusive OR Instruction
+class XorCm : public BitCm
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Conditional fractional jump command val1 >= val2
-class JGEqFCm : public TransCm
+// Bitwise NOT instruction
+class NotCm : public BitCm
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Signed conditional jump command val1 <= val2
-class JLEqCm : public TransCm
+// Command to load address from register 2 directly into register 1
+class LoadRCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Unsigned conditional jump instruction val1 <= val2
-class JLEqUCm : public TransCm
+// The instruction to load the value pointed to by register 2 there
+// where register 1 points to
+class LoadRVCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Conditional fractional jump command val1 <= val2
-class JLEqFCm : public TransCm
+// A command to load a flag into the memory location pointed to by a register
+class LoadF : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-
-// Command to read a signed integer from the console
-class ReadCm : public Command
+// Command to load a flag from a register
+class SetF : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Command to read unsigned integer from console
-class ReadUCm : public Command
+
+// Calling a subroutine
+class CallCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Command to read unsigned integer from console
-class ReadFCm : public Command
+// Returning from a subroutine
+class EndpCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
 
-// Abstract class for bitwise operations
-class BitCm : public Command
+// Starting a guest thread at the address, its id is written where the register points
+class SpawnCm : public Command
 {
 public:
-    virtual void operator()(Word word, Processor& proc) const noexcept = 0;
+    void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Bitwise AND instruction
-class AndCm : public BitCm
+// Waiting for the guest thread with the id pointed to by the register to halt
+class JoinCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Bitwise OR instruction
-class OrCm : public BitCm
+// Atomic addition of the value pointed to by register 3 to the word pointed to by register 2,
+// the previous value of the word goes where register 1 points
+class FetchAddCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Bitwise Exclusive OR Instruction
-class XorCm : public BitCm
+// Atomic compare and swap: if the word pointed to by register 1 equals the value pointed to by
+// register 2, it gets the value pointed to by register 3. Otherwise its current value goes
+// where register 2 points. The equality flag of CMP tells if the word was swapped
+class CompareSwapCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Bitwise NOT instruction
-class NotCm : public BitCm
+// Memory fence: the memory accesses before it are seen by the other guest threads before the ones after it
+class FenceCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Command to load address from register 2 directly into register 1
-class LoadRCm : public Command
+// Sending the words from the address in register 2 into the channel of the port (regs[0]),
+// their number is pointed to by register 3. Waits while the channel is full
+class SendCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// The instruction to load the value pointed to by register 2 there
-// where register 1 points to
-class LoadRVCm : public Command
+// Receiving up to the number of words pointed to by register 3 from the channel of the port
+// to the address in register 2. Waits for at least one word and writes the number of the
+// received ones where register 3 points, 0 after the end of the channel
+class RecvCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// A command to load a flag into the memory location pointed to by a register
-class LoadF : public Command
+// Pushing the word pointed to by the register onto the data stack
+class PushValueCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Command to load a flag from a register
-class SetF : public Command
+// Moving the word from the top of the data stack to where the register points
+class PopValueCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-
-// Calling a subroutine
-class CallCm : public Command
+// Loading the address of the frame pointer plus the signed offset into the address register
+class FrameCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
 };
 
-// Returning from a subroutine
-class EndpCm : public Command
+// Breakpoint of the debugger: stops the processor with the Instruction Pointer at it
+class BreakCm : public Command
 {
 public:
     void operator()(Word word, Processor& proc) const noexcept;
@@ -0,0 +1,88 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <signal.h>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "processor.h"
+
+// Debugger of the program loaded into a processor, driven by text commands (see run).
+// Breakpoints are BREAK commands written over the instructions only while the program runs,
+// so the interpreter runs at full speed between them and the memory never shows them.
+// Watched words get host pages of their own, protected from writes while the program runs:
+// a write into such a page faults, the fault handler lets it complete and stops the processor
+// after the command. Only the writes into the pages of watched words are slowed down
+class Debugger final
+{
+public:
+    // Why the program stopped
+    enum class Stop { STEP, BREAKPOINT, WATCHPOINT, HALT, TRAP };
+
+    Debugger(Processor& proc, uint16_t entry) noexcept;
+
+    Debugger(const Debugger&) = delete;
+    Debugger& operator=(const Debugger&) = delete;
+
+    // Label usable instead of an address in the commands
+    void add_label(const std::string& name, uint16_t address);
+
+    bool set_breakpoint(uint16_t address);
+    bool remove_breakpoint(uint16_t address);
+    // Watching the word at the address for changes
+    bool watch(uint16_t address);
+    bool unwatch(uint16_t address);
+
+    // Executing up to count commands, or running to a breakpoint, a change of a watched word or a halt
+    Stop step(size_t count);
+    Stop resume();
+
+    // Commands, one per line, until quit or the end of the input. An empty line repeats the last command:
+    //     break ADDR, delete ADDR     setting and removing a breakpoint
+    //     watch ADDR, unwatch ADDR    watching a word for changes
+    //     step [N], continue          running
+    //     regs [FIRST [LAST]]         address registers (the nonzero ones by default) and the words they point to
+    //     mem FIRST [LAST]            cells
+    //     word ADDR                   a word as a signed, unsigned and fraction number
+    //     flags, where, list [ADDR [N]], quit
+    // Addresses are numbers or labels
+    void run(std::istream& commands, std::ostream& out);
+
+private:
+    struct WatchedPage
+    {
+        Memory::Page* host;
+        uint16_t first; // Address of the first cell
+    };
+
+    Processor& proc;
+    size_t page_size; // Of the host mapping of a watched page
+    bool halted = false;
+    std::map<uint16_t, Word> breakpoints; // Instructions under the breakpoints
+    std::map<uint16_t, uint32_t> watched; // Last value of every watched word
+    std::vector<WatchedPage> pages;
+    uint16_t changed = 0; // Watched word that stopped the program
+    uint32_t previous = 0; // Its value before
+    std::map<std::string, uint16_t> labels;
+    std::map<uint16_t, std::string> label_at;
+    struct sigaction previous_action;
+
+    Stop execute(bool single);
+    Stop finished() const noexcept;
+    bool watched_changed();
+    void insert_breakpoints();
+    void remove_breakpoints();
+    void protect(bool enabled);
+    static void on_fault(int signal, siginfo_t* info, void* context);
+
+    bool parse_address(const std::string& text, uint16_t& address) const;
+    std::string describe(uint16_t address) const;
+    void report(Stop stop, std::ostream& out) const;
+    void print_registers(std::ostream& out, int first, int last) const;
+    void print_flags(std::ostream& out) const;
+    void print_stack(std::ostream& out) const;
+    void list(std::ostream& out, uint16_t address, size_t count) const;
+};
+
+#endif // DEBUGGER_H
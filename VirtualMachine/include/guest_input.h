@@ -0,0 +1,32 @@
+#ifndef GUEST_INPUT_H
+#define GUEST_INPUT_H
+
+#include <string>
+#include "command.h"
+#include "types.h"
+
+// Console input of a guest that is filled by the host as the data arrives.
+// READ takes the next value from it or, if the value isn't complete yet,
+// stops the processor with Trap::NEEDS_INPUT. The values are parsed like std::cin does:
+// after the end of the data or a wrong value every READ gets 0
+class GuestInput final
+{
+public:
+    void append(const char* data, size_t size);
+
+    // No more data will be appended
+    void close() noexcept { closed = true; }
+    bool is_closed() const noexcept { return closed; }
+
+    // Taking the next value. False if it may continue in the data not received yet
+    template <NumType T>
+    bool read(Word& value) noexcept;
+
+private:
+    std::string buffer;
+    size_t position = 0; // First character not parsed yet
+    bool closed = false;
+    bool failed = false; // The end of the data or a wrong value was read
+};
+
+#endif // GUEST_INPUT_H
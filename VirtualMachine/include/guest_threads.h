@@ -0,0 +1,52 @@
+#ifndef GUEST_THREADS_H
+#define GUEST_THREADS_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "processor.h"
+
+// Guest hardware threads started by SPAWN. Every thread is a processor with its own Instruction
+// Pointer, flags and call stack, the address registers copied from the spawning thread and the
+// memory shared with it, run in the interpreter by a host thread. Thread ids start at 1.
+// The data stack of thread N starts N * THREAD_STACK cells below the end of memory
+class GuestThreads final
+{
+public:
+    static constexpr size_t MAX_THREADS = 256; // Started during a run
+    static constexpr uint32_t THREAD_STACK = 256;
+
+    GuestThreads() = default;
+    ~GuestThreads();
+
+    GuestThreads(const GuestThreads&) = delete;
+    GuestThreads& operator=(const GuestThreads&) = delete;
+
+    // Starting a thread at the address. Returns its id, 0 if MAX_THREADS were already started
+    uint32_t spawn(const Processor& parent, uint16_t address);
+
+    // Waiting for the thread to halt, unknown ids return at once
+    void join(uint32_t id);
+
+    // Waiting for all threads, including the ones they start
+    void join_all();
+
+    // Threads stopped by a trap (see Processor::Trap)
+    size_t failed();
+
+private:
+    struct Thread
+    {
+        std::unique_ptr<Processor> proc;
+        std::thread host;
+        bool done = false;
+    };
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::vector<std::unique_ptr<Thread>> threads;
+};
+
+#endif // GUEST_THREADS_H
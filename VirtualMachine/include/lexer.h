@@ -0,0 +1,55 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Position and description of an error in the bytecode text
+struct ParseError
+{
+    size_t line;
+    size_t column;
+    const char* message;
+};
+
+// Significant line of the bytecode text: the mark and its numeric fields
+struct BytecodeLine
+{
+    static constexpr int MAX_VALUES = 4; // Command code and three registers
+
+    char mark;                   // 'a', 'e', 'i', 'u', 'f' or 'k'
+    uint8_t count;               // Number of fields after the mark
+    int64_t values[MAX_VALUES];  // Integer fields
+    float fval;                  // Value of an 'f' variable
+    size_t line;                 // Line number (from 1)
+    size_t columns[MAX_VALUES];  // Columns of the fields (from 1)
+};
+
+// Single pass lexer over the whole text of a bytecode file.
+// Doesn't allocate memory: numbers are converted in place by std::from_chars
+class Lexer final
+{
+public:
+    Lexer(const char* begin, const char* end) noexcept;
+
+    // Reading the next line with a mark. Returns false at the end of the text or on an error
+    bool next(BytecodeLine& line) noexcept;
+
+    bool failed() const noexcept { return has_error; }
+    const ParseError& error() const noexcept { return error_; }
+
+private:
+    const char* pos;
+    const char* end;
+    const char* line_start;
+    size_t line_number;
+    bool has_error;
+    ParseError error_;
+
+    bool fail(const char* at, const char* message) noexcept;
+    bool fail_field(const BytecodeLine& line, int field, const char* message) noexcept;
+    bool check_fields(const BytecodeLine& line) noexcept;
+    void skip_line() noexcept;
+};
+
+#endif // LEXER_H
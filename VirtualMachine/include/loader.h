@@ -1,23 +1,41 @@
 #ifndef LOADER_H
 #define LOADER_H
 
-#include <sstream>
 #include <fstream>
 #include <iostream>
+#include <string>
 #include <vector>
 #include "processor.h"
+#include "lexer.h"
 
-// Splitting a string into pieces separated by a space
-std::vector<std::string> split(const std::string& line) noexcept;
+// Parsing a line with memory allocation for a variable
+void parse_variable(const BytecodeLine& line, uint16_t adrs, Processor& cpu) noexcept;
 
-// Parsing a string with memory allocation for a variable
-void parse_variable(std::vector<std::string>& parts, uint16_t adrs, Processor& cpu) noexcept;
+// Parsing a line with command
+Word parse_command(const BytecodeLine& line) noexcept;
 
-// Parsing strings with command
-Word parse_command(std::vector<std::string>& parts, Processor& cpu) noexcept;
+// Writing a line into memory. Returns false if the line doesn't occupy memory
+bool parse_line_parts(const BytecodeLine& line, uint16_t address, Processor& cpu) noexcept;
 
-// Parsing all strings
-bool parse_line_parts(std::vector<std::string>& parts, uint16_t address, Processor& cpu) noexcept;
+// Number of host threads loading the texts of 1 MB and more, 0 for one per CPU
+void set_load_threads(size_t threads) noexcept;
+
+// Loading a program from the bytecode text. Returns false and fills the error on invalid text
+bool load_text(Processor& cpu, const char* begin, const char* end, uint16_t& run_address, ParseError& error) noexcept;
+
+// Loading a program from a binary image written by the assembler (see AssembledProgram::write_binary).
+// The error column is the offset of the invalid byte
+bool load_image(Processor& cpu, const char* begin, const char* end, uint16_t& run_address, ParseError& error) noexcept;
+
+// Reading a whole file. Returns false if it cannot be opened or isn't a regular file
+bool read_file(const char* filename, std::string& contents) noexcept;
+
+// Loading a program (text or binary image) into memory without running it.
+// Returns false if the file cannot be opened or parsed
+bool load_program(Processor& cpu, const char* filename, uint16_t& run_address) noexcept;
+
+// Address after the last cell of the memory that isn't zero, the lowest one the data stack may use
+uint32_t program_end(const Memory& memory) noexcept;
 
 // Function that implements the bootloader
 void load(Processor& cpu, char* filename) noexcept;
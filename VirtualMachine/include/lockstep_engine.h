@@ -0,0 +1,82 @@
+#ifndef LOCKSTEP_ENGINE_H
+#define LOCKSTEP_ENGINE_H
+
+#include <iostream>
+#include <vector>
+#include "processor.h"
+
+// Execution engine running up to LANES copies of one program on different inputs at once.
+// The memories of the copies (lanes) are interleaved cell by cell and every lane has its own
+// flags, so a command is fetched and dispatched once and executed by a loop over the lanes
+// that the compiler turns into vector instructions.
+//
+// Lanes following the same path form a group sharing the Instruction Pointer, the address
+// registers and the data stack pointers (they change the same way in all lanes of the group). A conditional jump taken by
+// some lanes only, a jump through memory to different targets or different code written by the
+// lanes split the group. The group with the lowest Instruction Pointer runs first, and groups
+// coming to the same command with the same registers are merged again.
+//
+// Differences from Processor::run: the call stack is always simulated by registers, fraction
+// arithmetic is always checked (no fast float mode), and an integer division by zero gives 0
+// in the lane instead of stopping the host
+class LockstepEngine final
+{
+public:
+    static constexpr int LANES = 8;
+
+    // Input of READ and output of PRINT of a lane
+    struct Lane
+    {
+        std::istream* input;
+        std::ostream* output;
+    };
+
+    // Every run starts the lanes with the memory of the loaded program
+    explicit LockstepEngine(const Memory& image);
+
+    // Running the program in the lanes (at most LANES) until all of them halt
+    void run(uint16_t start_address, const std::vector<Lane>& lanes);
+
+    // Commands executed by all runs: dispatched once for a group, and by all lanes
+    uint64_t steps = 0;
+    uint64_t lane_steps = 0;
+
+private:
+    // Lanes at the same command
+    struct Group
+    {
+        uint16_t ip;
+        uint8_t sp;
+        uint32_t lanes; // Bit mask
+        uint16_t regs[Processor::ADDRESS_REGS];
+        uint16_t data_sp, frame; // Data stack and frame pointer (see Processor::push_value)
+        uint16_t saved_frames[Processor::ADDRESS_REGS - Processor::START_STACK];
+    };
+
+    const Memory& image;
+    std::vector<uint16_t> cells; // Cell of the lane at address * LANES + lane
+    uint16_t flags[LANES];
+    Lane lane_io[LANES];
+
+    Group current;
+    uint16_t active[LANES];   // 0xFFFF for the lanes of the current group, 0 for the others
+    std::vector<Group> waiting;
+    uint32_t stop;            // Lowest Instruction Pointer of the waiting groups above the current one
+
+    void load(uint16_t address, Word (&values)[LANES]) const noexcept;
+    void store(uint16_t address, const Word (&values)[LANES]) noexcept;
+    void set_flags(uint16_t changed, const uint16_t (&values)[LANES]) noexcept;
+
+    template <class Op>
+    void binary(Word word, uint16_t changed, Op op) noexcept;
+    template <class Op>
+    void unary(Word word, uint8_t target, uint16_t changed, Op op) noexcept;
+
+    bool fetch(Word& word);
+    void execute(Word word);
+    void jump(Word word);
+    bool split(const uint32_t (&keys)[LANES], bool jump);
+    bool schedule(bool keep_current);
+};
+
+#endif // LOCKSTEP_ENGINE_H
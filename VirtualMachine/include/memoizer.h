@@ -0,0 +1,72 @@
+#ifndef MEMOIZER_H
+#define MEMOIZER_H
+
+#include <iostream>
+#include <vector>
+#include "purity.h"
+#include "processor.h"
+
+// Results of the pure subroutines of a program (see analyze_subroutines), used by CALL and ENDP
+// of a processor pointing to it. A CALL of a pure subroutine looks up its input words and flags
+// in the cache of the subroutine: on a hit the output words, the registers and the flags are set
+// as the call would set them and the subroutine isn't run. Otherwise the outputs are stored
+// at its ENDP. Every subroutine has CACHE_SLOTS results, a new one replaces the one in its slot.
+// A call with the frame making a word of the subroutine overlap a word at a fixed address of any
+// pure subroutine runs without the cache, and so do the calls it's nested in. The code of the pure
+// subroutines is watched in the memory: once it changes, the caches are dropped for the rest of the run
+class Memoizer final
+{
+public:
+    static constexpr size_t CACHE_SLOTS = 4096;
+
+    Memoizer(Memory& memory, uint16_t entry, bool fast_float);
+
+    Memoizer(const Memoizer&) = delete;
+    Memoizer& operator=(const Memoizer&) = delete;
+
+    // Called by CALL before the return address is pushed. Returns true if the call was
+    // answered from the cache, so the subroutine mustn't be run
+    bool call(Processor& proc, uint16_t target) noexcept;
+    // Called by ENDP after the return
+    void returned(Processor& proc) noexcept;
+
+    // Subroutines with the reasons they aren't pure, the calls and the hits
+    void print(std::ostream& out) const;
+
+private:
+    struct Subroutine
+    {
+        SubroutineEffects effects;
+        size_t key_size; // The flags, the input words and the registers kept on some paths
+        size_t stride; // Words of a slot: the used mark, the key, the output words, the flags and the registers
+        std::vector<uint16_t> frame_words; // Offsets of the words relative to the frame
+        std::vector<uint32_t> slots; // Allocated with the first result
+        uint64_t calls = 0, hits = 0;
+    };
+
+    // Call of a pure subroutine not found in the cache, running now
+    struct Running
+    {
+        int subroutine;
+        uint16_t frame;
+        size_t depth; // Of the calls in the processor before it
+        size_t key; // Position in keys
+        size_t slot;
+        bool stored; // False if a nested call ran without the cache
+    };
+
+    std::vector<Subroutine> subroutines;
+    std::vector<int> by_entry; // Index of the pure subroutine by address, -1 for the others
+    std::vector<bool> fixed_cells; // Of the words at fixed addresses of the pure subroutines
+    std::vector<Running> running;
+    std::vector<uint32_t> keys; // Of the running calls
+    size_t depth = 0;
+    std::vector<std::pair<uint16_t, uint16_t>> code; // Cells of the pure subroutines with their values
+    uint64_t code_writes; // Of the memory when the code was compared last
+    bool code_changed = false;
+
+    bool overlaps(const Subroutine& sub, uint16_t frame) const noexcept;
+    void check_code(const Memory& memory) noexcept;
+};
+
+#endif // MEMOIZER_H
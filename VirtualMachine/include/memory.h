@@ -3,33 +3,172 @@
 
 #include "types.h"
 #include <iostream>
-#include <bitset>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+class PageArena;
 
 // According to the laboratory work assignment option:
 // Word - 32 bit
 // Memory cell size - 16 bits
+//
+// The whole 16-bit address space is covered by a two-level page table. Pages are allocated
+// on the first write, all other addresses read the shared zero page, so a small program
+// takes a few pages only. A word at the last address continues at address 0.
+//
+// Guest threads share one memory: the pages are published by a compare and swap of the
+// table entries, so threads writing to a new page at once allocate it without a lock
 class Memory final
 {
 public:
-    static constexpr uint32_t MEM_SIZE = 32768;
+    static constexpr uint32_t MEM_SIZE = 65536;
+    static constexpr uint32_t PAGE_SIZE = 256;   // Cells in a page
+    static constexpr uint32_t TABLE_SIZE = 16;   // Pages in a page table
+    static constexpr uint32_t TABLES = MEM_SIZE / (PAGE_SIZE * TABLE_SIZE);
+
+    // Cells with one mark bit per cell for the decoded instructions
+    struct Page
+    {
+        uint16_t cells[PAGE_SIZE];
+        uint64_t code_marks[PAGE_SIZE / 64];
+    };
+
+    struct PageTable
+    {
+        Page* pages[TABLE_SIZE];
+    };
 
-    Memory();
+    // Pages are taken from the arena if there is one (and from the heap when it's exhausted)
+    explicit Memory(PageArena* arena = nullptr) noexcept;
     ~Memory();
 
-    void clear();
+    Memory(const Memory&) = delete;
+    Memory& operator=(const Memory&) = delete;
+
+    // Returning all pages, the whole memory reads as zeros again
+    void clear() noexcept;
 
     // Setting a word in memory by address
-    void set_word(uint16_t address, Word word);
-    void set_word(uint16_t address, uint16_t word_part1, uint16_t word_part2);
+    void set_word(uint16_t address, Word word)
+    {
+        set_cell(address, word.cells[0]);
+        set_cell(address + 1, word.cells[1]);
+    }
+    void set_word(uint16_t address, uint16_t word_part1, uint16_t word_part2)
+    {
+        set_cell(address, word_part1);
+        set_cell(address + 1, word_part2);
+    }
 
     // Getting a word in memory by address
-    Word get_word(uint16_t address) const noexcept;
+    Word get_word(uint16_t address) const noexcept
+    {
+        Word word = Word();
+        const Page* first = page(address);
+        uint32_t offset = address % PAGE_SIZE;
+        word.cells[0] = first->cells[offset];
+        word.cells[1] = offset + 1 < PAGE_SIZE ? first->cells[offset + 1] : page(address + 1)->cells[0];
+        return word;
+    }
+
+    // Atomic operations on a word for the guest threads. A word at an even address is changed
+    // by one host atomic instruction, a word at an odd address (not aligned) under a lock
+    uint32_t fetch_add(uint16_t address, uint32_t value);
+    bool compare_exchange(uint16_t address, uint32_t& expected, uint32_t desired);
 
     // Displaying the values ​​of memory cells
-    void print_memory(uint16_t first, uint16_t last) const noexcept;
+    void print_memory(uint16_t first, uint16_t last, std::ostream& out = std::cout) const noexcept;
+
+    // Moving the page holding the address into host pages of its own (allocating it first if nothing
+    // was written there), so the debugger can protect it with mprotect. Returns the page, nullptr on failure
+    Page* isolate_page(uint16_t address);
+    static size_t isolated_size() noexcept; // Size of the host mapping of an isolated page
+
+    // Marking the cells holding decoded instructions. Writing into them sets the code_written flag
+    void mark_code(uint16_t first, uint16_t last);
+    // Marking cells that stay marked after clear_code_marks, for the code that must not change during the run
+    void watch_code(uint16_t first, uint16_t last);
+    void clear_code_marks() noexcept;
+    bool code_written = false;
+    uint64_t code_writes = 0; // Writes into the marked cells, not reset by clear_code_marks
+
+    // Pages allocated for the written cells
+    size_t allocated_pages() const noexcept { return pages_count; }
+
+private:
+    static Page ZERO_PAGE;       // Read for every cell that wasn't written
+    static PageTable ZERO_TABLE; // Table of zero pages
+
+    PageTable* tables[TABLES];
+    PageArena* arena;
+    size_t pages_count = 0;
+    std::vector<Page*> isolated; // Pages mapped by isolate_page
+    std::vector<std::pair<uint16_t, uint16_t>> watched; // Ranges marked by watch_code
+
+    Page* page(uint16_t address) const noexcept
+    {
+        const PageTable* table = __atomic_load_n(&tables[address / (PAGE_SIZE * TABLE_SIZE)], __ATOMIC_ACQUIRE);
+        return __atomic_load_n(&table->pages[address / PAGE_SIZE % TABLE_SIZE], __ATOMIC_ACQUIRE);
+    }
+
+    void set_cell(uint16_t address, uint16_t value)
+    {
+        Page* target = writable_page(address);
+        uint32_t offset = address % PAGE_SIZE;
+        target->cells[offset] = value;
+        if (is_code(target, offset)) write_code();
+    }
+    void write_code() noexcept
+    {
+        code_written = true;
+        code_writes++;
+    }
+
+    Page* allocate_page(uint16_t address);
+    Page* writable_page(uint16_t address);
+    bool is_code(const Page* target, uint32_t offset) const noexcept
+    {
+        return (target->code_marks[offset / 64] >> (offset % 64)) & 1;
+    }
+    void* allocate_block(size_t size);
+    void free_block(void* block) noexcept;
+};
+
+// Blocks for the pages of many memories in one mapping, with huge pages when the system has them.
+// The mapping is used from the start, so its untouched part takes no physical memory.
+// Blocks are handed out zeroed
+class PageArena final
+{
+public:
+    static constexpr size_t BLOCK_SIZE = sizeof(Memory::Page);
+
+    explicit PageArena(size_t blocks);
+    ~PageArena();
+
+    PageArena(const PageArena&) = delete;
+    PageArena& operator=(const PageArena&) = delete;
+
+    // Zeroed block, nullptr if the arena is exhausted
+    void* allocate() noexcept;
+    void release(void* block) noexcept;
+
+    bool owns(const void* block) const noexcept
+    {
+        return block >= base && block < base + size;
+    }
+    bool huge_pages() const noexcept { return huge; }
+
+    // Taking the pages not touched yet from the memory of the NUMA node while it has free memory
+    bool bind_to_node(int node) noexcept;
 
 private:
-    uint16_t* memory;
+    char* base = nullptr;
+    size_t size = 0;       // In bytes
+    size_t used = 0;       // Bytes handed out from the start of the mapping
+    bool huge = false;     // Mapped with MAP_HUGETLB
+    std::mutex mutex;
+    std::vector<void*> free_list; // Released blocks
 };
 
 #endif // MEMORY_H
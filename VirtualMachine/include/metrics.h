@@ -0,0 +1,95 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "command.h"
+
+// Counters of one thread running processors. Only the owning thread writes them
+// (relaxed load and store, no read-modify-write), other threads read them on a scrape
+struct alignas(64) ThreadMetrics
+{
+    // Upper bounds of the run duration histogram buckets, in seconds
+    static constexpr int LATENCY_BUCKETS = 8;
+    static constexpr double LATENCY_BOUNDS[LATENCY_BUCKETS] = { 1e-5, 1e-4, 1e-3, 1e-2, 0.1, 1, 10, 100 };
+
+    std::atomic<uint64_t> opcodes[OPCODES_COUNT] = {}; // Executed commands by operation code
+    std::atomic<uint64_t> input_bytes { 0 }, output_bytes { 0 };
+    std::atomic<uint64_t> started { 0 }, halted { 0 }; // Runs started and finished
+    std::atomic<uint64_t> latency[LATENCY_BUCKETS + 1] = {}; // Finished runs by duration, the last bucket is +Inf
+    std::atomic<uint64_t> latency_sum_ns { 0 };
+
+    // Placement of the guests of the host on the NUMA nodes, counted by its worker threads
+    std::atomic<int> node { -1 }; // Node of the thread, -1 if it isn't pinned to one
+    std::atomic<uint64_t> runs { 0 }; // Guest runs (until a READ without input or a halt)
+    std::atomic<uint64_t> migrations { 0 }, remote_migrations { 0 }; // Guests stolen from other workers (on other nodes)
+    std::atomic<uint64_t> remote_runs { 0 }; // Runs of guests whose memory is on another node
+    std::atomic<uint64_t> remote_instructions { 0 }; // Commands of these runs
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t value) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    void count(uint8_t cmd) noexcept { add(opcodes[cmd], 1); }
+    void run_started() noexcept { add(started, 1); }
+    void run_finished(std::chrono::steady_clock::duration duration) noexcept;
+
+    // Counters of the calling thread, registered on the first use
+    static ThreadMetrics& local();
+};
+
+// Prometheus text exposition of the counters summed over all threads
+std::string metrics_text();
+
+// Counting the bytes read from std::cin and written to std::cout while the object exists
+class ConsoleIoCounter final
+{
+public:
+    ConsoleIoCounter();
+    ~ConsoleIoCounter();
+
+    ConsoleIoCounter(const ConsoleIoCounter&) = delete;
+    ConsoleIoCounter& operator=(const ConsoleIoCounter&) = delete;
+
+private:
+    std::unique_ptr<std::streambuf> input, output;
+    std::streambuf* original_input;
+    std::streambuf* original_output;
+};
+
+// Serving the metrics in the background: on a Unix domain socket (every connection gets
+// the current text, an HTTP GET gets it with HTTP headers) or by rewriting a file periodically.
+// The file is written once more when the exporter stops
+class MetricsExporter final
+{
+public:
+    // nullptr if the socket or the file can't be created
+    static std::unique_ptr<MetricsExporter> serve_socket(const std::string& path);
+    static std::unique_ptr<MetricsExporter> write_file(const std::string& path, std::chrono::milliseconds interval);
+    ~MetricsExporter();
+
+private:
+    MetricsExporter() = default;
+
+    std::string path;
+    int listen_fd = -1;
+    std::chrono::milliseconds interval {};
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void socket_loop();
+    void file_loop();
+    bool write_snapshot() const;
+};
+
+#endif // METRICS_H
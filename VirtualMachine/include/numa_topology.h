@@ -0,0 +1,27 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+#include <stddef.h>
+#include <vector>
+
+// Memory nodes of the host with the CPUs the process may run on, read from /sys/devices/system/node.
+// A host without NUMA (or without the sysfs files) is one node 0 with all these CPUs.
+// Nodes without such CPUs are left out
+class NumaTopology final
+{
+public:
+    NumaTopology();
+
+    size_t nodes() const noexcept { return ids.size(); }
+    int node_id(size_t node) const noexcept { return ids[node]; } // Number of the node in the system
+    const std::vector<int>& cpus(size_t node) const noexcept { return node_cpus[node]; }
+
+    // Restricting the calling thread to the CPUs. Returns false if the system refuses
+    static bool pin_thread(const std::vector<int>& cpus) noexcept;
+
+private:
+    std::vector<int> ids;
+    std::vector<std::vector<int>> node_cpus;
+};
+
+#endif // NUMA_TOPOLOGY_H
@@ -0,0 +1,43 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <vector>
+#include <iostream>
+#include "memory.h"
+
+// Result of one optimization pass summed over all rounds
+struct PassStats
+{
+    const char* name;
+    size_t rewritten; // Instructions replaced by other ones
+    size_t removed;   // Words removed from the image
+};
+
+struct OptimizerReport
+{
+    bool optimized = false;
+    const char* reason = nullptr;  // Why the program was left unchanged, or why the passes stopped early
+    size_t instructions_before = 0, instructions_after = 0;
+    size_t cells_before = 0, cells_after = 0;
+    std::vector<PassStats> passes;
+
+    void print(std::ostream& out) const;
+};
+
+// Peephole optimization of the program loaded into memory. The passes are repeated
+// until nothing changes:
+//   - jump threading: jumps and calls to an unconditional jump go to its target,
+//     jumps to the next instruction are removed
+//   - constant compares: a compare of cells that are never written (or of a register
+//     with itself) decides the following conditional jump
+//   - INC/DEC chains: three or more steps on the same register become one ADD of
+//     a constant cell when the flags they set are not read
+//   - redundant loads: LOAD and LOADR setting a register to the address it already has
+//   - dead code: words that are neither reachable instructions nor pointed to by a register
+// Removed words are squeezed out and all addresses are moved accordingly, so the
+// program must be closed: no memory- or register-indirect jumps, no writes into the
+// code, no jumps between subroutines. Otherwise the memory is left unchanged.
+// The entry address is updated together with the memory
+bool optimize(Memory& memory, uint16_t& entry, OptimizerReport& report);
+
+#endif // OPTIMIZER_H
@@ -0,0 +1,38 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+#include <iostream>
+
+// Hardware counters of the host CPU (Linux perf_event_open) measured around a run of the program.
+// Only the user-space part of the VM process is counted. Counters the CPU or the kernel
+// doesn't provide are reported as unavailable, the others still work
+class PerfCounters final
+{
+public:
+    enum Event { CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, LLC_MISSES, ITLB_MISSES, EVENTS_COUNT };
+
+    PerfCounters() noexcept;
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    void start() noexcept;
+    void stop() noexcept;
+
+    // Whether the event could be opened, and its count (scaled if the kernel multiplexed the counters)
+    bool available(Event event) const noexcept { return fds[event] >= 0; }
+    uint64_t count(Event event) const noexcept { return counts[event]; }
+
+    // Raw counts and counts per guest instruction
+    void print(std::ostream& out, uint64_t guest_instructions) const;
+
+private:
+    int fds[EVENTS_COUNT];
+    int errors[EVENTS_COUNT]; // errno of perf_event_open for unavailable events
+    uint64_t counts[EVENTS_COUNT];
+    double running[EVENTS_COUNT]; // Part of the time the counter was actually counting
+};
+
+#endif // PERF_COUNTERS_H
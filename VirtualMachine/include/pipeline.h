@@ -0,0 +1,36 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <memory>
+#include <vector>
+#include "channel.h"
+#include "processor.h"
+
+// Processors connected one after another by channels: what a stage sends to port 1 is received
+// by the next stage from port 0. Every stage runs on its own host thread, a full channel stops
+// the sender until the next stage catches up
+class Pipeline final
+{
+public:
+    static constexpr size_t CHANNEL_WORDS = 4096;
+    static constexpr int INPUT_PORT = 0;
+    static constexpr int OUTPUT_PORT = 1;
+
+    // Adding a stage after the last one. The processor is used until the pipeline is destroyed
+    void add_stage(Processor& proc, uint16_t entry);
+
+    // Running all stages until they halt
+    void run();
+
+private:
+    struct Stage
+    {
+        Processor* proc;
+        uint16_t entry;
+    };
+
+    std::vector<Stage> stages;
+    std::vector<std::unique_ptr<Channel>> channels;
+};
+
+#endif // PIPELINE_H
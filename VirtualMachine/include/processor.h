@@ -1,21 +1,56 @@
 #ifndef PROCESSOR_H
 #define PROCESSOR_H
 
+#include <array>
+#include <vector>
+#include <iostream>
 #include "command.h"
 #include "memory.h"
 
+struct ThreadMetrics;
+class GuestInput;
+class GuestThreads;
+class Channel;
+class Memoizer;
+
 class Processor final
 {
 public:
     static constexpr int ADDRESS_REGS = 256;
-    static constexpr int AMOUNT_COMMANDS = 55;
+    static constexpr int AMOUNT_COMMANDS = 66; // With the BREAK of the debugger
     static constexpr int START_STACK = 240; // Register from which the stack simulation starts
+    static constexpr int PORTS = 8; // Channels of SEND and RECV
+
+    // Reasons for the processor to stop before a halt command
+    enum class Trap : uint8_t
+    {
+        NONE,
+        STACK_OVERFLOW, // CALL beyond the limit of the extended call stack
+        STACK_UNDERFLOW, // ENDP with the empty extended call stack
+        NEEDS_INPUT, // READ from the guest input that has no complete value yet, run from the READ again to resume
+        BREAKPOINT, // BREAK of the debugger
+        DATA_STACK_OVERFLOW, // PUSHV beyond the limit of the data stack
+        DATA_STACK_UNDERFLOW, // POPV with no value pushed in the frame of the running subroutine
+        WATCHPOINT // The command wrote into a page watched by the debugger. It's complete, the Instruction Pointer isn't advanced
+    };
 
-    Memory memory = Memory();  // Memory class
+    Memory& memory = own_memory; // Own memory or the one shared with the other guest threads
     uint16_t address_regs[ADDRESS_REGS]; //Address registers
     uint16_t flags; // Status Flags
+    Trap trap = Trap::NONE; // Set by a command that can't be executed, stops the processor
+    uint64_t executed = 0; // Number of commands executed since the processor was created or reset
+    ThreadMetrics* metrics = nullptr; // Counters of the run (per operation code, duration), if any
+    GuestInput* input = nullptr; // Input of READ filled by the host, std::cin if not set
+    std::ostream* output = &std::cout; // Output of PRINT
+    GuestThreads* threads = nullptr; // Threads started by SPAWN, none if not set
+    Channel* ports[PORTS] = {}; // Channels to and from the other processors connected by the host
+    Memoizer* memo = nullptr; // Cached results of the pure subroutines for CALL and ENDP, if any
 
     Processor();
+    // Processor taking the memory pages from the arena
+    explicit Processor(PageArena* arena) noexcept;
+    // Processor of a guest thread working with the memory of another one
+    explicit Processor(Memory& shared) noexcept;
 
     // Resetting values ​​in memory and registers
     void reset() noexcept;
@@ -23,6 +58,9 @@ public:
     // Starting the processor
     void run(uint16_t start_address);
 
+    // Executing the command at the Instruction Pointer. Returns false at a halt command or a trap
+    bool step() noexcept;
+
     void set_flag(uint8_t flag_index, bool is_true) noexcept;
     bool get_flag(uint8_t flag_index) const noexcept;
 
@@ -32,20 +70,87 @@ public:
     void push(uint16_t adrs) noexcept; // Loading an address onto the stack
     uint16_t pop() noexcept; // Unloading an address from the stack
 
+    // Copying up to max return addresses of the stack simulated by registers, the newest first.
+    // Returns their number. Safe in a signal handler, so the extended call stack isn't read
+    size_t return_addresses(uint16_t* out, size_t max) const noexcept;
+
+    // Data stack growing down from the end of memory (the first value is at 65534).
+    // Addresses of the new top value and of the removed one. Return false and set the trap
+    // if the stack is full or there is no value above the frame pointer
+    bool push_value(uint16_t& address) noexcept
+    {
+        if (uint16_t(data_start - data_sp) + 2u > data_room)
+        {
+            trap = Trap::DATA_STACK_OVERFLOW;
+            return false;
+        }
+        address = data_sp -= 2;
+        return true;
+    }
+    bool pop_value(uint16_t& address) noexcept
+    {
+        if (uint16_t(data_start - data_sp) <= uint16_t(data_start - frame))
+        {
+            trap = Trap::DATA_STACK_UNDERFLOW;
+            return false;
+        }
+        address = data_sp;
+        data_sp += 2;
+        return true;
+    }
+    uint16_t frame_pointer() const noexcept { return frame; }
+    uint16_t data_stack_top() const noexcept { return data_sp; }
+    // Starting the data stack below the address top (0 for the end of memory). It may grow down to the address limit
+    void set_data_stack(uint16_t top, uint32_t limit) noexcept;
+
+    // Keeping return addresses in a growable stack of up to limit entries instead of registers 240-255.
+    // Limit 0 returns to the stack simulated by registers
+    void set_extended_stack(size_t limit) noexcept;
+    size_t extended_stack() const noexcept { return call_stack_limit; }
+
+    // Fast float mode: ADDF, SUBF, MULF and DIVF are single host operations setting no flags.
+    // The IEEE overflow and invalid operation they raise set flag 11, division by zero sets flag 12
+    // (and these flags stay set) when the flags are read by LOADF, written by SETF or the run stops
+    void set_fast_float(bool enabled) noexcept
+    {
+        commands = enabled ? FAST_FLOAT_COMMANDS.data() : COMMANDS.data();
+    }
+    bool fast_float() const noexcept { return commands == FAST_FLOAT_COMMANDS.data(); }
+    void collect_float_exceptions() noexcept;
+
+    // Command implementing the operation code (nullptr for halt and unknown codes)
+    const Command* command(uint8_t cmd) const noexcept
+    {
+        return cmd < AMOUNT_COMMANDS ? commands[cmd] : nullptr;
+    }
+
 private:
+    template <bool Counted>
+    void run_loop() noexcept;
+
+    Memory own_memory;
+
     uint16_t ip; // Instruction Pointer
     uint8_t sp; // Pointer to the top of the stack
+    uint16_t data_sp = 0; // Top of the data stack, 0 if it's empty
+    uint16_t frame = 0; // Frame pointer: the top of the data stack at the CALL of the running subroutine
+    uint16_t data_start = 0; // Address the data stack grows down from
+    uint32_t data_room = Memory::MEM_SIZE - 2; // Cells the data stack may take
+    uint16_t saved_frames[ADDRESS_REGS - START_STACK] = {}; // Frame pointers of the callers by stack register
+
+    // Return address and the frame pointer of the caller
+    struct CallRecord
+    {
+        uint16_t return_to;
+        uint16_t frame;
+    };
+    std::vector<CallRecord> call_stack; // Extended call stack
+    size_t call_stack_limit = 0; // Zero if the stack is simulated by registers
 
-    // Array of pointers to processor instructions
-    Command* commands[AMOUNT_COMMANDS] = { nullptr, new JumpCm(), new JEqCm(), new JEqUCm(), new JEqFCm(),
-        new JGrCm(), new JGrUCm(), new JGrFCm(), new JLsCm(), new JLsUCm(), new JLsFCm(),
-        new JNEqCm(), new JNEqUCm(), new JNEqFCm(), new JGEqCm(), new JGEqUCm(), new JGEqFCm(),
-        new JLEqCm(), new JLEqUCm(), new JLEqFCm(), new PrintCm(), new PrintUCm(), new PrintFCm(),
-        new LoadCm(), new NegCm(), new NegFCm(), new CmpCm(), new CmpUCm(), new CmpFCm(), new AddCm(),
-        new AddFCm(), new SubCm(), new SubFCm(), new MulCm(), new MulFCm(), new DivUCm(), new DivCm(),
-        new DivFCm(), new ModUCm(), new ModCm(), new IncCm(), new DecCm(), new ReadCm(), new ReadUCm(),
-        new ReadFCm(), new AndCm(), new OrCm(), new XorCm(), new NotCm(), new LoadRCm(), new LoadRVCm(),
-        new CallCm(), new LoadF(), new SetF(), new EndpCm() };
+    // Arrays of pointers to processor instructions, shared by all processors
+    static const std::array<const Command*, AMOUNT_COMMANDS> COMMANDS;
+    static const std::array<const Command*, AMOUNT_COMMANDS> FAST_FLOAT_COMMANDS;
+    const Command* const* commands = COMMANDS.data();
 };
 
 #endif // PROCESSOR_H
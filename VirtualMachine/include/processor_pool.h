@@ -0,0 +1,45 @@
+#ifndef PROCESSOR_POOL_H
+#define PROCESSOR_POOL_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "processor.h"
+
+// Fixed set of processors created once and handed out ready to run. The memory pages of all
+// of them come from one arena mapped with huge pages when the system has them (PAGES_PER_PROCESSOR
+// pages per processor on average, then the heap), so acquiring and releasing a processor
+// allocates nothing. A released processor is reset: its pages are zeroed and returned to the arena.
+// A pool of a NUMA node takes the pages from the memory of the node; the processors (and their
+// registers) are placed where the thread creating the pool runs, so it should run on the node
+class ProcessorPool final
+{
+public:
+    static constexpr size_t PAGES_PER_PROCESSOR = 32;
+
+    explicit ProcessorPool(size_t capacity, int node = -1);
+    ~ProcessorPool();
+
+    ProcessorPool(const ProcessorPool&) = delete;
+    ProcessorPool& operator=(const ProcessorPool&) = delete;
+
+    // Free processor, nullptr if all of them are in use
+    Processor* acquire() noexcept;
+
+    // Returning the processor acquired from the pool
+    void release(Processor* proc) noexcept;
+
+    size_t capacity() const noexcept { return processors.size(); }
+    bool huge_pages() const noexcept { return arena.huge_pages(); }
+    int node() const noexcept { return node_id; } // -1 if the pool isn't bound to a node
+
+private:
+    PageArena arena;
+    int node_id;
+    std::vector<std::unique_ptr<Processor>> processors;
+
+    std::mutex mutex;
+    std::vector<Processor*> free_list; // Never grows beyond the capacity reserved at the start
+};
+
+#endif // PROCESSOR_POOL_H
@@ -0,0 +1,61 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include "processor.h"
+
+// Sampling profiler of a run. A SIGPROF timer interrupts the thread running the processor at the given
+// rate of wall clock time, and the signal handler records the Instruction Pointer, the command and
+// the return addresses of the processor into a preallocated buffer without locks.
+// The samples are aggregated after the run by address and by subroutine.
+// The block engine updates the Instruction Pointer at the block exits only, so its samples
+// point to the last exit taken
+class SamplingProfiler final
+{
+public:
+    static constexpr size_t MAX_SAMPLES = 1 << 20; // Later samples are dropped
+    static constexpr size_t SAMPLED_RETURNS = 8; // Newest return addresses kept by a sample
+    static constexpr size_t HOT_ADDRESSES = 20; // Addresses listed in the report
+
+    SamplingProfiler(const Processor& proc, unsigned rate) noexcept;
+    ~SamplingProfiler();
+
+    SamplingProfiler(const SamplingProfiler&) = delete;
+    SamplingProfiler& operator=(const SamplingProfiler&) = delete;
+
+    // Starting the timer of the calling thread, the one running the processor. Fails if another profiler is running or the timer can't be set
+    bool start() noexcept;
+    // Stopping the timer, the samples taken are kept
+    void stop() noexcept;
+
+    size_t samples_taken() const noexcept;
+    size_t samples_dropped() const noexcept;
+
+    // Hot addresses and the time spent in every subroutine (self) and in it with its callees (total).
+    // Subroutines are found from the entry address as in the control flow graph
+    void print(std::ostream& out, uint16_t entry) const;
+
+private:
+    struct Sample
+    {
+        uint16_t ip;
+        uint8_t cmd;
+        uint8_t depth; // Return addresses kept
+        uint16_t returns[SAMPLED_RETURNS];
+    };
+
+    static void on_signal(int) noexcept;
+
+    const Processor& proc;
+    unsigned rate; // Samples per second
+    timer_t timer;
+    std::unique_ptr<Sample[]> samples;
+    std::atomic<size_t> taken { 0 }; // Samples requested by the signals, including the dropped ones
+};
+
+#endif // PROFILER_H
@@ -0,0 +1,50 @@
+#ifndef PURITY_H
+#define PURITY_H
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "memory.h"
+
+// Location of a word a subroutine works with: an address, or with FRAME_RELATIVE an offset
+// from the frame pointer of the subroutine (the top of the data stack at its CALL)
+constexpr uint32_t FRAME_RELATIVE = 0x10000;
+
+inline uint16_t location_address(uint32_t location, uint16_t frame) noexcept
+{
+    return uint16_t(location + (location & FRAME_RELATIVE ? frame : 0));
+}
+
+// Address register a subroutine may set
+struct RegisterEffect
+{
+    uint8_t reg;
+    bool frame_relative; // Set by FRAME, so the value is cached relative to the frame
+    bool kept; // Keeps the value from before the call on some paths, so that value is an input
+};
+
+// Effects of a subroutine called by CALL. A pure subroutine works with the memory only through
+// the registers it loads itself by LOAD, LOADR and FRAME, doesn't read or print values, doesn't halt,
+// doesn't write its code and calls only pure subroutines. So the same input words and flags always
+// give the same writes, registers and flags, as long as its words relative to the frame don't overlap
+// the ones at fixed addresses. The words below its frame are its own, dropped by ENDP
+struct SubroutineEffects
+{
+    uint16_t entry;
+    bool pure;
+    std::string reason; // Why the subroutine isn't pure, e.g. "PRINT at 52"
+    std::vector<uint32_t> inputs; // Words read before the subroutine writes them
+    std::vector<uint32_t> outputs; // Words written, except its own ones
+    std::vector<uint32_t> accessed; // Words read or written by its commands, without the subroutines it calls
+    std::vector<RegisterEffect> registers;
+    std::vector<std::pair<uint16_t, uint16_t>> code; // First and last cells of its blocks
+    uint16_t flag_inputs; // Flags the effects depend on
+    uint16_t flag_outputs; // Flags the subroutine may set
+};
+
+// Effects of all CALL targets of the program loaded into memory. In the fast float mode the fraction
+// arithmetic and the commands reading and writing flags depend on the host exceptions,
+// the subroutines using them aren't pure
+std::vector<SubroutineEffects> analyze_subroutines(const Memory& memory, uint16_t entry, bool fast_float);
+
+#endif // PURITY_H
@@ -2,18 +2,487 @@
 // Completed by student Serbin Alexander
 // Virtual Machine VM09.
 
+#include <charconv>
 #include <iostream>
+#include <limits>
+#include <string>
+#include <memory>
+#include <sstream>
 #include "loader.h"
+#include "cfg.h"
+#include "block_engine.h"
+#include "assembler.h"
+#include "optimizer.h"
+#include "perf_counters.h"
+#include "profiler.h"
+#include "metrics.h"
+#include "async_host.h"
+#include "code_cache.h"
+#include "lockstep_engine.h"
+#include "aot.h"
+#include "guest_threads.h"
+#include "pipeline.h"
+#include "debugger.h"
+#include "memoizer.h"
 
+// Writing the program as text or binary image into the file (or to the console if there's no file)
+static bool write_program(const AssembledProgram& program, const char* output, bool binary)
+{
+    std::ofstream fout;
+    if (output)
+    {
+        fout.open(output, binary ? std::ios::binary : std::ios::out);
+        if (!fout)
+        {
+            std::cout << "Failed to open file.\n";
+            return false;
+        }
+    }
+    std::ostream& out = output ? fout : std::cout;
+    if (binary) program.write_binary(out);
+    else program.write_text(out);
+    return true;
+}
+
+// Running a copy of the program for every line of the input file, LANES copies at a time in lockstep.
+// The output of every copy follows a line with its number
+static bool run_lockstep(const Memory& image, uint16_t run_address, const std::string& inputs)
+{
+    std::ifstream fin(inputs);
+    if (!fin)
+    {
+        std::cout << "Failed to open file.\n";
+        return false;
+    }
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(fin, line); )
+        lines.push_back(line);
+
+    LockstepEngine engine(image);
+    for (size_t first = 0; first < lines.size(); first += LockstepEngine::LANES)
+    {
+        size_t count = std::min<size_t>(LockstepEngine::LANES, lines.size() - first);
+        std::istringstream ins[LockstepEngine::LANES];
+        std::ostringstream outs[LockstepEngine::LANES];
+        std::vector<LockstepEngine::Lane> lanes;
+        for (size_t i = 0; i < count; i++)
+        {
+            ins[i].str(lines[first + i]);
+            lanes.push_back(LockstepEngine::Lane { &ins[i], &outs[i] });
+        }
+        engine.run(run_address, lanes);
+        for (size_t i = 0; i < count; i++)
+            std::cout << "Guest " << first + i + 1 << ":\n" << outs[i].str();
+    }
+    std::cerr << "Lockstep: " << lines.size() << " guests, " << engine.steps << " commands dispatched, "
+        << engine.lane_steps << " executed by the lanes (" << (engine.steps ? double(engine.lane_steps) / engine.steps : 0)
+        << " lanes per command)\n";
+    return true;
+}
+
+// Loading a stage of the pipeline, files with the .asm extension are assembled first
+static bool load_stage(Processor& proc, const std::string& filename, uint16_t& run_address)
+{
+    if (filename.size() <= 4 || filename.compare(filename.size() - 4, 4, ".asm") != 0)
+        return load_program(proc, filename.c_str(), run_address);
+
+    std::string source;
+    if (!read_file(filename.c_str(), source))
+    {
+        std::cout << "Failed to open file.\n";
+        return false;
+    }
+    AssembledProgram program;
+    AsmError error;
+    if (!assemble(source.data(), source.data() + source.size(), program, error))
+    {
+        std::cout << filename << ':' << error.line << ": " << error.message << '\n';
+        return false;
+    }
+    program.load(proc);
+    run_address = program.entry;
+    return true;
+}
+
+// Whether the program starts guest threads or uses the atomic commands or the channels. They are
+// run by the interpreter and the block engine only
+static bool uses_concurrency(const Memory& memory, uint16_t entry)
+{
+    ControlFlowGraph cfg(memory, entry);
+    for (const BasicBlock& block : cfg.blocks())
+        for (uint32_t address = block.start; address <= block.last; address += 2)
+            if (is_concurrent_command(memory.get_word(address).cmd3ops.cmd)) return true;
+    return false;
+}
+
+// Lowest address of the data stack of the program: above its last cell, and above the stacks
+// of the guest threads if it may start them
+static uint32_t data_stack_limit(const Memory& memory, uint16_t entry)
+{
+    uint32_t limit = program_end(memory);
+    if (uses_concurrency(memory, entry)) limit = std::max(limit, Memory::MEM_SIZE - GuestThreads::THREAD_STACK);
+    return limit;
+}
+
+// Running the program with the next stages of the pipeline, each one on its own host thread.
+// Returns false if a stage can't be loaded or stops on a trap (the first one is reported by main)
+static bool run_pipeline(Processor& first, uint16_t run_address, const std::vector<std::string>& files)
+{
+    std::vector<std::unique_ptr<Processor>> stages;
+    Pipeline pipeline;
+    pipeline.add_stage(first, run_address);
+    for (const std::string& file : files)
+    {
+        stages.emplace_back(new Processor());
+        Processor& proc = *stages.back();
+        uint16_t entry = 0;
+        if (!load_stage(proc, file, entry)) return false;
+        proc.set_extended_stack(first.extended_stack());
+        proc.set_fast_float(first.fast_float());
+        proc.set_data_stack(0, data_stack_limit(proc.memory, entry));
+        pipeline.add_stage(proc, entry);
+    }
+    pipeline.run();
+
+    bool ok = true;
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        if (stages[i]->trap == Processor::Trap::STACK_OVERFLOW)
+            std::cout << "Stage " << i + 2 << ": call stack overflow at address " << stages[i]->get_ip() << ".\n";
+        else if (stages[i]->trap == Processor::Trap::STACK_UNDERFLOW)
+            std::cout << "Stage " << i + 2 << ": return with empty call stack at address " << stages[i]->get_ip() << ".\n";
+        else if (stages[i]->trap == Processor::Trap::DATA_STACK_OVERFLOW)
+            std::cout << "Stage " << i + 2 << ": data stack overflow at address " << stages[i]->get_ip() << ".\n";
+        else if (stages[i]->trap == Processor::Trap::DATA_STACK_UNDERFLOW)
+            std::cout << "Stage " << i + 2 << ": pop from empty data stack frame at address " << stages[i]->get_ip() << ".\n";
+        ok &= stages[i]->trap == Processor::Trap::NONE;
+    }
+    return ok;
+}
+
+// Exporters of the metrics options, the ones that can't be started are reported
+static void start_exporters(const std::string& socket, const std::string& file, double interval,
+                            std::unique_ptr<MetricsExporter>& server, std::unique_ptr<MetricsExporter>& writer)
+{
+    if (!socket.empty() && !(server = MetricsExporter::serve_socket(socket)))
+        std::cerr << "Failed to create the metrics socket " << socket << ".\n";
+    if (!file.empty() && !(writer = MetricsExporter::write_file(file,
+            std::chrono::milliseconds(int64_t(interval * 1000)))))
+        std::cerr << "Failed to write the metrics file " << file << ".\n";
+}
+
+// Positive number after the prefix of the option, infinity isn't taken. A usage error is printed for other values
+template <class T>
+static bool option_value(const std::string& arg, size_t prefix, T& result)
+{
+    const char* first = arg.data() + prefix;
+    const char* last = arg.data() + arg.size();
+    T value;
+    std::from_chars_result parsed = std::from_chars(first, last, value);
+    if (first == last || parsed.ec != std::errc() || parsed.ptr != last ||
+        !(value > 0 && value <= std::numeric_limits<T>::max()))
+    {
+        std::cout << "Invalid value of " << arg.substr(0, prefix - 1) << ": '" << arg.substr(prefix)
+                  << "', a positive number is expected.\n";
+        return false;
+    }
+    result = value;
+    return true;
+}
 
 int main(int argc, char **argv)
 {
     Processor proc = Processor();
+    char* filename = nullptr;
+    bool dump_cfg = false;
+    bool block_engine = false;
+    bool ic_stats = false;
+    size_t call_stack_limit = 0;
+    bool assemble_only = false;
+    bool binary_output = false;
+    bool optimize_program = false;
+    bool perf = false;
+    unsigned profile_rate = 0;
+    bool fast_float = false;
+    const char* output = nullptr;
+    std::string metrics_socket, metrics_file;
+    double metrics_interval = 5;
+    std::string serve_path;
+    size_t serve_threads = std::thread::hardware_concurrency();
+    size_t serve_guests = 1024;
+    size_t load_threads = 0;
+    bool use_cache = false;
+    std::string cache_dir;
+    std::string lockstep_inputs;
+    std::string aot_output;
+    std::vector<std::string> next_stages;
+    bool debug = false;
+    bool memoize = false;
+    std::string debug_script; // Debugger commands, from the console if empty
+    std::vector<std::pair<std::string, uint16_t>> labels; // Of the assembled program, for the debugger
 
-    // Loading a program from a file into memory and running it
-    if (argc > 1)
-        load(proc, argv[1]);
-    else
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--dump-cfg") dump_cfg = true; // Print the control flow graph instead of running
+        else if (arg == "--engine=block") block_engine = true; // Run by decoded blocks
+        else if (arg == "--ic-stats") ic_stats = block_engine = true; // Indirect jump statistics
+        else if (arg.rfind("--call-stack=", 0) == 0) // Extended call stack with the depth limit
+        {
+            if (!option_value(arg, 13, call_stack_limit)) return 1;
+        }
+        else if (arg == "--assemble") assemble_only = true; // Translate an .asm file without running
+        else if (arg == "--binary") binary_output = true; // Write the binary image instead of text
+        else if (arg == "--output" && i + 1 < argc) output = argv[++i];
+        else if (arg == "--optimize") optimize_program = true; // Peephole optimization before running
+        else if (arg == "--perf") perf = true; // Host hardware counters of the run
+        else if (arg == "--profile") profile_rate = 1000; // Sampling profiler, samples per second
+        else if (arg.rfind("--profile=", 0) == 0)
+        {
+            if (!option_value(arg, 10, profile_rate)) return 1;
+        }
+        else if (arg == "--fast-float") fast_float = true; // Fraction arithmetic without flags
+        else if (arg.rfind("--metrics-socket=", 0) == 0) metrics_socket = arg.substr(17); // Metrics on a Unix socket
+        else if (arg.rfind("--metrics-file=", 0) == 0) metrics_file = arg.substr(15); // Metrics rewritten in a file
+        else if (arg.rfind("--metrics-interval=", 0) == 0)
+        {
+            if (!option_value(arg, 19, metrics_interval)) return 1;
+        }
+        else if (arg.rfind("--serve=", 0) == 0) serve_path = arg.substr(8); // A guest for every connection
+        else if (arg.rfind("--serve-threads=", 0) == 0)
+        {
+            if (!option_value(arg, 16, serve_threads)) return 1;
+        }
+        else if (arg.rfind("--serve-guests=", 0) == 0)
+        {
+            if (!option_value(arg, 15, serve_guests)) return 1;
+        }
+        else if (arg.rfind("--load-threads=", 0) == 0) // Host threads loading a large text
+        {
+            if (!option_value(arg, 15, load_threads)) return 1;
+        }
+        else if (arg == "--cache") use_cache = true; // Prepared programs kept between runs
+        else if (arg.rfind("--cache-dir=", 0) == 0) use_cache = true, cache_dir = arg.substr(12);
+        else if (arg.rfind("--lockstep=", 0) == 0) lockstep_inputs = arg.substr(11); // A copy for every input line
+        else if (arg.rfind("--aot=", 0) == 0) aot_output = arg.substr(6); // Translate into a C++ program
+        else if (arg.rfind("--then=", 0) == 0) next_stages.push_back(arg.substr(7)); // Next stage of the pipeline
+        else if (arg == "--debug") debug = true; // Run under the debugger
+        else if (arg.rfind("--debug=", 0) == 0) debug = true, debug_script = arg.substr(8);
+        else if (arg == "--memoize") memoize = true; // Cached results of the pure subroutines
+        else filename = argv[i];
+    }
+
+    if (!filename)
+    {
         std::cout << "Specify the file to execute.\n";
-    return 0;
+        return 0;
+    }
+
+    set_load_threads(load_threads);
+
+    // A program prepared by an earlier run with the same options is taken from the cache
+    uint16_t run_address = 0;
+    std::unique_ptr<CodeCache> cache;
+    uint64_t cache_key = 0;
+    CodeCache::Entry cached;
+    bool cache_hit = false;
+    if (use_cache && !assemble_only && !output)
+    {
+        std::string file;
+        if (!read_file(filename, file))
+        {
+            std::cout << "Failed to open file.\n";
+            return 1;
+        }
+        cache.reset(new CodeCache(cache_dir));
+        cache_key = CodeCache::key(file, optimize_program ? "optimize" : "");
+        ParseError error;
+        cache_hit = cache->load(cache_key, cached) &&
+            load_image(proc, cached.image.data(), cached.image.data() + cached.image.size(), run_address, error);
+        if (!cache_hit) proc.memory.clear(); // A damaged entry may be loaded in part
+    }
+
+    // Loading a program from a file into memory and running it.
+    // Files with the .asm extension are assembled first
+    std::string name = filename;
+    if (!cache_hit && (assemble_only || (name.size() > 4 && name.compare(name.size() - 4, 4, ".asm") == 0)))
+    {
+        std::string source;
+        if (!read_file(filename, source))
+        {
+            std::cout << "Failed to open file.\n";
+            return 1;
+        }
+        AssembledProgram program;
+        AsmError error;
+        if (!assemble(source.data(), source.data() + source.size(), program, error))
+        {
+            std::cout << filename << ':' << error.line << ": " << error.message << '\n';
+            return 1;
+        }
+
+        program.load(proc);
+        run_address = program.entry;
+        for (const AsmWord& word : program.words)
+            if (!word.label.empty()) labels.emplace_back(word.label, word.address);
+        if (assemble_only && !optimize_program)
+            return write_program(program, output, binary_output) ? 0 : 1;
+    }
+    else if (!cache_hit && !load_program(proc, filename, run_address))
+        return 1;
+
+    if (optimize_program && !cache_hit)
+    {
+        OptimizerReport report;
+        optimize(proc.memory, run_address, report);
+        report.print(std::cerr);
+    }
+
+    // The prepared program is stored at once, the blocks decoded by the block engine after the run
+    if (cache && !cache_hit)
+    {
+        cached.image = CodeCache::image_of(proc.memory, run_address);
+        cached.blocks.clear();
+        if (!block_engine && !cache->store(cache_key, cached))
+            std::cerr << "Failed to write the cache entry into " << cache->path() << ".\n";
+    }
+
+    if ((!aot_output.empty() || !lockstep_inputs.empty() || debug || memoize) &&
+        uses_concurrency(proc.memory, run_address))
+    {
+        std::cout << "Guest threads and channels can't be used with --aot, --lockstep, --debug and --memoize.\n";
+        return 1;
+    }
+
+    // Translating the loaded program into C++ instead of running it
+    if (!aot_output.empty())
+    {
+        std::ofstream fout(aot_output);
+        if (!fout)
+        {
+            std::cout << "Failed to open file.\n";
+            return 1;
+        }
+        translate_to_cpp(proc.memory, run_address, fout);
+        return fout ? 0 : 1;
+    }
+
+    // Writing the loaded program (e.g. after the optimization) instead of running it
+    if (assemble_only || output)
+        return write_program(program_from_memory(proc.memory, run_address), output, binary_output) ? 0 : 1;
+
+    // Interactive guests on a Unix socket, each connection runs its own copy of the program
+    if (!serve_path.empty())
+    {
+        AsyncHost host(serve_threads, serve_guests);
+        host.call_stack_limit = call_stack_limit;
+        host.fast_float = fast_float;
+        host.data_stack_limit = data_stack_limit(proc.memory, run_address);
+        if (!host.listen(serve_path, program_from_memory(proc.memory, run_address)))
+        {
+            std::cout << "Failed to create the socket " << serve_path << ".\n";
+            return 1;
+        }
+        std::unique_ptr<MetricsExporter> metrics_server, metrics_writer; // With the placement counters of the workers
+        start_exporters(metrics_socket, metrics_file, metrics_interval, metrics_server, metrics_writer);
+        host.run();
+        return 0;
+    }
+
+    // Copies of the program for the lines of the input file, run by groups of lanes
+    if (!lockstep_inputs.empty())
+        return run_lockstep(proc.memory, run_address, lockstep_inputs) ? 0 : 1;
+
+    if (call_stack_limit)
+        proc.set_extended_stack(call_stack_limit);
+    proc.set_fast_float(fast_float);
+    proc.set_data_stack(0, data_stack_limit(proc.memory, run_address));
+
+    // Running under the debugger with the commands of the script or the console
+    if (debug)
+    {
+        std::ifstream script;
+        if (!debug_script.empty())
+        {
+            script.open(debug_script);
+            if (!script)
+            {
+                std::cout << "Failed to open file.\n";
+                return 1;
+            }
+        }
+        Debugger debugger(proc, run_address);
+        for (const std::pair<std::string, uint16_t>& label : labels)
+            debugger.add_label(label.first, label.second);
+        debugger.run(debug_script.empty() ? std::cin : script, std::cout);
+        return proc.trap == Processor::Trap::NONE ? 0 : 1;
+    }
+
+    size_t failed_threads = 0;
+    bool failed_stages = false;
+    if (dump_cfg)
+        ControlFlowGraph(proc.memory, run_address).dump(std::cout);
+    else if (!next_stages.empty())
+        failed_stages = !run_pipeline(proc, run_address, next_stages);
+    else
+    {
+        // The exporters are destroyed after the run, the metrics file gets the final values
+        std::unique_ptr<MetricsExporter> metrics_server, metrics_writer;
+        std::unique_ptr<ConsoleIoCounter> io_counter;
+        if (!metrics_socket.empty() || !metrics_file.empty())
+        {
+            proc.metrics = &ThreadMetrics::local();
+            io_counter.reset(new ConsoleIoCounter());
+        }
+        start_exporters(metrics_socket, metrics_file, metrics_interval, metrics_server, metrics_writer);
+
+        std::unique_ptr<PerfCounters> counters(perf ? new PerfCounters() : nullptr);
+        std::unique_ptr<SamplingProfiler> profiler(profile_rate ? new SamplingProfiler(proc, profile_rate) : nullptr);
+        if (profiler && !profiler->start())
+        {
+            std::cerr << "Failed to start the profiler.\n";
+            profiler.reset();
+        }
+        std::unique_ptr<Memoizer> memoizer(memoize ? new Memoizer(proc.memory, run_address, fast_float) : nullptr);
+        proc.memo = memoizer.get();
+        std::unique_ptr<BlockEngine> engine(block_engine ? new BlockEngine(proc) : nullptr);
+        if (engine && cache_hit) engine->predecode(cached.blocks);
+        GuestThreads threads;
+        proc.threads = &threads;
+        if (counters) counters->start();
+        if (engine) engine->run(run_address);
+        else proc.run(run_address);
+        threads.join_all(); // The program ends when all its threads halt
+        failed_threads = threads.failed();
+        if (counters)
+        {
+            counters->stop();
+            counters->print(std::cerr, proc.executed);
+        }
+        if (profiler)
+        {
+            profiler->stop();
+            profiler->print(std::cerr, run_address);
+        }
+        if (ic_stats) engine->print_inline_cache_stats(std::cerr);
+        if (memoizer) memoizer->print(std::cerr);
+        if (engine && cache && cached.blocks.empty())
+        {
+            cached.blocks = engine->block_starts();
+            if (!cache->store(cache_key, cached))
+                std::cerr << "Failed to write the cache entry into " << cache->path() << ".\n";
+        }
+    }
+
+    if (proc.trap == Processor::Trap::STACK_OVERFLOW)
+        std::cout << "Call stack overflow at address " << proc.get_ip() << ".\n";
+    else if (proc.trap == Processor::Trap::STACK_UNDERFLOW)
+        std::cout << "Return with empty call stack at address " << proc.get_ip() << ".\n";
+    else if (proc.trap == Processor::Trap::DATA_STACK_OVERFLOW)
+        std::cout << "Data stack overflow at address " << proc.get_ip() << ".\n";
+    else if (proc.trap == Processor::Trap::DATA_STACK_UNDERFLOW)
+        std::cout << "Pop from empty data stack frame at address " << proc.get_ip() << ".\n";
+    if (failed_threads)
+        std::cout << failed_threads << " guest threads stopped on a stack error.\n";
+    return proc.trap == Processor::Trap::NONE && !failed_threads && !failed_stages ? 0 : 1;
 }
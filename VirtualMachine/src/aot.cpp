@@ -0,0 +1,566 @@
+#include "aot.h"
+#include "cfg.h"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// Beginning of the translated program: the state of the processor and the commands.
+// The commands repeat the ones of command.cpp, the operands are the register numbers
+static const char* const PRELUDE = R"(#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#define OP static inline
+
+// Same layout as in the VM: 32-bit words over 16-bit cells, 256 address registers, 16 flags
+union Word
+{
+    uint16_t cells[2];
+    int32_t ival;
+    uint32_t uval;
+    float fval;
+};
+
+static uint16_t cells[65536];
+static bool code[65536]; // Cells of the translated instructions
+static uint16_t original[65536]; // Their values at the start
+static bool changed[65536]; // Translated cells holding other values now
+static unsigned code_changes; // Number of writes changing the translated cells
+static uint16_t regs[256];
+static uint16_t flags;
+static uint8_t sp = 240; // Call stack simulated by registers 240-255
+static uint16_t data_sp, frame; // Data stack and frame pointer
+static uint16_t saved_frames[16]; // Frame pointers of the callers by stack register
+
+OP Word get(uint16_t address)
+{
+    Word word;
+    word.cells[0] = cells[address];
+    word.cells[1] = cells[uint16_t(address + 1)];
+    return word;
+}
+
+// Writing into a translated cell. The program may do it as long as it doesn't execute the changed instruction
+static void change_code(uint16_t address, uint16_t value)
+{
+    changed[address] = value != original[address];
+    code_changes++;
+}
+
+OP void set(uint16_t address, Word word)
+{
+    uint16_t next = address + 1;
+    if (code[address] | code[next])
+    {
+        if (code[address]) change_code(address, word.cells[0]);
+        if (code[next]) change_code(next, word.cells[1]);
+    }
+    cells[address] = word.cells[0];
+    cells[next] = word.cells[1];
+}
+
+// Stopping if an instruction about to be executed was changed
+static void verify(uint32_t first, uint32_t last)
+{
+    for (uint32_t address = first; address <= last; address++)
+    {
+        if (!changed[address]) continue;
+        std::cout.flush();
+        std::cerr << "The program changed its code at address " << address << ", it can't be run translated.\n";
+        std::exit(1);
+    }
+}
+
+OP void set_flag(int flag, bool value)
+{
+    if (value) flags |= 1 << flag;
+    else flags &= ~(1 << flag);
+}
+
+OP void int_flags(Word result)
+{
+    set_flag(0, result.ival == 0);
+    set_flag(1, (result.uval & 1) == 0);
+    set_flag(8, result.ival < 0);
+}
+
+OP void float_flags(Word result)
+{
+    set_flag(0, result.fval == 0);
+    set_flag(8, result.fval < 0);
+}
+
+// ADD, SUB and MUL with the overflow and carry flags
+template <char Op>
+OP void arith(uint8_t r0, uint8_t r1, uint8_t r2)
+{
+    Word word1 = get(regs[r1]), word2 = get(regs[r2]), result = {};
+    if (Op == '-') word2.uval = 0u - word2.uval;
+    long wide;
+    if (Op == '*')
+    {
+        result.uval = word1.uval * word2.uval;
+        wide = (long)word1.ival * (long)word2.ival;
+    }
+    else
+    {
+        result.uval = word1.uval + word2.uval;
+        wide = (long)word1.ival + (long)word2.ival;
+    }
+    set_flag(9, wide != result.ival);
+    set_flag(10, wide != result.uval);
+    int_flags(result);
+    set(regs[r0], result);
+}
+
+// ADDF, SUBF and MULF checked in double precision
+template <char Op>
+OP void arithf(uint8_t r0, uint8_t r1, uint8_t r2)
+{
+    Word word1 = get(regs[r1]), word2 = get(regs[r2]), result = {};
+    if (Op == '-') word2.fval = -word2.fval;
+    double wide;
+    if (Op == '*')
+    {
+        result.fval = word1.fval * word2.fval;
+        wide = (double)word1.fval * (double)word2.fval;
+    }
+    else
+    {
+        result.fval = word1.fval + word2.fval;
+        wide = (double)word1.fval + (double)word2.fval;
+    }
+    set_flag(11, wide != result.fval);
+    float_flags(result);
+    set(regs[r0], result);
+}
+
+template <char Op>
+OP void divide(uint8_t r0, uint8_t r1, uint8_t r2)
+{
+    Word word1 = get(regs[r1]), word2 = get(regs[r2]), result = {};
+    set_flag(12, word2.ival == 0);
+    result.ival = Op == '/' ? word1.ival / word2.ival : word1.ival % word2.ival;
+    int_flags(result);
+    set(regs[r0], result);
+}
+
+template <char Op>
+OP void divideu(uint8_t r0, uint8_t r1, uint8_t r2)
+{
+    Word word1 = get(regs[r1]), word2 = get(regs[r2]), result = {};
+    set_flag(12, word2.uval == 0);
+    result.uval = Op == '/' ? word1.uval / word2.uval : word1.uval % word2.uval;
+    int_flags(result);
+    set(regs[r0], result);
+}
+
+OP void dividef(uint8_t r0, uint8_t r1, uint8_t r2)
+{
+    Word word1 = get(regs[r1]), word2 = get(regs[r2]), result = {};
+    set_flag(12, word2.fval == 0);
+    result.fval = word1.fval / word2.fval;
+    float_flags(result);
+    set(regs[r0], result);
+}
+
+OP void neg(uint8_t r2)
+{
+    Word result = {};
+    result.uval = 0u - get(regs[r2]).uval;
+    int_flags(result);
+    set(regs[r2], result);
+}
+
+OP void negf(uint8_t r2)
+{
+    Word result = {};
+    result.fval = -get(regs[r2]).fval;
+    float_flags(result);
+    set(regs[r2], result);
+}
+
+OP void inc(uint8_t r2)
+{
+    Word word = get(regs[r2]), result = {};
+    result.uval = word.uval + 1;
+    set_flag(9, result.ival < word.ival);
+    set_flag(10, result.uval < word.uval);
+    set(regs[r2], result);
+}
+
+OP void dec(uint8_t r2)
+{
+    Word word = get(regs[r2]), result = {};
+    result.uval = word.uval - 1;
+    set_flag(9, result.ival > word.ival);
+    set_flag(10, result.uval > word.uval);
+    set(regs[r2], result);
+}
+
+OP void cmp(uint8_t r0, uint8_t r1)
+{
+    Word word1 = get(regs[r0]), word2 = get(regs[r1]);
+    set_flag(2, word1.ival == word2.ival);
+    set_flag(3, word1.ival > word2.ival);
+}
+
+OP void cmpu(uint8_t r0, uint8_t r1)
+{
+    Word word1 = get(regs[r0]), word2 = get(regs[r1]);
+    set_flag(4, word1.uval == word2.uval);
+    set_flag(5, word1.uval > word2.uval);
+}
+
+OP void cmpf(uint8_t r0, uint8_t r1)
+{
+    Word word1 = get(regs[r0]), word2 = get(regs[r1]);
+    set_flag(6, word1.fval == word2.fval);
+    set_flag(7, word1.fval > word2.fval);
+}
+
+template <char Op>
+OP void bitwise(uint8_t r0, uint8_t r1, uint8_t r2)
+{
+    Word word1 = get(regs[r1]), word2 = get(regs[r2]), result = {};
+    result.uval = Op == '&' ? word1.uval & word2.uval : Op == '|' ? word1.uval | word2.uval : word1.uval ^ word2.uval;
+    set(regs[r0], result);
+    int_flags(result);
+}
+
+OP void bitnot(uint8_t r0, uint8_t r2)
+{
+    Word result = {};
+    result.uval = ~get(regs[r2]).uval;
+    set(regs[r0], result);
+    int_flags(result);
+}
+
+OP void read(uint8_t r2)
+{
+    Word value = {};
+    std::cin >> value.ival;
+    set(regs[r2], value);
+}
+
+OP void readu(uint8_t r2)
+{
+    Word value = {};
+    std::cin >> value.uval;
+    set(regs[r2], value);
+}
+
+OP void readf(uint8_t r2)
+{
+    Word value = {};
+    std::cin >> value.fval;
+    set(regs[r2], value);
+}
+
+OP void loadf(uint8_t r0, uint8_t flag)
+{
+    Word value = {};
+    value.uval = flag < 16 && (flags >> flag) & 1;
+    set(regs[r0], value);
+}
+
+OP void setf(uint8_t flag, uint8_t r1)
+{
+    Word value = get(regs[r1]);
+    if (flag < 16) set_flag(flag, value.uval != 0);
+}
+
+OP void push(uint16_t address)
+{
+    regs[sp] = address;
+    saved_frames[sp - 240] = frame;
+    frame = data_sp;
+    sp++;
+    if (sp < 240) sp = 240;
+}
+
+OP uint16_t pop()
+{
+    sp--;
+    if (sp < 240) sp = 255;
+    data_sp = frame;
+    frame = saved_frames[sp - 240];
+    return regs[sp];
+}
+
+OP void pushv(uint8_t r2)
+{
+    Word value = get(regs[r2]);
+    data_sp -= 2;
+    set(data_sp, value);
+}
+
+OP void popv(uint8_t r2)
+{
+    data_sp += 2;
+    set(regs[r2], get(data_sp - 2));
+}
+
+// Results of the translated code besides the address of the next instruction
+static constexpr uint32_t HALTED = 0x10000;
+static constexpr uint32_t FAILED = 0x10001;
+
+// Address without a translated instruction: a halt if there's one, an error otherwise
+static uint32_t untranslated(uint16_t address)
+{
+    uint8_t cmd = get(address).cells[0] & 0xFF;
+    if (cmd == 0 || cmd >= 55) return HALTED;
+    std::cout.flush();
+    std::cerr << "The program jumped to address " << address << ", which wasn't translated.\n";
+    return FAILED;
+}
+)";
+
+// Instructions in one function of the translated program
+static constexpr size_t CHUNK_SIZE = 256;
+
+// Targets of the register-indirect jumps by address, for the jumps whose registers are set by LOAD
+// or LOADR earlier in the same block (-1 for the other instructions)
+static std::vector<int32_t> register_jump_targets(const Memory& memory, const ControlFlowGraph& cfg)
+{
+    std::vector<int32_t> targets(Memory::MEM_SIZE, -1);
+    int32_t values[256];
+    for (const BasicBlock& block : cfg.blocks())
+    {
+        std::fill(std::begin(values), std::end(values), -1);
+        for (uint32_t address = block.start; address <= block.last; address += 2)
+        {
+            Word word = memory.get_word(address);
+            uint8_t cmd = word.cmd3ops.cmd;
+            uint8_t* regs = word.cmd3ops.regs;
+            if (cmd == OP_LOAD) values[word.cmd2ops.reg] = word.cmd2ops.adrs;
+            else if (cmd == OP_LOADR) values[regs[0]] = values[regs[1]];
+            else if (cmd == OP_FRAME) values[word.cmd2ops.reg] = -1;
+            else if (is_jump(cmd) && regs[0] == JUMP_REGISTERS && values[regs[1]] >= 0 && values[regs[2]] >= 0)
+                targets[address] = uint16_t(values[regs[2]] + values[regs[1]]);
+        }
+    }
+    return targets;
+}
+
+// Going to the instruction at the address: a goto inside the function, otherwise returning to main
+static void emit_goto(std::ostream& out, uint32_t target, const std::vector<int>& chunk_of, int chunk)
+{
+    target &= 0xFFFF;
+    if (chunk_of[target] == chunk) out << "goto L" << target << ';';
+    else out << "return " << target << ';';
+}
+
+// Whether the command writes into memory
+static bool writes_memory(uint8_t cmd) noexcept
+{
+    return (cmd >= OP_NEG && cmd <= OP_NOT && cmd != OP_CMP && cmd != OP_CMPU && cmd != OP_CMPF)
+        || cmd == OP_LOADRV || cmd == OP_LOADF || cmd == OP_PUSHV || cmd == OP_POPV;
+}
+
+// Code of the instruction. Returns false if the next instruction isn't executed after it
+static bool emit_command(std::ostream& out, Word word, uint16_t address, const std::vector<int>& chunk_of,
+                         int chunk, int32_t known_target)
+{
+    uint8_t cmd = word.cmd3ops.cmd;
+    int r0 = word.cmd3ops.regs[0], r1 = word.cmd3ops.regs[1], r2 = word.cmd3ops.regs[2];
+    auto ops3 = [&](const char* name) { out << name << '(' << r0 << ", " << r1 << ", " << r2 << ");"; };
+
+    if (is_jump(cmd))
+    {
+        JumpMask mask = JUMP_MASKS[cmd];
+        if (mask.table != 0xF)
+            out << "if ((" << int(mask.table) << " >> ((flags >> " << int(mask.shift) << ") & 3)) & 1) ";
+        if (r0 == JUMP_DIRECT) emit_goto(out, word.cmd2ops.adrs, chunk_of, chunk);
+        else if (r0 == JUMP_MEMORY) out << "return uint16_t(get(" << word.cmd2ops.adrs << ").uval);";
+        else if (r0 == JUMP_REGISTERS && known_target >= 0) emit_goto(out, known_target, chunk_of, chunk);
+        else if (r0 == JUMP_REGISTERS) out << "return uint16_t(regs[" << r2 << "] + regs[" << r1 << "]);";
+        else emit_goto(out, address + word.cmd2ops.adrs, chunk_of, chunk);
+        return cmd != OP_JMP;
+    }
+
+    switch (cmd)
+    {
+    case OP_PRINT: out << "std::cout << get(regs[" << r2 << "]).ival << std::endl;"; break;
+    case OP_PRINTU: out << "std::cout << get(regs[" << r2 << "]).uval << std::endl;"; break;
+    case OP_PRINTF: out << "std::cout << get(regs[" << r2 << "]).fval << std::endl;"; break;
+    case OP_LOAD: out << "regs[" << int(word.cmd2ops.reg) << "] = " << word.cmd2ops.adrs << ';'; break;
+    case OP_NEG: out << "neg(" << r2 << ");"; break;
+    case OP_NEGF: out << "negf(" << r2 << ");"; break;
+    case OP_CMP: out << "cmp(" << r0 << ", " << r1 << ");"; break;
+    case OP_CMPU: out << "cmpu(" << r0 << ", " << r1 << ");"; break;
+    case OP_CMPF: out << "cmpf(" << r0 << ", " << r1 << ");"; break;
+    case OP_ADD: ops3("arith<'+'>"); break;
+    case OP_ADDF: ops3("arithf<'+'>"); break;
+    case OP_SUB: ops3("arith<'-'>"); break;
+    case OP_SUBF: ops3("arithf<'-'>"); break;
+    case OP_MUL: ops3("arith<'*'>"); break;
+    case OP_MULF: ops3("arithf<'*'>"); break;
+    case OP_DIVU: ops3("divideu<'/'>"); break;
+    case OP_DIV: ops3("divide<'/'>"); break;
+    case OP_DIVF: ops3("dividef"); break;
+    case OP_MODU: ops3("divideu<'%'>"); break;
+    case OP_MOD: ops3("divide<'%'>"); break;
+    case OP_INC: out << "inc(" << r2 << ");"; break;
+    case OP_DEC: out << "dec(" << r2 << ");"; break;
+    case OP_READ: out << "read(" << r2 << ");"; break;
+    case OP_READU: out << "readu(" << r2 << ");"; break;
+    case OP_READF: out << "readf(" << r2 << ");"; break;
+    case OP_AND: ops3("bitwise<'&'>"); break;
+    case OP_OR: ops3("bitwise<'|'>"); break;
+    case OP_XOR: ops3("bitwise<'^'>"); break;
+    case OP_NOT: out << "bitnot(" << r0 << ", " << r2 << ");"; break;
+    case OP_LOADR: out << "regs[" << r0 << "] = regs[" << r1 << "];"; break;
+    case OP_LOADRV: out << "set(regs[" << r0 << "], get(regs[" << r1 << "]));"; break;
+    case OP_LOADF: out << "loadf(" << r0 << ", " << r1 << ");"; break;
+    case OP_SETF: out << "setf(" << r0 << ", " << r1 << ");"; break;
+    case OP_PUSHV: out << "pushv(" << r2 << ");"; break;
+    case OP_POPV: out << "popv(" << r2 << ");"; break;
+    case OP_FRAME: out << "regs[" << int(word.cmd2ops.reg) << "] = frame + " << word.cmd2ops.adrs << ';'; break;
+    case OP_CALL:
+        out << "push(" << uint16_t(address + 2) << "); ";
+        emit_goto(out, word.cmd2ops.adrs, chunk_of, chunk);
+        return false;
+    case OP_ENDP:
+        out << "return pop();";
+        return false;
+    default: // Halt and unknown codes
+        out << "return HALTED;";
+        return false;
+    }
+    return true;
+}
+
+// Translating the program into a C++ program
+size_t translate_to_cpp(const Memory& memory, uint16_t entry, std::ostream& out)
+{
+    // Decoding from the known targets of the register-indirect jumps too, until no new ones are found
+    std::unique_ptr<ControlFlowGraph> graph(new ControlFlowGraph(memory, entry));
+    std::vector<int32_t> jump_targets = register_jump_targets(memory, *graph);
+    for (std::vector<uint16_t> roots; ; )
+    {
+        size_t known = roots.size();
+        for (uint32_t address = 0; address < Memory::MEM_SIZE; address++)
+            if (jump_targets[address] >= 0 && graph->block_at(jump_targets[address]) < 0)
+                roots.push_back(jump_targets[address]);
+        if (roots.size() == known) break;
+        graph.reset(new ControlFlowGraph(memory, entry, roots));
+        jump_targets = register_jump_targets(memory, *graph);
+    }
+    const ControlFlowGraph& cfg = *graph;
+    const std::vector<BasicBlock>& blocks = cfg.blocks();
+
+    // Functions of consecutive blocks with up to CHUNK_SIZE instructions, so the compiler
+    // doesn't get one huge function
+    std::vector<int> chunk_of(Memory::MEM_SIZE, -1);
+    std::vector<std::vector<uint16_t>> chunks; // Instructions of the functions by address
+    for (const BasicBlock& block : blocks)
+    {
+        if (chunks.empty() || chunks.back().size() >= CHUNK_SIZE) chunks.emplace_back();
+        for (uint32_t address = block.start; address <= block.last; address += 2)
+        {
+            chunk_of[address] = chunks.size() - 1;
+            chunks.back().push_back(address);
+        }
+    }
+
+    // Checking the rest of the block for the changed instructions, once after every change
+    auto emit_check = [&](int block, uint32_t first) {
+        out << "check(" << block << ", " << first << ", " << std::min<uint32_t>(blocks[block].last + 1, 0xFFFF) << ");";
+    };
+
+    out << "// Translated by VirtualMachine9 from the program with the entry address " << entry << '\n';
+    out << PRELUDE << '\n';
+
+    out << "static unsigned seen[" << std::max<size_t>(blocks.size(), 1) << "]; // Number of code changes checked by the blocks\n\n"
+        << "OP void check(int block, uint32_t first, uint32_t last)\n{\n"
+        << "    if (code_changes == seen[block]) return;\n"
+        << "    verify(first, last);\n"
+        << "    seen[block] = code_changes;\n}\n";
+
+    // Functions executing the instructions from the address up to a transition to another function,
+    // returning the address of the next instruction
+    size_t translated = 0;
+    for (size_t chunk = 0; chunk < chunks.size(); chunk++)
+    {
+        const std::vector<uint16_t>& addresses = chunks[chunk];
+        out << "\nstatic uint32_t code" << chunk << "(uint16_t ip)\n{\n    switch (ip)\n    {\n";
+        for (uint16_t address : addresses)
+        {
+            int block = cfg.block_at(address);
+            out << "    case " << address << ": ";
+            if (blocks[block].start != address)
+            {
+                emit_check(block, address); // Entering the block in the middle
+                out << ' ';
+            }
+            out << "goto L" << address << ";\n";
+        }
+        out << "    default: return untranslated(ip);\n    }\n\n";
+
+        for (size_t i = 0; i < addresses.size(); i++)
+        {
+            uint16_t address = addresses[i];
+            Word word = memory.get_word(address);
+            int block = cfg.block_at(address);
+            out << "L" << address << ": ";
+            if (blocks[block].start == address)
+            {
+                emit_check(block, address);
+                out << ' ';
+            }
+            bool falls_through = emit_command(out, word, address, chunk_of, chunk, jump_targets[address]);
+            if (writes_memory(word.cmd3ops.cmd) && address != blocks[block].last)
+            {
+                out << ' ';
+                emit_check(block, address + 2);
+            }
+            if (falls_through && (i + 1 == addresses.size() || addresses[i + 1] != uint16_t(address + 2)))
+            {
+                out << ' ';
+                emit_goto(out, address + 2, chunk_of, chunk);
+            }
+            out << " // " << disassemble(word) << '\n';
+        }
+        out << "}\n";
+        translated += addresses.size();
+    }
+
+    // The image (nonzero cells) and the cells of the instructions with their functions
+    out << "\nstatic const uint16_t IMAGE[][2] = {";
+    size_t count = 0;
+    for (uint32_t address = 0; address < Memory::MEM_SIZE; address += 2)
+    {
+        Word word = memory.get_word(address);
+        for (uint32_t i = 0; i < 2; i++)
+            if (word.cells[i]) out << (count++ % 8 ? " " : "\n    ") << '{' << address + i << ", " << word.cells[i] << "},";
+    }
+    if (!count) out << "\n    {0, 0},";
+    out << "\n};\n\nstatic const uint16_t CODE[][3] = {";
+    for (size_t i = 0; i < blocks.size(); i++)
+        out << (i % 8 ? " " : "\n    ") << '{' << blocks[i].start << ", "
+            << std::min<uint32_t>(blocks[i].last + 1, 0xFFFF) << ", " << chunk_of[blocks[i].start] << "},";
+    if (blocks.empty()) out << "\n    {1, 0, 0},";
+    out << "\n};\n\nstatic uint32_t (*const FUNCTIONS[])(uint16_t) = {";
+    for (size_t chunk = 0; chunk < chunks.size(); chunk++)
+        out << (chunk % 8 ? " " : "\n    ") << "code" << chunk << ',';
+    if (chunks.empty()) out << "\n    nullptr,";
+    out << "\n};\n\n";
+
+    out << "static uint32_t (*code_at[65536])(uint16_t); // Function of the instruction at the address\n\n"
+        << "int main()\n{\n"
+        << "    for (const auto& cell : IMAGE)\n"
+        << "        cells[cell[0]] = cell[1];\n"
+        << "    for (const auto& range : CODE)\n"
+        << "        for (uint32_t address = range[0]; address <= range[1]; address++)\n"
+        << "        {\n"
+        << "            code[address] = true;\n"
+        << "            original[address] = cells[address];\n"
+        << "            code_at[address] = FUNCTIONS[range[2]];\n"
+        << "        }\n\n"
+        << "    uint32_t ip = " << entry << ";\n"
+        << "    while (ip < HALTED)\n"
+        << "        ip = code_at[ip] ? code_at[ip](ip) : untranslated(ip);\n"
+        << "    return ip == HALTED ? 0 : 1;\n}\n";
+    return translated;
+}
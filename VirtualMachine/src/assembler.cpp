@@ -0,0 +1,545 @@
+#include "assembler.h"
+#include "cfg.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <map>
+
+// Operand layouts of the commands
+enum class Form : uint8_t
+{
+    NONE,      // HALT, ENDP, FENCE
+    JUMP,      // label, [label] or two registers
+    REG,       // One register in regs[2]: PRINT, NEG, INC, READ...
+    LOAD,      // Register and address: LOAD, SPAWN, FRAME
+    REGS2,     // Two registers in regs[0] and regs[1]: CMP, LOADR, LOADRV
+    REGS3,     // Three registers: ADD, MUL, AND...
+    NOT,       // Two registers in regs[0] and regs[2]
+    CALL,      // Address
+    LOADF,     // Register and flag index
+    SETF,      // Flag index and register
+    CHANNEL    // Port number and two registers: SEND, RECV
+};
+
+static Form command_form(uint8_t cmd) noexcept
+{
+    if (is_jump(cmd)) return Form::JUMP;
+    switch (cmd)
+    {
+    case OP_HALT: case OP_ENDP: case OP_FENCE: return Form::NONE;
+    case OP_PRINT: case OP_PRINTU: case OP_PRINTF: case OP_NEG: case OP_NEGF: case OP_INC: case OP_DEC:
+    case OP_READ: case OP_READU: case OP_READF: case OP_JOIN: case OP_PUSHV: case OP_POPV: return Form::REG;
+    case OP_LOAD: case OP_SPAWN: case OP_FRAME: return Form::LOAD;
+    case OP_CMP: case OP_CMPU: case OP_CMPF: case OP_LOADR: case OP_LOADRV: return Form::REGS2;
+    case OP_NOT: return Form::NOT;
+    case OP_CALL: return Form::CALL;
+    case OP_LOADF: return Form::LOADF;
+    case OP_SETF: return Form::SETF;
+    case OP_SEND: case OP_RECV: return Form::CHANNEL;
+    default: return Form::REGS3;
+    }
+}
+
+// Ranges of the absolute addresses and of the signed offsets of the relative jumps and FRAME
+static constexpr int64_t ADDRESS_MIN = 0, ADDRESS_MAX = UINT16_MAX, OFFSET_MIN = INT16_MIN, OFFSET_MAX = INT16_MAX;
+
+// Statement of the source
+struct Item
+{
+    enum Type { COMMAND, DATA, LABEL, ORG, ALIGN } type;
+    size_t line;
+    uint8_t cmd;                       // COMMAND
+    char kind;                         // DATA: 'i', 'u' or 'f'
+    std::string name;                  // LABEL
+    std::vector<std::string> operands; // COMMAND, DATA, ORG, ALIGN
+    uint32_t address;
+    uint32_t padding;                  // ALIGN: number of skipped cells
+};
+
+class Assembler
+{
+public:
+    Assembler(AssembledProgram& program, AsmError& error) : program(program), error(error) {}
+
+    bool parse(const char* begin, const char* end);
+    bool layout();
+    bool encode();
+
+private:
+    AssembledProgram& program;
+    AsmError& error;
+    std::vector<Item> sections[2]; // .text and .data
+    int section = 0;
+    std::map<std::string, int64_t> symbols;
+    std::string entry;
+    size_t entry_line = 0;
+
+    bool fail(size_t line, const std::string& message)
+    {
+        error = AsmError { line, message };
+        return false;
+    }
+
+    bool parse_line(std::string line, size_t number);
+    bool value(const Item& item, const std::string& text, int64_t& result);
+    bool value(const Item& item, const std::string& text, int64_t min, int64_t max, int64_t& result);
+    bool number(const Item& item, const std::string& text, int64_t min, int64_t max, int64_t& result);
+    bool reg(const Item& item, const std::string& text, uint8_t& result);
+    bool encode_command(const Item& item, Word& word);
+};
+
+static bool is_name_start(char c) noexcept
+{
+    return isalpha((unsigned char)c) || c == '_' || c == '.';
+}
+
+static bool is_name(const std::string& text) noexcept
+{
+    if (text.empty() || !is_name_start(text[0])) return false;
+    for (char c : text)
+        if (!isalnum((unsigned char)c) && c != '_' && c != '.') return false;
+    return true;
+}
+
+static std::string upper(std::string text)
+{
+    for (char& c : text)
+        c = toupper((unsigned char)c);
+    return text;
+}
+
+// Splitting the source into statements
+bool Assembler::parse(const char* begin, const char* end)
+{
+    size_t number = 1;
+    while (begin < end)
+    {
+        const char* eol = std::find(begin, end, '\n');
+        if (!parse_line(std::string(begin, std::find(begin, eol, '#')), number))
+            return false;
+        begin = eol < end ? eol + 1 : end;
+        number++;
+    }
+    return true;
+}
+
+bool Assembler::parse_line(std::string line, size_t number)
+{
+    // Operands are separated by commas or spaces
+    std::vector<std::string> tokens;
+    std::string token;
+    for (char c : line + " ")
+    {
+        if (isspace((unsigned char)c) || c == ',')
+        {
+            if (!token.empty()) tokens.push_back(token);
+            token.clear();
+        }
+        else token += c;
+    }
+
+    size_t i = 0;
+    while (i < tokens.size() && tokens[i].size() > 1 && tokens[i].back() == ':')
+    {
+        std::string name = tokens[i].substr(0, tokens[i].size() - 1);
+        if (!is_name(name)) return fail(number, "invalid label '" + name + "'");
+        sections[section].push_back(Item { Item::LABEL, number, 0, 0, name, {}, 0, 0 });
+        i++;
+    }
+    if (i == tokens.size()) return true;
+
+    std::string op = tokens[i];
+    std::vector<std::string> operands(tokens.begin() + i + 1, tokens.end());
+    std::string directive = op[0] == '.' ? op.substr(1) : "";
+
+    if (directive == "text" || directive == "data")
+    {
+        section = directive == "data";
+        return operands.empty() || fail(number, "unexpected operand");
+    }
+    if (directive == "entry" || directive == "equ")
+    {
+        if (operands.size() != (directive == "entry" ? 1u : 2u)) return fail(number, "wrong number of operands");
+        if (directive == "entry")
+        {
+            entry = operands[0];
+            entry_line = number;
+            return true;
+        }
+        if (!is_name(operands[0])) return fail(number, "invalid name '" + operands[0] + "'");
+        int64_t result;
+        const char* first = operands[1].data();
+        const char* last = first + operands[1].size();
+        if (std::from_chars(first, last, result).ptr != last) return fail(number, "invalid number '" + operands[1] + "'");
+        if (!symbols.emplace(operands[0], result).second) return fail(number, "'" + operands[0] + "' is already defined");
+        return true;
+    }
+    if (directive == "org" || directive == "align")
+    {
+        if (operands.size() != 1) return fail(number, "wrong number of operands");
+        sections[section].push_back(Item { directive == "org" ? Item::ORG : Item::ALIGN, number, 0, 0, "", operands, 0, 0 });
+        return true;
+    }
+    if (directive == "int" || directive == "uint" || directive == "float")
+    {
+        if (operands.size() != 1) return fail(number, "wrong number of operands");
+        char kind = directive == "int" ? 'i' : directive == "uint" ? 'u' : 'f';
+        sections[section].push_back(Item { Item::DATA, number, 0, kind, "", operands, 0, 0 });
+        return true;
+    }
+    if (!directive.empty()) return fail(number, "unknown directive '" + op + "'");
+
+    const char* const* name = std::find_if(OPCODE_NAMES, OPCODE_NAMES + OPCODES_COUNT,
+                                           [&](const char* mnemonic) { return upper(op) == mnemonic; });
+    if (name == OPCODE_NAMES + OPCODES_COUNT) return fail(number, "unknown command '" + op + "'");
+    sections[section].push_back(Item { Item::COMMAND, number, uint8_t(name - OPCODE_NAMES), 0, "", operands, 0, 0 });
+    return true;
+}
+
+// Number in the range
+bool Assembler::number(const Item& item, const std::string& text, int64_t min, int64_t max, int64_t& result)
+{
+    const char* first = text.data();
+    const char* last = first + text.size();
+    if (std::from_chars(first, last, result).ptr != last || text.empty())
+        return fail(item.line, "invalid number '" + text + "'");
+    if (result < min || result > max)
+        return fail(item.line, "value '" + text + "' out of range");
+    return true;
+}
+
+// Number, name or name with offset (name+4, name-2)
+bool Assembler::value(const Item& item, const std::string& text, int64_t& result)
+{
+    if (text.empty() || !is_name_start(text[0]))
+        return number(item, text, INT32_MIN, UINT32_MAX, result);
+
+    size_t sign = text.find_first_of("+-");
+    std::string name = text.substr(0, sign);
+    auto symbol = symbols.find(name);
+    if (symbol == symbols.end()) return fail(item.line, "undefined name '" + name + "'");
+    result = symbol->second;
+    if (sign == std::string::npos) return true;
+
+    int64_t offset;
+    if (!number(item, text.substr(sign + 1), 0, UINT16_MAX, offset)) return false;
+    result += text[sign] == '+' ? offset : -offset;
+    return true;
+}
+
+// Number or name in the range
+bool Assembler::value(const Item& item, const std::string& text, int64_t min, int64_t max, int64_t& result)
+{
+    if (!value(item, text, result)) return false;
+    if (result < min || result > max) return fail(item.line, "value '" + text + "' out of range");
+    return true;
+}
+
+// Register r0..r255
+bool Assembler::reg(const Item& item, const std::string& text, uint8_t& result)
+{
+    int64_t index;
+    if (text.size() < 2 || (text[0] != 'r' && text[0] != 'R'))
+        return fail(item.line, "register expected instead of '" + text + "'");
+    if (!number(item, text.substr(1), 0, Processor::ADDRESS_REGS - 1, index)) return false;
+    result = index;
+    return true;
+}
+
+// Assigning addresses to the statements, the data goes right after the code
+bool Assembler::layout()
+{
+    uint32_t address = 0;
+    for (std::vector<Item>& items : sections)
+    {
+        for (Item& item : items)
+        {
+            int64_t argument = 0;
+            if ((item.type == Item::ORG || item.type == Item::ALIGN)
+                && !number(item, item.operands[0], 1, Memory::MEM_SIZE, argument))
+                return false;
+
+            if (item.type == Item::ORG)
+                address = argument;
+            else if (item.type == Item::ALIGN)
+            {
+                if (argument % 2) return fail(item.line, "alignment must be even");
+                if (address % 2) return fail(item.line, "can't align after an odd address");
+                item.address = address;
+                address = (address + argument - 1) / argument * argument;
+                item.padding = address - item.address;
+            }
+            else if (item.type == Item::LABEL)
+            {
+                if (!symbols.emplace(item.name, address).second)
+                    return fail(item.line, "'" + item.name + "' is already defined");
+            }
+            else
+            {
+                if (address + 1 >= Memory::MEM_SIZE) return fail(item.line, "program does not fit into memory");
+                item.address = address;
+                address += 2;
+            }
+        }
+    }
+    return true;
+}
+
+// Encoding the operands of a command
+bool Assembler::encode_command(const Item& item, Word& word)
+{
+    static const size_t OPERANDS[] = { 0, 1, 1, 2, 2, 3, 2, 1, 2, 2, 3 };
+    const std::vector<std::string>& ops = item.operands;
+    Form form = command_form(item.cmd);
+    word = Word();
+    word.cmd3ops.cmd = item.cmd;
+
+    bool register_jump = form == Form::JUMP && ops.size() == 2;
+    if (ops.size() != OPERANDS[(int)form] && !register_jump)
+        return fail(item.line, std::string("wrong number of operands for ") + OPCODE_NAMES[item.cmd]);
+
+    int64_t address;
+    switch (form)
+    {
+    case Form::NONE:
+        return true;
+    case Form::JUMP:
+        if (register_jump) // IP = reg1 + reg2
+        {
+            word.cmd3ops.regs[0] = 2;
+            return reg(item, ops[0], word.cmd3ops.regs[1]) && reg(item, ops[1], word.cmd3ops.regs[2]);
+        }
+        if (ops[0].size() > 2 && ops[0].front() == '[' && ops[0].back() == ']') // IP = value of the variable
+        {
+            word.cmd2ops.reg = 1;
+            if (!value(item, ops[0].substr(1, ops[0].size() - 2), ADDRESS_MIN, ADDRESS_MAX, address)) return false;
+        }
+        else if (ops[0].size() > 2 && ops[0][0] == '$' && (ops[0][1] == '+' || ops[0][1] == '-')) // IP = IP + offset
+        {
+            word.cmd2ops.reg = 3;
+            if (!number(item, ops[0].substr(ops[0][1] == '+' ? 2 : 1), OFFSET_MIN, OFFSET_MAX, address)) return false;
+        }
+        else if (!value(item, ops[0], ADDRESS_MIN, ADDRESS_MAX, address)) return false;
+        word.cmd2ops.adrs = address;
+        return true;
+    case Form::REG:
+        return reg(item, ops[0], word.cmd3ops.regs[2]);
+    case Form::LOAD:
+    {
+        bool offset = item.cmd == OP_FRAME; // Signed offset from the frame pointer
+        if (!reg(item, ops[0], word.cmd3ops.regs[0]) ||
+            !value(item, ops[1], offset ? OFFSET_MIN : ADDRESS_MIN, offset ? OFFSET_MAX : ADDRESS_MAX, address)) return false;
+        word.cmd2ops.adrs = address;
+        return true;
+    }
+    case Form::REGS2:
+        return reg(item, ops[0], word.cmd3ops.regs[0]) && reg(item, ops[1], word.cmd3ops.regs[1]);
+    case Form::REGS3:
+        return reg(item, ops[0], word.cmd3ops.regs[0]) && reg(item, ops[1], word.cmd3ops.regs[1])
+            && reg(item, ops[2], word.cmd3ops.regs[2]);
+    case Form::NOT:
+        return reg(item, ops[0], word.cmd3ops.regs[0]) && reg(item, ops[1], word.cmd3ops.regs[2]);
+    case Form::CALL:
+        if (!value(item, ops[0], ADDRESS_MIN, ADDRESS_MAX, address)) return false;
+        word.cmd2ops.adrs = address;
+        return true;
+    case Form::LOADF:
+    {
+        int64_t flag;
+        if (!reg(item, ops[0], word.cmd3ops.regs[0]) || !number(item, ops[1], 0, 15, flag)) return false;
+        word.cmd3ops.regs[1] = flag;
+        return true;
+    }
+    case Form::SETF:
+    {
+        int64_t flag;
+        if (!number(item, ops[0], 0, 15, flag) || !reg(item, ops[1], word.cmd3ops.regs[1])) return false;
+        word.cmd3ops.regs[0] = flag;
+        return true;
+    }
+    case Form::CHANNEL:
+    {
+        int64_t port;
+        if (!number(item, ops[0], 0, Processor::PORTS - 1, port)) return false;
+        word.cmd3ops.regs[0] = port;
+        return reg(item, ops[1], word.cmd3ops.regs[1]) && reg(item, ops[2], word.cmd3ops.regs[2]);
+    }
+    }
+    return true;
+}
+
+// Producing the words with all names resolved
+bool Assembler::encode()
+{
+    std::map<uint32_t, std::string> labels;
+    std::vector<uint8_t> used(Memory::MEM_SIZE, 0);
+    for (int s = 1; s >= 0; s--) // Data labels are overridden by the code ones at the same address
+        for (const Item& item : sections[s])
+            if (item.type == Item::LABEL) labels[symbols[item.name]] = item.name;
+
+    auto add_word = [&](const Item& item, Word word, char kind) {
+        if (used[item.address] || used[item.address + 1])
+            return fail(item.line, "overlaps with another statement");
+        used[item.address] = used[item.address + 1] = 1;
+        auto label = labels.find(item.address);
+        program.words.push_back(AsmWord { (uint16_t)item.address, word, kind,
+                                          label != labels.end() ? label->second : "" });
+        return true;
+    };
+
+    for (const std::vector<Item>& items : sections)
+    {
+        for (const Item& item : items)
+        {
+            Word word = Word();
+            if (item.type == Item::COMMAND)
+            {
+                if (!encode_command(item, word) || !add_word(item, word, 'k')) return false;
+            }
+            else if (item.type == Item::DATA)
+            {
+                int64_t result;
+                if (item.kind == 'f')
+                {
+                    const char* first = item.operands[0].data();
+                    const char* last = first + item.operands[0].size();
+                    if (std::from_chars(first, last, word.fval).ptr != last)
+                        return fail(item.line, "invalid number '" + item.operands[0] + "'");
+                }
+                else if (!value(item, item.operands[0], result)) return false;
+                else word.uval = result;
+                if (!add_word(item, word, item.kind)) return false;
+            }
+            else if (item.type == Item::ALIGN && &items == &sections[0])
+            {
+                // Code running into the aligned address passes the padding with LOADR r0, r0
+                Word nop = Word();
+                nop.cmd3ops.cmd = OP_LOADR;
+                Item padding = item;
+                for (; padding.address < item.address + item.padding; padding.address += 2)
+                    if (!add_word(padding, nop, 'k')) return false;
+            }
+        }
+    }
+
+    std::sort(program.words.begin(), program.words.end(),
+              [](const AsmWord& a, const AsmWord& b) { return a.address < b.address; });
+
+    int64_t start = program.words.empty() ? 0 : program.words.front().address;
+    for (const Item& item : sections[0])
+        if (item.type == Item::COMMAND)
+        {
+            start = item.address;
+            break;
+        }
+    if (!entry.empty() && !value(Item { Item::LABEL, entry_line, 0, 0, "", {}, 0, 0 }, entry, start))
+        return false;
+    program.entry = start;
+    return true;
+}
+
+// Assembling the source into the program
+bool assemble(const char* begin, const char* end, AssembledProgram& program, AsmError& error)
+{
+    Assembler assembler(program, error);
+    program = AssembledProgram();
+    error = AsmError();
+    return assembler.parse(begin, end) && assembler.layout() && assembler.encode();
+}
+
+// Writing the program into memory
+void AssembledProgram::load(Processor& cpu) const
+{
+    for (const AsmWord& word : words)
+        cpu.memory.set_word(word.address, word.word);
+}
+
+// Writing the program in the text bytecode format
+void AssembledProgram::write_text(std::ostream& out) const
+{
+    // The mark "e" is written to memory as the halt command, the program starts two cells before its value.
+    // After a word at the end of the memory there's no room for it, then it goes first at the address
+    // of the first word, which is written over it
+    uint16_t entry_mark = entry + 2;
+    bool entry_first = !words.empty() && words.back().address + 3u >= Memory::MEM_SIZE;
+    uint32_t address = words.empty() ? 0 : words.front().address;
+    out << "a " << address << '\n';
+    if (entry_first) out << "e " << entry_mark << "\na " << address << '\n';
+    for (const AsmWord& word : words)
+    {
+        if (word.address != address)
+            out << "a " << word.address << '\n';
+        address = word.address + 2;
+
+        Word w = word.word;
+        uint8_t cmd = w.cmd3ops.cmd;
+        if (word.kind == 'i') out << "i " << w.ival;
+        else if (word.kind == 'u') out << "u " << w.uval;
+        else if (word.kind == 'f')
+        {
+            char buffer[32];
+            out << "f " << std::string(buffer, std::to_chars(buffer, buffer + sizeof(buffer), w.fval).ptr);
+        }
+        else
+        {
+            out << "k " << (int)cmd;
+            if (cmd == OP_CALL)
+                out << ' ' << w.cmd2ops.adrs;
+            else if (cmd == OP_LOAD || cmd == OP_SPAWN || cmd == OP_FRAME || (is_jump(cmd) && w.cmd3ops.regs[0] != 2))
+                out << ' ' << (int)w.cmd2ops.reg << ' ' << w.cmd2ops.adrs;
+            else if (w.uval >> 8)
+                out << ' ' << (int)w.cmd3ops.regs[0] << ' ' << (int)w.cmd3ops.regs[1] << ' ' << (int)w.cmd3ops.regs[2];
+        }
+
+        if (!word.label.empty() || word.kind == 'k') out << " #";
+        if (!word.label.empty()) out << ' ' << word.label << ':';
+        if (word.kind == 'k') out << ' ' << disassemble(w);
+        out << '\n';
+    }
+    if (!entry_first) out << "e " << entry_mark << '\n';
+}
+
+// Writing the program as a binary image: "VM9B", version, entry, number of segments,
+// then the address, the number of cells and the cells of each segment. All numbers are
+// 16-bit little-endian
+void AssembledProgram::write_binary(std::ostream& out) const
+{
+    std::vector<uint16_t> image = { 1, entry, 0 };
+    size_t count_at = 0;
+    for (size_t i = 0; i < words.size(); i++)
+    {
+        if (i == 0 || words[i].address != words[i - 1].address + 2)
+        {
+            image[2]++;
+            image.push_back(words[i].address);
+            count_at = image.size();
+            image.push_back(0);
+        }
+        image.push_back(words[i].word.cells[0]);
+        image.push_back(words[i].word.cells[1]);
+        image[count_at] += 2;
+    }
+
+    out.write("VM9B", 4);
+    for (uint16_t value : image)
+    {
+        char bytes[2] = { char(value & 0xFF), char(value >> 8) };
+        out.write(bytes, 2);
+    }
+}
+
+// Collecting the program loaded into memory
+AssembledProgram program_from_memory(const Memory& memory, uint16_t entry)
+{
+    ControlFlowGraph cfg(memory, entry);
+    AssembledProgram program;
+    program.entry = entry;
+    for (uint32_t address = 0; address + 1 < Memory::MEM_SIZE; address += 2)
+    {
+        Word word = memory.get_word(address);
+        bool is_code = cfg.block_at(address) >= 0;
+        if (is_code || word.uval != 0)
+            program.words.push_back(AsmWord { uint16_t(address), word, is_code ? 'k' : 'u', "" });
+    }
+    return program;
+}
@@ -0,0 +1,330 @@
+#include "async_host.h"
+#include "guest_input.h"
+#include "metrics.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+
+struct AsyncHost::Guest
+{
+    Processor* proc;
+    size_t node;   // Of the pool of the processor
+    size_t worker; // Running the guest
+    GuestInput input;
+    std::ostringstream output;
+    int fd;
+    uint16_t entry;
+    bool started = false;
+    bool watched = false; // The descriptor was added to epoll
+};
+
+static void write_all(int fd, const std::string& text) noexcept
+{
+    for (size_t sent = 0; sent < text.size();)
+    {
+        ssize_t written = write(fd, text.data() + sent, text.size() - sent);
+        if (written <= 0) break;
+        sent += written;
+    }
+}
+
+// Markers of the descriptors that aren't guests in the epoll events
+static char LISTENER, WAKER;
+
+AsyncHost::AsyncHost(size_t threads, size_t max_guests)
+{
+    signal(SIGPIPE, SIG_IGN); // Output to a closed connection is dropped
+
+    // A pool is created by a thread running on its node, so the processors are in the memory of the node
+    size_t nodes = topology.nodes();
+    for (size_t node = 0; node < nodes; node++)
+    {
+        size_t capacity = max_guests / nodes + (node < max_guests % nodes ? 1 : 0);
+        std::thread([this, node, capacity] {
+            NumaTopology::pin_thread(topology.cpus(node));
+            pools.emplace_back(new ProcessorPool(capacity, topology.node_id(node)));
+        }).join();
+    }
+
+    // Worker i runs on node i % nodes
+    for (size_t i = 0; i < (threads ? threads : 1); i++)
+    {
+        Worker* worker = new Worker();
+        worker->node = i % nodes;
+        const std::vector<int>& cpus = topology.cpus(worker->node);
+        worker->cpu = cpus[i / nodes % cpus.size()];
+        workers.emplace_back(worker);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &WAKER;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+}
+
+AsyncHost::~AsyncHost()
+{
+    for (const std::unique_ptr<Worker>& worker : workers)
+        for (Guest* guest : worker->queue)
+        {
+            close(guest->fd);
+            pools[guest->node]->release(guest->proc);
+            delete guest;
+        }
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+        unlink(listen_path.c_str());
+    }
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+// New guests go to the workers in turn. When the pool of the worker's node is empty,
+// the processor comes from another node
+bool AsyncHost::add_guest(const AssembledProgram& program, int fd)
+{
+    size_t home;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        home = next_worker++ % workers.size();
+    }
+    size_t node = workers[home]->node;
+    Processor* proc = pools[node]->acquire();
+    for (size_t other = 0; !proc && other < pools.size(); other++)
+        if ((proc = pools[other]->acquire())) node = other;
+    if (!proc)
+    {
+        write_all(fd, "Too many guests.\n");
+        close(fd);
+        return false;
+    }
+
+    Guest* guest = new Guest();
+    guest->proc = proc;
+    guest->node = node;
+    guest->worker = home;
+    program.load(*proc);
+    proc->set_extended_stack(call_stack_limit);
+    proc->set_fast_float(fast_float);
+    proc->set_data_stack(0, data_stack_limit);
+    guest->entry = program.entry;
+    guest->fd = fd;
+    proc->input = &guest->input;
+    proc->output = &guest->output;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        guests++;
+    }
+    schedule(guest);
+    return true;
+}
+
+bool AsyncHost::listen(const std::string& path, const AssembledProgram& program)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) return false;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 128) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &LISTENER;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    listen_fd = fd;
+    listen_path = path;
+    listen_program = program;
+    return true;
+}
+
+void AsyncHost::run()
+{
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers.size(); i++)
+        threads.emplace_back(&AsyncHost::worker, this, i);
+
+    epoll_event events[64];
+    char data[4096];
+    bool running;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = guests > 0 || listen_fd >= 0;
+    }
+    while (running)
+    {
+        int count = epoll_wait(epoll_fd, events, 64, -1);
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.ptr == &LISTENER)
+            {
+                int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client >= 0) add_guest(listen_program, client);
+            }
+            else if (events[i].data.ptr == &WAKER)
+            {
+                uint64_t value;
+                if (read(wake_fd, &value, sizeof(value)) < 0) continue;
+                std::lock_guard<std::mutex> lock(mutex);
+                running = guests > 0 || listen_fd >= 0;
+            }
+            else
+            {
+                // The guest waits in READ, its descriptor isn't watched until it stops again
+                Guest* guest = static_cast<Guest*>(events[i].data.ptr);
+                ssize_t received = read(guest->fd, data, sizeof(data));
+                if (received > 0) guest->input.append(data, received);
+                else guest->input.close();
+                schedule(guest);
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        for (const std::unique_ptr<Worker>& worker : workers)
+            worker->wake.notify_one();
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+// The guest waits for its worker. If the worker is busy, an idle one (of the same node first) is woken to take it
+void AsyncHost::schedule(Guest* guest)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Worker& home = *workers[guest->worker];
+    home.queue.push_back(guest);
+    if (home.idle)
+    {
+        home.wake.notify_one();
+        return;
+    }
+    Worker* helper = nullptr;
+    for (const std::unique_ptr<Worker>& worker : workers)
+        if (worker->idle && (!helper || (worker->node == home.node && helper->node != home.node)))
+            helper = worker.get();
+    if (helper) helper->wake.notify_one();
+}
+
+// The oldest guest of the worker, or the newest one waiting for a busy worker. Called with the mutex held
+AsyncHost::Guest* AsyncHost::take(size_t index)
+{
+    Worker& self = *workers[index];
+    Guest* guest = nullptr;
+    if (!self.queue.empty())
+    {
+        guest = self.queue.front();
+        self.queue.pop_front();
+        return guest;
+    }
+
+    // An idle worker was woken for its guests, they aren't taken
+    Worker* busy = nullptr;
+    for (const std::unique_ptr<Worker>& worker : workers)
+        if (worker.get() != &self && !worker->idle && !worker->queue.empty() &&
+            (!busy || (worker->node == self.node && busy->node != self.node)))
+            busy = worker.get();
+    if (!busy) return nullptr;
+    guest = busy->queue.back();
+    busy->queue.pop_back();
+    guest->worker = index;
+
+    ThreadMetrics& metrics = ThreadMetrics::local();
+    ThreadMetrics::add(metrics.migrations, 1);
+    if (busy->node != self.node) ThreadMetrics::add(metrics.remote_migrations, 1);
+    return guest;
+}
+
+// Running the guests of the worker (and the ones it takes) until they stop
+void AsyncHost::worker(size_t index)
+{
+    Worker& self = *workers[index];
+    ThreadMetrics& metrics = ThreadMetrics::local();
+    if (NumaTopology::pin_thread({ self.cpu }))
+        metrics.node.store(topology.node_id(self.node), std::memory_order_relaxed);
+
+    for (;;)
+    {
+        Guest* guest;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!(guest = take(index)))
+            {
+                if (stopping) return;
+                self.idle = true;
+                self.wake.wait(lock);
+                self.idle = false;
+            }
+        }
+
+        // Resuming from the READ that stopped the guest
+        uint64_t executed = guest->proc->executed;
+        guest->proc->run(guest->started ? guest->proc->get_ip() : guest->entry);
+        guest->started = true;
+        ThreadMetrics::add(metrics.runs, 1);
+        if (guest->node != self.node)
+        {
+            ThreadMetrics::add(metrics.remote_runs, 1);
+            ThreadMetrics::add(metrics.remote_instructions, guest->proc->executed - executed);
+        }
+
+        if (guest->proc->trap == Processor::Trap::STACK_OVERFLOW)
+            guest->output << "Call stack overflow at address " << guest->proc->get_ip() << ".\n";
+        else if (guest->proc->trap == Processor::Trap::STACK_UNDERFLOW)
+            guest->output << "Return with empty call stack at address " << guest->proc->get_ip() << ".\n";
+        else if (guest->proc->trap == Processor::Trap::DATA_STACK_OVERFLOW)
+            guest->output << "Data stack overflow at address " << guest->proc->get_ip() << ".\n";
+        else if (guest->proc->trap == Processor::Trap::DATA_STACK_UNDERFLOW)
+            guest->output << "Pop from empty data stack frame at address " << guest->proc->get_ip() << ".\n";
+
+        write_all(guest->fd, guest->output.str());
+        guest->output.str(std::string());
+
+        if (guest->proc->trap == Processor::Trap::NEEDS_INPUT) suspend(guest);
+        else finish(guest);
+    }
+}
+
+// Waiting for the input in the epoll loop, one event at a time
+void AsyncHost::suspend(Guest* guest)
+{
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = guest;
+    epoll_ctl(epoll_fd, guest->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, guest->fd, &event);
+    guest->watched = true;
+}
+
+void AsyncHost::finish(Guest* guest)
+{
+    if (guest->watched) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, guest->fd, nullptr);
+    close(guest->fd);
+    pools[guest->node]->release(guest->proc);
+    delete guest;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--guests == 0)
+    {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) return;
+    }
+}
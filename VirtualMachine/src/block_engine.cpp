@@ -0,0 +1,248 @@
+#include "block_engine.h"
+#include "metrics.h"
+#include "memoizer.h"
+#include <cfenv>
+
+BlockEngine::BlockEngine(Processor& proc) : proc(proc), block_at(Memory::MEM_SIZE, nullptr)
+{
+}
+
+// Starting the processor
+void BlockEngine::run(uint16_t start_address)
+{
+    if (proc.memory.code_written) flush();
+
+    std::chrono::steady_clock::time_point start;
+    if (proc.metrics)
+    {
+        proc.metrics->run_started();
+        start = std::chrono::steady_clock::now();
+    }
+
+    proc.set_ip(start_address);
+    proc.trap = Processor::Trap::NONE;
+    if (proc.fast_float()) feclearexcept(FE_ALL_EXCEPT);
+    DecodedBlock* block = find_block(start_address);
+    while (block)
+        block = execute(block);
+    if (proc.fast_float()) proc.collect_float_exceptions();
+
+    if (proc.metrics) proc.metrics->run_finished(std::chrono::steady_clock::now() - start);
+}
+
+// Dropping all decoded blocks
+void BlockEngine::flush() noexcept
+{
+    for (const std::unique_ptr<DecodedBlock>& block : blocks)
+        block_at[block->start] = nullptr;
+    blocks.clear();
+    shadow_stack.clear();
+    proc.memory.clear_code_marks();
+}
+
+// Start addresses of the decoded blocks, in the order of decoding
+std::vector<uint16_t> BlockEngine::block_starts() const
+{
+    std::vector<uint16_t> starts;
+    starts.reserve(blocks.size());
+    for (const std::unique_ptr<DecodedBlock>& block : blocks)
+        starts.push_back(block->start);
+    return starts;
+}
+
+// Decoding the blocks before the run
+void BlockEngine::predecode(const std::vector<uint16_t>& starts)
+{
+    if (proc.memory.code_written) flush();
+    for (uint16_t start : starts)
+        find_block(start);
+}
+
+// Searching for the block starting at the address, decoding it on the first use
+DecodedBlock* BlockEngine::find_block(uint16_t address)
+{
+    if (address + 1u >= Memory::MEM_SIZE) return nullptr;
+    DecodedBlock* block = block_at[address];
+    return block ? block : decode(address);
+}
+
+// Decoding the instructions up to the first jump, CALL, ENDP or halt
+DecodedBlock* BlockEngine::decode(uint16_t address)
+{
+    std::unique_ptr<DecodedBlock> block(new DecodedBlock());
+    block->start = address;
+    block->exit = BlockExit::HALT;
+
+    uint32_t current = address;
+    while (current + 1 < Memory::MEM_SIZE)
+    {
+        Word word = proc.memory.get_word(current);
+        uint8_t cmd = word.cmd3ops.cmd;
+        const Command* command = proc.command(cmd);
+        if (!command) break;
+
+        if (is_jump(cmd))
+        {
+            command = jump_command(word); // Specialized on the addressing mode
+            block->condition = JUMP_MASKS[cmd];
+            uint8_t mode = word.cmd3ops.regs[0];
+            block->exit = mode == 1 || mode == 2 ? BlockExit::INDIRECT : BlockExit::JUMP;
+            if (mode == 0) block->links[0].ip = word.cmd2ops.adrs;
+            else if (mode != 1 && mode != 2) block->links[0].ip = current + word.cmd2ops.adrs;
+            block->links[1].ip = current + 2;
+            if (block->exit == BlockExit::INDIRECT)
+            {
+                block->cache = &ic_stats[current];
+                block->cache->mode = mode;
+            }
+        }
+        else if (cmd == OP_CALL)
+        {
+            block->exit = BlockExit::CALL;
+            block->links[0].ip = word.cmd2ops.adrs;
+            block->links[1].ip = current + 2; // Return point, used by the shadow return stack
+        }
+        else if (cmd == OP_ENDP)
+            block->exit = BlockExit::ENDP;
+        else
+        {
+            block->body.push_back(DecodedInsn { command, word });
+            current += 2;
+            continue;
+        }
+
+        block->last = DecodedInsn { command, word };
+        break;
+    }
+    block->exit_address = current;
+    proc.memory.mark_code(address, current + 1 < Memory::MEM_SIZE ? current + 1 : Memory::MEM_SIZE - 1);
+
+    DecodedBlock* result = block.get();
+    block_at[address] = result;
+    blocks.push_back(std::move(block));
+    return result;
+}
+
+// Executing a block. Returns the next block or nullptr if the processor stops
+DecodedBlock* BlockEngine::execute(DecodedBlock* block)
+{
+    uint16_t address = block->start;
+    proc.executed += block->body.size() + (block->exit != BlockExit::HALT);
+    for (const DecodedInsn& insn : block->body)
+    {
+        (*insn.command)(insn.word, proc);
+
+        // READ stopped the processor waiting for input or the data stack failed, the Instruction Pointer stays at the command
+        if (proc.trap != Processor::Trap::NONE)
+        {
+            proc.executed -= (block->exit_address - address) / 2 + (block->exit != BlockExit::HALT);
+            proc.set_ip(address);
+            return nullptr;
+        }
+        if (proc.metrics) proc.metrics->count(insn.word.cmd3ops.cmd);
+        address += 2;
+
+        // The program changed its own code, the decoded blocks can't be used anymore
+        if (proc.memory.code_written)
+        {
+            proc.executed -= (block->exit_address - address) / 2 + (block->exit != BlockExit::HALT);
+            flush();
+            proc.set_ip(address);
+            return find_block(address);
+        }
+    }
+
+    proc.set_ip(block->exit_address);
+    Word word = block->last.word;
+    switch (block->exit)
+    {
+    case BlockExit::HALT:
+        return nullptr;
+    case BlockExit::JUMP:
+    {
+        // The condition selects one of the two successors, links[0] is the target
+        if (proc.metrics) proc.metrics->count(word.cmd3ops.cmd);
+        BlockLink& link = block->links[!jump_taken(block->condition, proc.flags)];
+        proc.set_ip(link.ip);
+        return link.block ? link.block : link.block = find_block(link.ip);
+    }
+    case BlockExit::INDIRECT:
+        (*block->last.command)(word, proc);
+        if (proc.metrics) proc.metrics->count(word.cmd3ops.cmd);
+        break;
+    case BlockExit::CALL:
+        if (proc.memo && proc.memo->call(proc, word.cmd2ops.adrs)) // The results are taken from the cache
+        {
+            proc.set_ip(block->exit_address + 2);
+            if (proc.metrics) proc.metrics->count(OP_CALL);
+            break;
+        }
+        proc.push(block->exit_address + 2);
+        if (proc.trap != Processor::Trap::NONE)
+        {
+            proc.executed--;
+            return nullptr;
+        }
+        proc.set_ip(word.cmd2ops.adrs);
+        if (proc.metrics) proc.metrics->count(OP_CALL);
+        if (shadow_stack.size() < SHADOW_STACK_SIZE) shadow_stack.push_back(&block->links[1]);
+        break;
+    case BlockExit::ENDP:
+    {
+        uint16_t return_to = proc.pop();
+        if (proc.trap != Processor::Trap::NONE)
+        {
+            proc.executed--;
+            return nullptr;
+        }
+        proc.set_ip(return_to);
+        if (proc.metrics) proc.metrics->count(OP_ENDP);
+        if (proc.memo) proc.memo->returned(proc);
+
+        // The shadow return stack keeps the block following the CALL
+        if (!shadow_stack.empty())
+        {
+            BlockLink* link = shadow_stack.back();
+            shadow_stack.pop_back();
+            if (link->ip == return_to)
+                return link->block ? link->block : link->block = find_block(return_to);
+            shadow_stack.clear(); // The return address doesn't match the CALL, the prediction is lost
+        }
+        return find_block(return_to);
+    }
+    }
+
+    uint16_t ip = proc.get_ip();
+    if (block->exit == BlockExit::INDIRECT && (word.cmd3ops.cmd == OP_JMP || ip != block->links[1].ip))
+    {
+        InlineCacheStats* cache = block->cache;
+        cache->target = ip;
+        if (block->links[0].block && block->links[0].ip == ip)
+        {
+            cache->hits++;
+            return block->links[0].block;
+        }
+        cache->misses++;
+        block->links[0].ip = ip;
+        return block->links[0].block = find_block(ip);
+    }
+
+    for (BlockLink& link : block->links)
+        if (link.ip == ip)
+            return link.block ? link.block : link.block = find_block(ip);
+    return find_block(ip);
+}
+
+// Displaying the statistics of the indirect jump sites
+void BlockEngine::print_inline_cache_stats(std::ostream& out) const
+{
+    out << "Indirect jump sites:\n";
+    for (const auto& site : ic_stats)
+    {
+        const InlineCacheStats& stats = site.second;
+        uint64_t total = stats.hits + stats.misses;
+        out << "    " << site.first << ": mode " << (int)stats.mode << ", hits " << stats.hits
+            << ", misses " << stats.misses << ", hit rate "
+            << (total ? 100.0 * stats.hits / total : 0.0) << "%, last target " << stats.target << '\n';
+    }
+}
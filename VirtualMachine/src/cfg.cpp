@@ -0,0 +1,518 @@
+#include "cfg.h"
+#include <algorithm>
+#include <sstream>
+
+// Marks of the decoded addresses
+static constexpr uint8_t MARK_INSN = 1;   // An instruction starts at the address
+static constexpr uint8_t MARK_LEADER = 2; // A basic block starts at the address
+static constexpr uint8_t MARK_ENTRY = 4;  // A subroutine starts at the address
+
+// Checking that a whole word at the address fits into memory
+static bool in_image(uint32_t address) noexcept
+{
+    return address + 1 < Memory::MEM_SIZE;
+}
+
+// Whether the command ends a basic block
+static bool is_terminator(uint8_t cmd) noexcept
+{
+    return cmd <= OP_JLEF || cmd == OP_CALL || cmd == OP_ENDP || cmd >= OPCODES_COUNT;
+}
+
+// Searching for the jump target known before execution, the same way as TransCm::calc_instraction_pointer.
+// Returns false for register-indirect jumps and jumps through cells outside memory
+static bool static_target(Word word, uint16_t address, const Memory& memory, uint16_t& target, EdgeKind& kind) noexcept
+{
+    uint8_t code = word.cmd3ops.regs[0];
+    kind = EdgeKind::JUMP;
+    if (code == 0)
+        target = word.cmd2ops.adrs;
+    else if (code == 1)
+    {
+        if (!in_image(word.cmd2ops.adrs)) return false;
+        target = memory.get_word(word.cmd2ops.adrs).uval;
+        kind = EdgeKind::INDIRECT;
+    }
+    else if (code == 2)
+        return false;
+    else
+        target = address + word.cmd2ops.adrs;
+    return true;
+}
+
+// Grouping the edges by the source (or target) block with a counting sort.
+// first[b] is the index of the first edge of block b, first[blocks] is the number of edges
+static std::vector<CfgEdge> group_edges(const std::vector<CfgEdge>& edges, size_t blocks, bool by_target,
+                                        std::vector<int>& first)
+{
+    first.assign(blocks + 1, 0);
+    for (const CfgEdge& edge : edges)
+        first[(by_target ? edge.to : edge.from) + 1]++;
+    for (size_t i = 0; i < blocks; i++)
+        first[i + 1] += first[i];
+
+    std::vector<int> pos(first.begin(), first.end() - 1);
+    std::vector<CfgEdge> grouped(edges.size());
+    for (const CfgEdge& edge : edges)
+        grouped[pos[by_target ? edge.to : edge.from]++] = edge;
+    return grouped;
+}
+
+ControlFlowGraph::ControlFlowGraph(const Memory& memory, uint16_t entry, const std::vector<uint16_t>& roots)
+    : memory(memory), block_of(Memory::MEM_SIZE, -1), marks(Memory::MEM_SIZE, 0)
+{
+    decode(entry, roots);
+    build_blocks();
+    build_edges();
+    find_procedures(entry);
+    find_dominators();
+    find_loops();
+}
+
+// Marking all instructions reachable from the entry and the block leaders
+void ControlFlowGraph::decode(uint16_t entry, const std::vector<uint16_t>& roots)
+{
+    std::vector<uint16_t> work;
+    auto add_leader = [&](uint32_t address) {
+        if (!in_image(address)) return;
+        if (!(marks[address] & MARK_LEADER)) work.push_back(address);
+        marks[address] |= MARK_LEADER;
+    };
+
+    add_leader(entry);
+    if (in_image(entry)) marks[entry] |= MARK_ENTRY;
+    for (uint16_t root : roots)
+        add_leader(root);
+
+    while (!work.empty())
+    {
+        uint32_t address = work.back();
+        work.pop_back();
+        while (in_image(address) && !(marks[address] & MARK_INSN))
+        {
+            marks[address] |= MARK_INSN;
+            Word word = memory.get_word(address);
+            uint8_t cmd = word.cmd3ops.cmd;
+            if (!is_terminator(cmd))
+            {
+                if (cmd == OP_SPAWN) add_leader(word.cmd2ops.adrs); // Code of the started guest thread
+                address += 2;
+                continue;
+            }
+
+            if (is_jump(cmd))
+            {
+                uint16_t target;
+                EdgeKind kind;
+                if (static_target(word, address, memory, target, kind)) add_leader(target);
+                if (cmd != OP_JMP) add_leader(address + 2);
+            }
+            else if (cmd == OP_CALL)
+            {
+                add_leader(word.cmd2ops.adrs);
+                if (in_image(word.cmd2ops.adrs)) marks[word.cmd2ops.adrs] |= MARK_ENTRY;
+                add_leader(address + 2);
+            }
+            break;
+        }
+    }
+}
+
+// Splitting the decoded instructions into basic blocks
+void ControlFlowGraph::build_blocks()
+{
+    blocks_.reserve(256);
+    for (uint32_t address = 0; address < Memory::MEM_SIZE; address++)
+    {
+        if ((marks[address] & (MARK_INSN | MARK_LEADER)) != (MARK_INSN | MARK_LEADER))
+            continue;
+
+        BasicBlock block = BasicBlock();
+        block.start = address;
+        block.proc = block.idom = block.loop = -1;
+        int index = blocks_.size();
+        uint32_t last = address;
+        while (true)
+        {
+            block_of[last] = index;
+            uint32_t next = last + 2;
+            if (is_terminator(memory.get_word(last).cmd3ops.cmd) || !in_image(next)
+                || (marks[next] & MARK_LEADER) || !(marks[next] & MARK_INSN))
+                break;
+            last = next;
+        }
+        block.last = last;
+        blocks_.push_back(block);
+    }
+}
+
+// Creating the transitions between blocks (except returns from subroutines)
+void ControlFlowGraph::build_edges()
+{
+    succs_.reserve(blocks_.size() * 2);
+    for (size_t i = 0; i < blocks_.size(); i++)
+    {
+        BasicBlock& block = blocks_[i];
+        block.first_succ = succs_.size();
+        Word word = memory.get_word(block.last);
+        uint8_t cmd = word.cmd3ops.cmd;
+        uint32_t next = block.last + 2;
+
+        auto add_edge = [&](uint32_t target, EdgeKind kind) {
+            if (!in_image(target) || block_of[target] < 0)
+            {
+                block.leaves_image = true;
+                return;
+            }
+            succs_.push_back(CfgEdge { (int)i, block_of[target], kind });
+        };
+
+        if (is_jump(cmd))
+        {
+            uint16_t target;
+            EdgeKind kind;
+            if (static_target(word, block.last, memory, target, kind)) add_edge(target, kind);
+            else if (word.cmd3ops.regs[0] == 2) block.unknown_target = true;
+            else block.leaves_image = true;
+            if (cmd != OP_JMP) add_edge(next, EdgeKind::FALLTHROUGH);
+        }
+        else if (cmd == OP_CALL)
+        {
+            add_edge(word.cmd2ops.adrs, EdgeKind::CALL);
+            add_edge(next, EdgeKind::FALLTHROUGH);
+        }
+        else if (!is_terminator(cmd))
+            add_edge(next, EdgeKind::FALLTHROUGH);
+
+        block.succ_count = succs_.size() - block.first_succ;
+    }
+}
+
+// Assigning the blocks to subroutines and connecting ENDP with the return points
+void ControlFlowGraph::find_procedures(uint16_t entry)
+{
+    // The main subroutine goes first
+    if (block_at(entry) >= 0)
+        procs_.push_back(Procedure { entry, block_at(entry) });
+    for (size_t i = 0; i < blocks_.size(); i++)
+        if ((marks[blocks_[i].start] & MARK_ENTRY) && blocks_[i].start != entry)
+            procs_.push_back(Procedure { blocks_[i].start, (int)i });
+
+    // Blocks reachable from a subroutine entry without calls belong to that subroutine
+    std::vector<int> work;
+    for (size_t p = 0; p < procs_.size(); p++)
+    {
+        if (blocks_[procs_[p].block].proc >= 0) continue;
+        blocks_[procs_[p].block].proc = p;
+        work.push_back(procs_[p].block);
+        while (!work.empty())
+        {
+            const BasicBlock& block = blocks_[work.back()];
+            work.pop_back();
+            for (int e = block.first_succ; e < block.first_succ + block.succ_count; e++)
+            {
+                BasicBlock& succ = blocks_[succs_[e].to];
+                if (succs_[e].kind != EdgeKind::CALL && succ.proc < 0)
+                {
+                    succ.proc = p;
+                    work.push_back(succs_[e].to);
+                }
+            }
+        }
+    }
+
+    // ENDP of a subroutine returns to the instructions following every CALL of it
+    std::vector<std::vector<int>> returns(procs_.size());
+    for (size_t i = 0; i < blocks_.size(); i++)
+        if (blocks_[i].proc >= 0 && memory.get_word(blocks_[i].last).cmd3ops.cmd == OP_ENDP)
+            returns[blocks_[i].proc].push_back(i);
+
+    for (size_t i = 0; i < blocks_.size(); i++)
+    {
+        const BasicBlock& block = blocks_[i];
+        uint32_t return_point = block.last + 2;
+        if (memory.get_word(block.last).cmd3ops.cmd != OP_CALL || !in_image(return_point)
+            || block_of[return_point] < 0)
+            continue;
+        for (int e = block.first_succ; e < block.first_succ + block.succ_count; e++)
+        {
+            if (succs_[e].kind != EdgeKind::CALL || blocks_[succs_[e].to].proc < 0) continue;
+            for (int endp : returns[blocks_[succs_[e].to].proc])
+                succs_.push_back(CfgEdge { endp, block_of[return_point], EdgeKind::RETURN });
+        }
+    }
+
+    // Return edges were appended at the end, group all edges by blocks again
+    std::vector<int> first;
+    succs_ = group_edges(succs_, blocks_.size(), false, first);
+    for (size_t i = 0; i < blocks_.size(); i++)
+    {
+        blocks_[i].first_succ = first[i];
+        blocks_[i].succ_count = first[i + 1] - first[i];
+    }
+    preds_ = group_edges(succs_, blocks_.size(), true, first);
+    for (size_t i = 0; i < blocks_.size(); i++)
+    {
+        blocks_[i].first_pred = first[i];
+        blocks_[i].pred_count = first[i + 1] - first[i];
+    }
+}
+
+// Edges followed inside a subroutine when searching for dominators and loops
+static bool is_local_edge(const CfgEdge& edge) noexcept
+{
+    return edge.kind != EdgeKind::CALL && edge.kind != EdgeKind::RETURN;
+}
+
+// Searching for immediate dominators (Cooper, Harvey, Kennedy iterative algorithm).
+// Subroutine entries are the roots of the dominator trees, they hang on a virtual root
+void ControlFlowGraph::find_dominators()
+{
+    int count = blocks_.size();
+    int root = count;
+    std::vector<int> order; // Reverse postorder
+    std::vector<int> rpo_index(count + 1, -1);
+    std::vector<uint8_t> visited(count, 0);
+    std::vector<std::pair<int, int>> stack;
+
+    for (const Procedure& proc : procs_)
+    {
+        if (visited[proc.block]) continue;
+        std::vector<int> postorder;
+        stack.push_back({ proc.block, 0 });
+        visited[proc.block] = 1;
+        while (!stack.empty())
+        {
+            int b = stack.back().first;
+            int& e = stack.back().second;
+            if (e < blocks_[b].succ_count)
+            {
+                const CfgEdge& edge = succs_[blocks_[b].first_succ + e++];
+                if (is_local_edge(edge) && !visited[edge.to])
+                {
+                    visited[edge.to] = 1;
+                    stack.push_back({ edge.to, 0 });
+                }
+                continue;
+            }
+            postorder.push_back(b);
+            stack.pop_back();
+        }
+        order.insert(order.end(), postorder.rbegin(), postorder.rend());
+    }
+    for (size_t i = 0; i < order.size(); i++)
+        rpo_index[order[i]] = i;
+
+    std::vector<int> idom(count + 1, -1);
+    idom[root] = root;
+    for (const Procedure& proc : procs_)
+        idom[proc.block] = root;
+
+    auto intersect = [&](int a, int b) {
+        while (a != b)
+        {
+            while (rpo_index[a] > rpo_index[b]) a = idom[a];
+            while (rpo_index[b] > rpo_index[a]) b = idom[b];
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int b : order)
+        {
+            if (idom[b] == root) continue;
+            int new_idom = -1;
+            for (int e = blocks_[b].first_pred; e < blocks_[b].first_pred + blocks_[b].pred_count; e++)
+            {
+                const CfgEdge& edge = preds_[e];
+                if (!is_local_edge(edge) || idom[edge.from] < 0) continue;
+                new_idom = new_idom < 0 ? edge.from : intersect(edge.from, new_idom);
+            }
+            if (new_idom >= 0 && idom[b] != new_idom)
+            {
+                idom[b] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    for (int b = 0; b < count; b++)
+        blocks_[b].idom = idom[b] == root ? -1 : idom[b];
+
+    // Numbering the dominator tree in depth-first order, so that a dominates b
+    // if b is numbered inside the interval of a
+    std::vector<int> first_child(count + 1, -1), next_sibling(count, -1);
+    for (int b = count - 1; b >= 0; b--)
+    {
+        if (idom[b] < 0) continue;
+        next_sibling[b] = first_child[idom[b]];
+        first_child[idom[b]] = b;
+    }
+    dom_in.assign(count + 1, -1);
+    dom_out.assign(count + 1, -1);
+    int number = 0;
+    std::vector<int> path = { root };
+    std::vector<int> next_child = first_child; // Next child to visit for the blocks on the path
+    dom_in[root] = number++;
+    while (!path.empty())
+    {
+        int top = path.back();
+        int child = next_child[top];
+        if (child >= 0)
+        {
+            next_child[top] = next_sibling[child];
+            dom_in[child] = number++;
+            path.push_back(child);
+        }
+        else
+        {
+            dom_out[top] = number;
+            path.pop_back();
+        }
+    }
+}
+
+// Whether block a dominates block b
+bool ControlFlowGraph::dominates(int a, int b) const noexcept
+{
+    return dom_in[a] >= 0 && dom_in[b] >= 0 && dom_in[a] <= dom_in[b] && dom_out[b] <= dom_out[a];
+}
+
+// Searching for natural loops by back edges and building the loop nesting tree
+void ControlFlowGraph::find_loops()
+{
+    std::vector<int> loop_of_header(blocks_.size(), -1);
+    std::vector<int> mark(blocks_.size(), -1);
+    std::vector<int> work;
+
+    for (const CfgEdge& edge : succs_)
+    {
+        if (!is_local_edge(edge) || !dominates(edge.to, edge.from)) continue;
+
+        int l = loop_of_header[edge.to];
+        if (l < 0)
+        {
+            l = loop_of_header[edge.to] = loops_.size();
+            loops_.push_back(Loop { edge.to, -1, 0, { edge.to } });
+            mark[edge.to] = l;
+        }
+
+        // The body consists of blocks from which the back edge is reachable without the header
+        if (mark[edge.from] != l)
+        {
+            mark[edge.from] = l;
+            work.push_back(edge.from);
+        }
+        while (!work.empty())
+        {
+            int b = work.back();
+            work.pop_back();
+            loops_[l].blocks.push_back(b);
+            for (int e = blocks_[b].first_pred; e < blocks_[b].first_pred + blocks_[b].pred_count; e++)
+            {
+                const CfgEdge& pred = preds_[e];
+                if (is_local_edge(pred) && mark[pred.from] != l)
+                {
+                    mark[pred.from] = l;
+                    work.push_back(pred.from);
+                }
+            }
+        }
+    }
+
+    // Larger loops are processed first, so the last loop containing a block is the innermost one
+    std::vector<int> by_size(loops_.size());
+    for (size_t l = 0; l < loops_.size(); l++)
+        by_size[l] = l;
+    std::sort(by_size.begin(), by_size.end(), [&](int a, int b) {
+        return loops_[a].blocks.size() > loops_[b].blocks.size();
+    });
+    for (int l : by_size)
+    {
+        Loop& loop = loops_[l];
+        loop.parent = blocks_[loop.header].loop;
+        loop.depth = loop.parent < 0 ? 1 : loops_[loop.parent].depth + 1;
+        for (int b : loop.blocks)
+        {
+            blocks_[b].loop = l;
+            blocks_[b].loop_depth = loop.depth;
+        }
+    }
+}
+
+// Index of the block containing the instruction at the address (-1 if not code)
+int ControlFlowGraph::block_at(uint16_t address) const noexcept
+{
+    return address < block_of.size() ? block_of[address] : -1;
+}
+
+// Text representation of a command, e.g. "JGU 3 8"
+std::string disassemble(Word word)
+{
+    std::ostringstream out;
+    uint8_t cmd = word.cmd3ops.cmd;
+    if (cmd >= OPCODES_COUNT)
+    {
+        out << "??? " << word.uval;
+        return out.str();
+    }
+
+    out << OPCODE_NAMES[cmd];
+    if (is_jump(cmd))
+    {
+        out << ' ' << (int)word.cmd3ops.regs[0] << ' ';
+        if (word.cmd3ops.regs[0] == 2)
+            out << (int)word.cmd3ops.regs[1] << ' ' << (int)word.cmd3ops.regs[2];
+        else if (word.cmd3ops.regs[0] == 3)
+            out << (int16_t)word.cmd2ops.adrs;
+        else
+            out << word.cmd2ops.adrs;
+    }
+    else if (cmd == OP_LOAD || cmd == OP_SPAWN)
+        out << ' ' << (int)word.cmd2ops.reg << ' ' << word.cmd2ops.adrs;
+    else if (cmd == OP_FRAME)
+        out << ' ' << (int)word.cmd2ops.reg << ' ' << (int16_t)word.cmd2ops.adrs;
+    else if (cmd == OP_CALL)
+        out << ' ' << word.cmd2ops.adrs;
+    else if (cmd != OP_HALT && cmd != OP_ENDP && cmd != OP_FENCE)
+        out << ' ' << (int)word.cmd3ops.regs[0] << ' ' << (int)word.cmd3ops.regs[1]
+            << ' ' << (int)word.cmd3ops.regs[2];
+    return out.str();
+}
+
+// Displaying blocks, edges, dominators and loops
+void ControlFlowGraph::dump(std::ostream& out) const
+{
+    static const char* const EDGE_NAMES[] = { "fallthrough", "jump", "indirect", "call", "return" };
+
+    out << "CFG: " << blocks_.size() << " blocks, " << procs_.size() << " subroutines, "
+        << loops_.size() << " loops\n";
+    for (size_t p = 0; p < procs_.size(); p++)
+        out << "Subroutine " << p << ": entry " << procs_[p].entry << ", block " << procs_[p].block << '\n';
+
+    for (size_t b = 0; b < blocks_.size(); b++)
+    {
+        const BasicBlock& block = blocks_[b];
+        out << "\nBlock " << b << " [" << block.start << ".." << block.last << "] subroutine " << block.proc
+            << ", idom " << block.idom << ", loop " << block.loop << ", depth " << block.loop_depth << '\n';
+        for (uint32_t address = block.start; address <= block.last; address += 2)
+            out << "    " << address << ": " << disassemble(memory.get_word(address)) << '\n';
+        for (int e = block.first_succ; e < block.first_succ + block.succ_count; e++)
+            out << "    -> block " << succs_[e].to << " (" << EDGE_NAMES[(int)succs_[e].kind] << ")\n";
+        if (block.unknown_target) out << "    -> unknown (register-indirect jump)\n";
+        if (block.leaves_image) out << "    -> outside of the program\n";
+    }
+
+    if (!loops_.empty()) out << '\n';
+    for (size_t l = 0; l < loops_.size(); l++)
+    {
+        out << "Loop " << l << ": header block " << loops_[l].header << ", parent " << loops_[l].parent
+            << ", depth " << loops_[l].depth << ", blocks";
+        for (int b : loops_[l].blocks)
+            out << ' ' << b;
+        out << '\n';
+    }
+}
@@ -0,0 +1,35 @@
+#include "channel.h"
+#include <algorithm>
+
+Channel::Channel(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size *= 2;
+    buffer.resize(size);
+    mask = size - 1;
+}
+
+size_t Channel::send(const uint32_t* words, size_t count) noexcept
+{
+    size_t position = tail.load(std::memory_order_relaxed);
+    if (position - cached_head + count > buffer.size())
+        cached_head = head.load(std::memory_order_acquire);
+    count = std::min(count, buffer.size() - (position - cached_head));
+    for (size_t i = 0; i < count; i++)
+        buffer[(position + i) & mask] = words[i];
+    tail.store(position + count, std::memory_order_release);
+    return count;
+}
+
+size_t Channel::receive(uint32_t* words, size_t count) noexcept
+{
+    size_t position = head.load(std::memory_order_relaxed);
+    if (cached_tail - position < count)
+        cached_tail = tail.load(std::memory_order_acquire);
+    count = std::min(count, cached_tail - position);
+    for (size_t i = 0; i < count; i++)
+        words[i] = buffer[(position + i) & mask];
+    head.store(position + count, std::memory_order_release);
+    return count;
+}
@@ -0,0 +1,153 @@
+#include "code_cache.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+// Cache file: "VM9C", the key, the image size and the image, the number of blocks
+// and their starts. Numbers are little-endian
+static const char MAGIC[4] = { 'V', 'M', '9', 'C' };
+
+static void put(std::string& out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        out.push_back(char(value >> (8 * i) & 0xFF));
+}
+
+static bool get(const std::string& in, size_t& pos, uint64_t& value, int bytes)
+{
+    if (in.size() - pos < size_t(bytes)) return false;
+    value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= uint64_t(uint8_t(in[pos + i])) << (8 * i);
+    pos += bytes;
+    return true;
+}
+
+CodeCache::CodeCache(const std::string& directory) : directory(directory)
+{
+    if (!this->directory.empty()) return;
+    if (const char* cache = getenv("XDG_CACHE_HOME"); cache && *cache)
+        this->directory = std::string(cache) + "/vm9";
+    else if (const char* home = getenv("HOME"); home && *home)
+        this->directory = std::string(home) + "/.cache/vm9";
+    else
+        this->directory = ".vm9-cache";
+}
+
+uint64_t CodeCache::key(const std::string& file, const std::string& options) noexcept
+{
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](const std::string& text) {
+        for (char c : text)
+            hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+        hash = (hash ^ 0xFF) * 1099511628211ull; // Separator, so the parts can't be shifted into each other
+    };
+    add(VERSION);
+    add(options);
+    add(file);
+    return hash;
+}
+
+std::string CodeCache::image_of(const Memory& memory, uint16_t entry)
+{
+    std::string image("VM9B");
+    put(image, 1, 2);
+    put(image, entry, 2);
+    size_t segments_at = image.size();
+    put(image, 0, 2);
+
+    // Segments of consecutive words with nonzero cells, the rest of the memory is zero after loading
+    uint16_t segments = 0;
+    size_t cells_at = 0;
+    uint32_t cells = 0;
+    auto close_segment = [&]() {
+        if (!cells) return;
+        image[cells_at] = char(cells & 0xFF);
+        image[cells_at + 1] = char(cells >> 8);
+        cells = 0;
+    };
+    for (uint32_t address = 0; address + 1 < Memory::MEM_SIZE; address += 2)
+    {
+        Word word = memory.get_word(address);
+        if (word.uval == 0 || cells + 2 > 0xFFFF) close_segment();
+        if (word.uval == 0) continue;
+        if (!cells)
+        {
+            segments++;
+            put(image, address, 2);
+            cells_at = image.size();
+            put(image, 0, 2);
+        }
+        put(image, word.cells[0], 2);
+        put(image, word.cells[1], 2);
+        cells += 2;
+    }
+    close_segment();
+    image[segments_at] = char(segments & 0xFF);
+    image[segments_at + 1] = char(segments >> 8);
+    return image;
+}
+
+std::string CodeCache::file_of(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.vm9c", (unsigned long long)key);
+    return directory + name;
+}
+
+bool CodeCache::load(uint64_t key, Entry& entry) const
+{
+    std::ifstream fin(file_of(key), std::ios::binary);
+    if (!fin) return false;
+    std::string data((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+
+    size_t pos = sizeof(MAGIC);
+    uint64_t stored_key, size, count, address;
+    if (data.size() < sizeof(MAGIC) || memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) return false;
+    if (!get(data, pos, stored_key, 8) || stored_key != key) return false; // A collision of the names
+    if (!get(data, pos, size, 4) || data.size() - pos < size) return false;
+    entry.image = data.substr(pos, size);
+    pos += size;
+
+    if (!get(data, pos, count, 4)) return false;
+    entry.blocks.clear();
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (!get(data, pos, address, 2)) return false;
+        entry.blocks.push_back(uint16_t(address));
+    }
+    return pos == data.size();
+}
+
+// Writing into a temporary file and renaming it, so other processes see either the whole entry or none
+bool CodeCache::store(uint64_t key, const Entry& entry) const
+{
+    // Creating the directory with its parents
+    for (size_t slash = directory.find('/', 1); ; slash = directory.find('/', slash + 1))
+    {
+        mkdir(directory.substr(0, slash).c_str(), 0755);
+        if (slash == std::string::npos) break;
+    }
+
+    std::string data(MAGIC, sizeof(MAGIC));
+    put(data, key, 8);
+    put(data, entry.image.size(), 4);
+    data += entry.image;
+    put(data, entry.blocks.size(), 4);
+    for (uint16_t start : entry.blocks)
+        put(data, start, 2);
+
+    std::string path = file_of(key);
+    std::string temporary = path + "." + std::to_string(getpid());
+    {
+        std::ofstream fout(temporary, std::ios::binary);
+        if (!fout.write(data.data(), data.size())) return false;
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) == 0) return true;
+    std::remove(temporary.c_str());
+    return false;
+}
@@ -1,5 +1,21 @@
 #include "command.h"
 #include "processor.h"
+#include "guest_input.h"
+#include "guest_threads.h"
+#include "channel.h"
+#include "memoizer.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <array>
+#include <utility>
+
+const char* const OPCODE_NAMES[OPCODES_COUNT] = { "HALT", "JMP", "JE", "JEU", "JEF", "JG", "JGU", "JGF",
+    "JL", "JLU", "JLF", "JNE", "JNEU", "JNEF", "JGE", "JGEU", "JGEF", "JLE", "JLEU", "JLEF",
+    "PRINT", "PRINTU", "PRINTF", "LOAD", "NEG", "NEGF", "CMP", "CMPU", "CMPF", "ADD", "ADDF",
+    "SUB", "SUBF", "MUL", "MULF", "DIVU", "DIV", "DIVF", "MODU", "MOD", "INC", "DEC",
+    "READ", "READU", "READF", "AND", "OR", "XOR", "NOT", "LOADR", "LOADRV", "CALL",
+    "LOADF", "SETF", "ENDP", "SPAWN", "JOIN", "XADD", "CAS", "FENCE", "SEND", "RECV", "PUSHV", "POPV", "FRAME" };
 
 // Loading an address into the address register
 void LoadCm::operator()(Word word, Processor& proc) const noexcept
@@ -7,25 +23,21 @@ void LoadCm::operator()(Word word, Processor& proc) const noexcept
     proc.address_regs[word.cmd2ops.reg] = word.cmd2ops.adrs;
 }
 
-// Print the signed integer value pointed to by the address register
-void PrintCm::operator()(Word word, Processor& proc) const noexcept
+// Field of the word holding a value of the type
+template <NumType T>
+static decltype(auto) value_of(Word& word) noexcept
 {
-    word = proc.memory.get_word(proc.address_regs[word.cmd3ops.regs[2]]);
-    std::cout << word.ival << std::endl;
+    if constexpr (T == NumType::INT) return (word.ival);
+    else if constexpr (T == NumType::UINT) return (word.uval);
+    else return (word.fval);
 }
 
-// Outputting the unsigned integer value pointed to by the address register
-void PrintUCm::operator()(Word word, Processor& proc) const noexcept
+// Printing the value pointed to by the address register
+template <NumType T>
+void PrintValueCm<T>::operator()(Word word, Processor& proc) const noexcept
 {
     word = proc.memory.get_word(proc.address_regs[word.cmd3ops.regs[2]]);
-    std::cout <<  word.uval << std::endl;
-}
-
-// Printing the fractional value pointed to by the address register
-void PrintFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    word = proc.memory.get_word(proc.address_regs[word.cmd3ops.regs[2]]);
-    std::cout << word.fval << std::endl;
+    *proc.output << value_of<T>(word) << std::endl;
 }
 
 // Get value from processor register
@@ -56,175 +68,84 @@ void Command::set_flags_float(Word word, Processor& proc) const noexcept
     proc.set_flag(8, word.fval < 0); // Sign flag (1 if number is negative)
 }
 
-// Addition operations with setting flags (for subtraction, pass the is_sub=True argument)
-Word ArithCm::add_int_check_overflow(uint8_t reg1, uint8_t reg2, Processor& proc, bool is_sub) const noexcept
-{
-    Word word1 = get_reg_val(reg1, proc);
-    Word word2 = get_reg_val(reg2, proc);
-    if (is_sub) word2.ival = -word2.ival;
-    Word sum_result = Word();
-    sum_result.uval = word1.uval + word2.uval;
-
-    long long_res = (long)word1.ival + (long)word2.ival;
-    proc.set_flag(9, long_res != sum_result.ival); // Signed integer overflow flag
-    proc.set_flag(10, long_res != sum_result.uval); // Carry flag (unsigned integer overflow)
-
-    set_flags_int(sum_result, proc);
-    return sum_result;
-}
-
-Word ArithCm::add_float_check_overflow(uint8_t reg1, uint8_t reg2, Processor& proc, bool is_sub) const noexcept
+// Arithmetic operation with setting flags: zero, parity and sign for integers, zero and sign
+// for fractions, overflow for addition, subtraction and multiplication, division by zero for
+// division and remainder
+template <ArithOp Op, NumType T>
+void BinaryCm<Op, T>::operator()(Word word, Processor& proc) const noexcept
 {
-    Word word1 = get_reg_val(reg1, proc);
-    Word word2 = get_reg_val(reg2, proc);
-    if (is_sub) word2.fval = -word2.fval;
-    Word sum_result = Word();
-    sum_result.fval = word1.fval + word2.fval;
-
-    double double_res = (double)word1.fval + (double)word2.fval;
-    proc.set_flag(11, double_res != sum_result.fval); // Fractional overflow flag
-
-    set_flags_float(sum_result, proc);
-    return sum_result;
-}
-
-// Addition of integers
-void AddCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word sum_result = add_int_check_overflow(word.cmd3ops.regs[1], word.cmd3ops.regs[2], proc);
-    set_reg_val(word.cmd3ops.regs[0], sum_result, proc);
-}
-
-// Adding Fractions
-void AddFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word sum_result = add_float_check_overflow(word.cmd3ops.regs[1], word.cmd3ops.regs[2], proc);
-    set_reg_val(word.cmd3ops.regs[0], sum_result, proc);
-}
-
-// Subtracting Integers
-void SubCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word sub_result = add_int_check_overflow(word.cmd3ops.regs[1], word.cmd3ops.regs[2], proc, true);
-    set_reg_val(word.cmd3ops.regs[0], sub_result, proc);
-}
-
-// Subtracting fractions
-void SubFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word sub_result = add_float_check_overflow(word.cmd3ops.regs[1], word.cmd3ops.regs[2], proc, true);
-    set_reg_val(word.cmd3ops.regs[0], sub_result, proc);
-}
-
-// Multiplying with flags
-Word ArithCm::mul_int_check_overflow(uint8_t reg1, uint8_t reg2, Processor& proc) const noexcept
-{
-    Word word1 = get_reg_val(reg1, proc);
-    Word word2 = get_reg_val(reg2, proc);
+    Word word1 = get_reg_val(word.cmd3ops.regs[1], proc);
+    Word word2 = get_reg_val(word.cmd3ops.regs[2], proc);
     Word result = Word();
-    result.ival = word1.ival * word2.ival;
-
-    long long_res = (long)word1.ival * (long)word2.ival;
-    proc.set_flag(9, long_res != result.ival); // Sign integer overflow flag
-    proc.set_flag(10, long_res != result.uval); // Carry flag (unsigned integer overflow)
-
-    set_flags_int(result, proc);
-    return result;
-}
 
-Word ArithCm::mul_float_check_overflow(uint8_t reg1, uint8_t reg2, Processor& proc) const noexcept
-{
-    Word word1 = get_reg_val(reg1, proc);
-    Word word2 = get_reg_val(reg2, proc);
-    Word result = Word();
-    result.fval = word1.fval * word2.fval;
-
-    double double_res = (double)word1.fval * (double)word2.fval;
-    proc.set_flag(11, double_res != result.fval); // Fractional overflow flag
-
-    set_flags_float(result, proc);
-    return result;
-}
+    if constexpr (Op == ArithOp::DIV || Op == ArithOp::MOD)
+    {
+        proc.set_flag(12, value_of<T>(word2) == 0); // Flag indicating division by zero
+        if constexpr (Op == ArithOp::DIV) value_of<T>(result) = value_of<T>(word1) / value_of<T>(word2);
+        else value_of<T>(result) = value_of<T>(word1) % value_of<T>(word2);
+    }
+    else if constexpr (T == NumType::FLOAT)
+    {
+        if constexpr (Op == ArithOp::SUB) word2.fval = -word2.fval;
+        double double_res;
+        if constexpr (Op == ArithOp::MUL)
+        {
+            result.fval = word1.fval * word2.fval;
+            double_res = (double)word1.fval * (double)word2.fval;
+        }
+        else
+        {
+            result.fval = word1.fval + word2.fval;
+            double_res = (double)word1.fval + (double)word2.fval;
+        }
+        proc.set_flag(11, double_res != result.fval); // Fractional overflow flag
+    }
+    else
+    {
+        if constexpr (Op == ArithOp::SUB) word2.ival = -word2.ival;
+        long long_res;
+        if constexpr (Op == ArithOp::MUL)
+        {
+            result.uval = word1.uval * word2.uval; // Same bits as the signed product
+            long_res = (long)word1.ival * (long)word2.ival;
+        }
+        else
+        {
+            result.uval = word1.uval + word2.uval;
+            long_res = (long)word1.ival + (long)word2.ival;
+        }
+        proc.set_flag(9, long_res != result.ival); // Signed integer overflow flag
+        proc.set_flag(10, long_res != result.uval); // Carry flag (unsigned integer overflow)
+    }
 
-// Multiplying Integers
-void MulCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word result = mul_int_check_overflow(word.cmd3ops.regs[1], word.cmd3ops.regs[2], proc);
+    if constexpr (T == NumType::FLOAT) set_flags_float(result, proc);
+    else set_flags_int(result, proc);
     set_reg_val(word.cmd3ops.regs[0], result, proc);
 }
 
-// Multiplying fractions
-void MulFCm::operator()(Word word, Processor& proc) const noexcept
+// Fraction arithmetic without the double precision check and the flags
+template <ArithOp Op>
+void FastFloatCm<Op>::operator()(Word word, Processor& proc) const noexcept
 {
-    Word result = mul_float_check_overflow(word.cmd3ops.regs[1], word.cmd3ops.regs[2], proc);
+    float value1 = get_reg_val(word.cmd3ops.regs[1], proc).fval;
+    float value2 = get_reg_val(word.cmd3ops.regs[2], proc).fval;
+    Word result = Word();
+    if constexpr (Op == ArithOp::ADD) result.fval = value1 + value2;
+    else if constexpr (Op == ArithOp::SUB) result.fval = value1 - value2;
+    else if constexpr (Op == ArithOp::MUL) result.fval = value1 * value2;
+    else result.fval = value1 / value2;
     set_reg_val(word.cmd3ops.regs[0], result, proc);
-};
-
-// Division of unsigned integers
-void DivUCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word res = Word();
-    proc.set_flag(12, get_reg_val(word.cmd3ops.regs[2], proc).uval == 0); // Flag indicating division by zero
-    res.uval = get_reg_val(word.cmd3ops.regs[1], proc).uval / get_reg_val(word.cmd3ops.regs[2], proc).uval;
-    set_flags_int(res, proc);
-    set_reg_val(word.cmd3ops.regs[0], res, proc);
-}
-
-// Divide signed integers
-void DivCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word res = Word();
-    proc.set_flag(12, get_reg_val(word.cmd3ops.regs[2], proc).ival == 0); // Flag indicating division by zero
-    res.ival = get_reg_val(word.cmd3ops.regs[1], proc).ival / get_reg_val(word.cmd3ops.regs[2], proc).ival;
-    set_flags_int(res, proc);
-    set_reg_val(word.cmd3ops.regs[0], res, proc);
-}
-
-// Division of fractional numbers
-void DivFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word res = Word();
-    proc.set_flag(12, get_reg_val(word.cmd3ops.regs[2], proc).fval == 0); // Flag indicating division by zero
-    res.fval = get_reg_val(word.cmd3ops.regs[1], proc).fval / get_reg_val(word.cmd3ops.regs[2], proc).fval;
-    set_flags_float(res, proc);
-    set_reg_val(word.cmd3ops.regs[0], res, proc);
-}
-
-// Taking the remainder of division of unsigned integers
-void ModUCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word res = Word();
-    proc.set_flag(12, get_reg_val(word.cmd3ops.regs[2], proc).uval == 0); // Flag indicating division by zero
-    res.uval = get_reg_val(word.cmd3ops.regs[1], proc).uval % get_reg_val(word.cmd3ops.regs[2], proc).uval;
-    set_flags_int(res, proc);
-    set_reg_val(word.cmd3ops.regs[0], res, proc);
-}
-
-// Taking the remainder of division of signed integers
-void ModCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word res = Word();
-    proc.set_flag(12, get_reg_val(word.cmd3ops.regs[2], proc).ival == 0); // Flag indicating division by zero
-    res.ival = get_reg_val(word.cmd3ops.regs[1], proc).ival % get_reg_val(word.cmd3ops.regs[2], proc).ival;
-    set_flags_int(res, proc);
-    set_reg_val(word.cmd3ops.regs[0], res, proc);
 }
 
 // Sign conversion
-void NegCm::operator()(Word word, Processor& proc) const noexcept
+template <NumType T>
+void NegateCm<T>::operator()(Word word, Processor& proc) const noexcept
 {
+    Word value = get_reg_val(word.cmd3ops.regs[2], proc);
     Word res = Word();
-    res.ival = -get_reg_val(word.cmd3ops.regs[2], proc).ival;
-    set_flags_int(res, proc);
-    set_reg_val(word.cmd3ops.regs[2], res, proc);
-}
-
-// Changing the sign of fractions
-void NegFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word res = Word();
-    res.fval = -get_reg_val(word.cmd3ops.regs[2], proc).fval;
-    set_flags_float(res, proc);
+    value_of<T>(res) = -value_of<T>(value);
+    if constexpr (T == NumType::FLOAT) set_flags_float(res, proc);
+    else set_flags_int(res, proc);
     set_reg_val(word.cmd3ops.regs[2], res, proc);
 }
 
@@ -261,245 +182,94 @@ void DecCm::operator()(Word word, Processor& proc) const noexcept
     set_reg_val(word.cmd3ops.regs[2], sum_result, proc);
 }
 
-// Comparison of signed integers
-void CmpCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word val1 = get_reg_val(word.cmd3ops.regs[0], proc);
-    Word val2 = get_reg_val(word.cmd3ops.regs[1], proc);
-    proc.set_flag(2, val1.ival == val2.ival); // Set the flag at index 2 if there is equality
-    proc.set_flag(3, val1.ival > val2.ival); // Set the flag at index 3 if val1 > val2
-}
-
-// Comparison of unsigned integers
-void CmpUCm::operator()(Word word, Processor& proc) const noexcept
+// Comparison of the values, the equality and "greater" flags are 2 and 3 for signed integers,
+// 4 and 5 for unsigned integers, 6 and 7 for fractions
+template <NumType T>
+void CompareCm<T>::operator()(Word word, Processor& proc) const noexcept
 {
+    constexpr uint8_t flag = 2 + 2 * (uint8_t)T;
     Word val1 = get_reg_val(word.cmd3ops.regs[0], proc);
     Word val2 = get_reg_val(word.cmd3ops.regs[1], proc);
-    proc.set_flag(4, val1.uval == val2.uval); // Set the flag at index 4 if there is equality
-    proc.set_flag(5, val1.uval > val2.uval); // Set the flag at index 5 if val1 > val2
+    proc.set_flag(flag, value_of<T>(val1) == value_of<T>(val2)); // Set the flag if there is equality
+    proc.set_flag(flag + 1, value_of<T>(val1) > value_of<T>(val2)); // Set the next flag if val1 > val2
 }
 
-// Comparison of fractional numbers
-void CmpFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word val1 = get_reg_val(word.cmd3ops.regs[0], proc);
-    Word val2 = get_reg_val(word.cmd3ops.regs[1], proc);
-    proc.set_flag(6, val1.fval == val2.fval); // Set the flag at index 6 if there is equality
-    proc.set_flag(7, val1.fval > val2.fval); // Set the flag at index 7 if val1 > val2
-}
-
-// Searching for a new IP to transition to. Same for all jump commands.
-uint16_t TransCm::calc_instraction_pointer(Word word, Processor& proc) const noexcept
+// Jump target in the addressing mode
+template <JumpMode M>
+static uint16_t jump_target(Word word, Processor& proc) noexcept
 {
-    uint8_t code = word.cmd3ops.regs[0];
-
-    if (code == 0)  // Direct jump, IP = address constant in command
+    if constexpr (M == JUMP_DIRECT) // IP = address constant in command
         return word.cmd2ops.adrs;
-
-    if (code == 1) // Direct indirect jump, IP = the value in memory that lies at the address.
-                   // Address is a constant in the command
+    else if constexpr (M == JUMP_MEMORY) // IP = the value in memory that lies at the address
         return proc.memory.get_word(word.cmd2ops.adrs).uval;
-
-    if (code == 2) // Direct indirect register jump, IP = address in register 1 + address in register 2
+    else if constexpr (M == JUMP_REGISTERS) // IP = address in register 1 + address in register 2
+        return proc.address_regs[word.cmd3ops.regs[2]] + proc.address_regs[word.cmd3ops.regs[1]];
+    else if constexpr (M == JUMP_RELATIVE) // IP = IP + offset
+        return proc.get_ip() + word.cmd2ops.adrs;
+    else
     {
-        uint16_t adrs1 = proc.address_regs[word.cmd3ops.regs[2]];
-        uint16_t adrs2 = proc.address_regs[word.cmd3ops.regs[1]];
-        return adrs1 + adrs2;
+        switch (word.cmd3ops.regs[0])
+        {
+        case JUMP_DIRECT: return jump_target<JUMP_DIRECT>(word, proc);
+        case JUMP_MEMORY: return jump_target<JUMP_MEMORY>(word, proc);
+        case JUMP_REGISTERS: return jump_target<JUMP_REGISTERS>(word, proc);
+        default: return jump_target<JUMP_RELATIVE>(word, proc);
+        }
     }
-    // (code == 3)   Relative transition, IP = IP + offset. Offset is a constant in the command
-    return proc.get_ip() + word.cmd2ops.adrs;
 }
 
-// Unconditional jump command
-void JumpCm::operator()(Word word, Processor& proc) const noexcept
-{
-    proc.set_ip(calc_instraction_pointer(word, proc));
-}
-
-// Signed conditional jump command val1 == val2
-void JEqCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (proc.get_flag(2)) // flag check for signed numbers
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-// Conditional unsigned jump command val1 == val2
-void JEqUCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (proc.get_flag(4)) // check the flag for unsigned
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-// Conditional jump command for fractional val1 == val2
-void JEqFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (proc.get_flag(6)) // checking the flag for fractional
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-// Signed conditional jump command val1 > val2
-void JGrCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (proc.get_flag(3)) // check the flag for signed numbers
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-// Conditional unsigned jump command val1 > val2
-void JGrUCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (proc.get_flag(5)) // check the flag for unsigned
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-// Command for conditional transition of fractional val1 > val2
-void JGrFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (!proc.get_flag(6) && proc.get_flag(7)) // check the flag for fractional
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-// Signed conditional jump command val1 < val2
-void JLsCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (!proc.get_flag(2) && !proc.get_flag(3)) // check the flag for signed
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-// Conditional unsigned jump command val1 < val2
-void JLsUCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (!proc.get_flag(4) && !proc.get_flag(5)) // check the flag for unsigned
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-// Command for conditional transition of fractional val1 < val2
-void JLsFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (!proc.get_flag(6) && !proc.get_flag(7)) // check the flag for fractional
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-// Signed conditional jump command val1 != val2
-void JNEqCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (!proc.get_flag(2)) // checking the flag for signed ones
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-// Conditional jump command for unsigned val1 != val2
-void JNEqUCm::operator()(Word word, Processor& proc) const noexcept
+// Searching for a new IP to transition to. Same for all jump commands.
+uint16_t TransCm::calc_instraction_pointer(Word word, Processor& proc) const noexcept
 {
-    if (!proc.get_flag(4)) // check the flag for unsigned
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
+    return jump_target<JUMP_ANY>(word, proc);
 }
 
-// Conditional jump command for fractional val1 != val2
-void JNEqFCm::operator()(Word word, Processor& proc) const noexcept
+// Jump command: going to the target if the condition holds, to the next command otherwise.
+// The condition is a precomputed mask, and the next IP is selected without a branch
+template <JumpCond C, NumType T, JumpMode M>
+void JumpIfCm<C, T, M>::operator()(Word word, Processor& proc) const noexcept
 {
-    if (!proc.get_flag(6)) // checking the flag for fractional
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
+    constexpr JumpMask mask = jump_mask(JumpKind { C, T });
+    uint16_t next = proc.get_ip() + 2;
+    uint16_t target = jump_target<M>(word, proc);
+    proc.set_ip(jump_taken(mask, proc.flags) ? target : next);
 }
 
-// Signed conditional jump command val1 >= val2
-void JGEqCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (proc.get_flag(3) || proc.get_flag(2)) // check the flag for signed
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
+// Jump commands of all operation codes specialized on the addressing mode
+template <uint8_t Cmd, JumpMode M>
+static const JumpOpCm<Cmd, M> JUMP_COMMAND = JumpOpCm<Cmd, M>();
 
-// Conditional unsigned jump command val1 >= val2
-void JGEqUCm::operator()(Word word, Processor& proc) const noexcept
+template <size_t... Cmd>
+static constexpr std::array<std::array<const Command*, JUMP_ANY>, sizeof...(Cmd)> make_jump_commands(
+    std::index_sequence<Cmd...>) noexcept
 {
-    if (proc.get_flag(5) || proc.get_flag(4)) // check the flag for unsigned
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
+    return { { { &JUMP_COMMAND<Cmd, JUMP_DIRECT>, &JUMP_COMMAND<Cmd, JUMP_MEMORY>,
+        &JUMP_COMMAND<Cmd, JUMP_REGISTERS>, &JUMP_COMMAND<Cmd, JUMP_RELATIVE> }... } };
 }
 
-// Conditional transition command for fractional val1 >= val2
-void JGEqFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (proc.get_flag(6) || proc.get_flag(7)) // check the flag for fractional
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
+static constexpr auto JUMP_COMMANDS = make_jump_commands(std::make_index_sequence<OP_JLEF + 1>());
 
-// Signed conditional jump command val1 <= val2
-void JLEqCm::operator()(Word word, Processor& proc) const noexcept
+// Jump command specialized on the addressing mode of the instruction
+const Command* jump_command(Word word) noexcept
 {
-    if (!proc.get_flag(3)) // check the flag for signed ones
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
+    uint8_t cmd = word.cmd3ops.cmd, mode = word.cmd3ops.regs[0];
+    if (!is_jump(cmd)) return nullptr;
+    return JUMP_COMMANDS[cmd][mode < JUMP_ANY ? mode : uint8_t(JUMP_RELATIVE)];
 }
 
-// Conditional unsigned jump command val1 <= val2
-void JLEqUCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (!proc.get_flag(5)) // check the flag for unsigned
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
 
-// Conditional transition command for fractional val1 <= val2
-void JLEqFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    if (!proc.get_flag(7)) // checking the flag for fractional
-        proc.set_ip(calc_instraction_pointer(word, proc));
-    else
-        proc.set_ip(proc.get_ip() + 2);
-}
-
-
-// Command to read a signed integer from the console
-void ReadCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word user_val = Word();
-    std::cin >> user_val.ival;
-    set_reg_val(word.cmd3ops.regs[2], user_val, proc);
-}
-
-// Command to read an unsigned integer from the console
-void ReadUCm::operator()(Word word, Processor& proc) const noexcept
+// Command to read a value from the console or from the guest input.
+// Without a complete value in the guest input the processor stops and the command is repeated on resuming
+template <NumType T>
+void ReadValueCm<T>::operator()(Word word, Processor& proc) const noexcept
 {
     Word user_val = Word();
-    std::cin >> user_val.uval;
-    set_reg_val(word.cmd3ops.regs[2], user_val, proc);
-}
-
-// Command to read a fractional from the console
-void ReadFCm::operator()(Word word, Processor& proc) const noexcept
-{
-    Word user_val = Word();
-    std::cin >> user_val.fval;
+    if (!proc.input) std::cin >> value_of<T>(user_val);
+    else if (!proc.input->read<T>(user_val))
+    {
+        proc.trap = Processor::Trap::NEEDS_INPUT;
+        return;
+    }
     set_reg_val(word.cmd3ops.regs[2], user_val, proc);
 }
 
@@ -554,6 +324,7 @@ void LoadRVCm::operator()(Word word, Processor& proc) const noexcept
 // The instruction to load a flag into the value pointed to by a register
 void LoadF::operator()(Word word, Processor& proc) const noexcept
 {
+    if (proc.fast_float()) proc.collect_float_exceptions();
     Word val = Word();
     val.uval = int(proc.get_flag(word.cmd3ops.regs[1]));
     set_reg_val(word.cmd3ops.regs[0], val, proc);
@@ -567,20 +338,205 @@ void SetF::operator()(Word word, Processor& proc) const noexcept
 
     Word val = Word();
     val = proc.memory.get_word(proc.address_regs[reg_from]);
+    if (proc.fast_float()) proc.collect_float_exceptions(); // Exceptions raised before don't override the flag
     proc.set_flag(flag, val.uval != 0);
 }
 
+// Pushing a value onto the data stack
+void PushValueCm::operator()(Word word, Processor& proc) const noexcept
+{
+    Word value = get_reg_val(word.cmd3ops.regs[2], proc);
+    uint16_t address;
+    if (proc.push_value(address)) proc.memory.set_word(address, value);
+}
+
+// Popping a value from the data stack
+void PopValueCm::operator()(Word word, Processor& proc) const noexcept
+{
+    uint16_t address;
+    if (proc.pop_value(address)) set_reg_val(word.cmd3ops.regs[2], proc.memory.get_word(address), proc);
+}
+
+// Address relative to the frame pointer
+void FrameCm::operator()(Word word, Processor& proc) const noexcept
+{
+    proc.address_regs[word.cmd2ops.reg] = proc.frame_pointer() + word.cmd2ops.adrs;
+}
+
 // Calling a subroutine
 void CallCm::operator()(Word word, Processor& proc) const noexcept
 {
+    if (proc.memo && proc.memo->call(proc, word.cmd2ops.adrs)) return; // The results are taken from the cache
     uint16_t return_to = proc.get_ip();
     proc.push(return_to + 2); // Storing the return address onto a register-mimicking stack
-    proc.set_ip(word.cmd2ops.adrs - 2);
+    if (proc.trap == Processor::Trap::NONE)
+        proc.set_ip(word.cmd2ops.adrs - 2);
 }
 
 // Return from subroutine
-void EndpCm::operator()(Word word, Processor& proc) const noexcept
+void EndpCm::operator()(Word, Processor& proc) const noexcept
+{
+    uint16_t return_to = proc.pop();
+    if (proc.trap != Processor::Trap::NONE) return;
+    proc.set_ip(return_to - 2);
+    if (proc.memo) proc.memo->returned(proc);
+}
+
+// Starting a guest thread, id 0 if there are no guest threads in this run or too many of them
+void SpawnCm::operator()(Word word, Processor& proc) const noexcept
 {
-    proc.set_ip(proc.pop() - 2);
+    Word id = Word();
+    if (proc.threads) id.uval = proc.threads->spawn(proc, word.cmd2ops.adrs);
+    set_reg_val(word.cmd2ops.reg, id, proc);
 }
 
+// Waiting for a guest thread, unknown ids are ignored
+void JoinCm::operator()(Word word, Processor& proc) const noexcept
+{
+    if (proc.threads) proc.threads->join(get_reg_val(word.cmd3ops.regs[2], proc).uval);
+}
+
+// Atomic fetch and add
+void FetchAddCm::operator()(Word word, Processor& proc) const noexcept
+{
+    uint32_t value = get_reg_val(word.cmd3ops.regs[2], proc).uval;
+    Word previous = Word();
+    previous.uval = proc.memory.fetch_add(proc.address_regs[word.cmd3ops.regs[1]], value);
+    set_reg_val(word.cmd3ops.regs[0], previous, proc);
+}
+
+// Atomic compare and swap
+void CompareSwapCm::operator()(Word word, Processor& proc) const noexcept
+{
+    Word expected = get_reg_val(word.cmd3ops.regs[1], proc);
+    uint32_t desired = get_reg_val(word.cmd3ops.regs[2], proc).uval;
+    bool swapped = proc.memory.compare_exchange(proc.address_regs[word.cmd3ops.regs[0]], expected.uval, desired);
+    if (!swapped) set_reg_val(word.cmd3ops.regs[1], expected, proc);
+    proc.set_flag(2, swapped); // Equality flag of CMP, for JE and JNE
+}
+
+// Memory fence
+void FenceCm::operator()(Word, Processor&) const noexcept
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+// Words moved between the memory and a channel at once
+static constexpr uint32_t CHANNEL_BATCH = 64;
+
+static Channel* port_channel(uint8_t port, Processor& proc) noexcept
+{
+    return port < Processor::PORTS ? proc.ports[port] : nullptr;
+}
+
+// Sending words, the ones sent to an unconnected or closed channel are dropped
+void SendCm::operator()(Word word, Processor& proc) const noexcept
+{
+    Channel* channel = port_channel(word.cmd3ops.regs[0], proc);
+    uint32_t count = get_reg_val(word.cmd3ops.regs[2], proc).uval;
+    uint16_t address = proc.address_regs[word.cmd3ops.regs[1]];
+    uint32_t words[CHANNEL_BATCH];
+    for (uint32_t sent = 0; channel && sent < count; )
+    {
+        uint32_t batch = std::min(CHANNEL_BATCH, count - sent);
+        for (uint32_t i = 0; i < batch; i++)
+            words[i] = proc.memory.get_word(address + 2 * i).uval;
+        for (uint32_t done = 0; done < batch; )
+        {
+            if (channel->is_closed()) return;
+            size_t added = channel->send(words + done, batch - done);
+            if (!added) std::this_thread::yield(); // Back-pressure: the receiver is behind
+            done += added;
+        }
+        sent += batch;
+        address += 2 * batch;
+    }
+}
+
+// Receiving the words that have arrived, at least one unless the channel is closed and empty
+void RecvCm::operator()(Word word, Processor& proc) const noexcept
+{
+    Channel* channel = port_channel(word.cmd3ops.regs[0], proc);
+    uint32_t wanted = get_reg_val(word.cmd3ops.regs[2], proc).uval;
+    uint16_t address = proc.address_regs[word.cmd3ops.regs[1]];
+    uint32_t words[CHANNEL_BATCH];
+    uint32_t received = 0;
+    while (channel && received < wanted)
+    {
+        size_t count = channel->receive(words, std::min(CHANNEL_BATCH, wanted - received));
+        if (!count)
+        {
+            if (received) break;
+            bool closed = channel->is_closed(); // The words sent before closing are in the channel
+            if (!(count = channel->receive(words, std::min(CHANNEL_BATCH, wanted))))
+            {
+                if (closed) break;
+                std::this_thread::yield();
+                continue;
+            }
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            Word value = Word();
+            value.uval = words[i];
+            proc.memory.set_word(address, value);
+            address += 2;
+        }
+        received += count;
+    }
+    Word result = Word();
+    result.uval = received;
+    set_reg_val(word.cmd3ops.regs[2], result, proc);
+}
+
+// Handlers used by Processor
+template class PrintValueCm<NumType::INT>;
+template class PrintValueCm<NumType::UINT>;
+template class PrintValueCm<NumType::FLOAT>;
+template class BinaryCm<ArithOp::ADD, NumType::INT>;
+template class BinaryCm<ArithOp::ADD, NumType::FLOAT>;
+template class BinaryCm<ArithOp::SUB, NumType::INT>;
+template class BinaryCm<ArithOp::SUB, NumType::FLOAT>;
+template class BinaryCm<ArithOp::MUL, NumType::INT>;
+template class BinaryCm<ArithOp::MUL, NumType::FLOAT>;
+template class BinaryCm<ArithOp::DIV, NumType::UINT>;
+template class BinaryCm<ArithOp::DIV, NumType::INT>;
+template class BinaryCm<ArithOp::DIV, NumType::FLOAT>;
+template class BinaryCm<ArithOp::MOD, NumType::UINT>;
+template class BinaryCm<ArithOp::MOD, NumType::INT>;
+template class FastFloatCm<ArithOp::ADD>;
+template class FastFloatCm<ArithOp::SUB>;
+template class FastFloatCm<ArithOp::MUL>;
+template class FastFloatCm<ArithOp::DIV>;
+template class NegateCm<NumType::INT>;
+template class NegateCm<NumType::FLOAT>;
+template class CompareCm<NumType::INT>;
+template class CompareCm<NumType::UINT>;
+template class CompareCm<NumType::FLOAT>;
+template class JumpIfCm<JumpCond::ALWAYS, NumType::INT>;
+template class JumpIfCm<JumpCond::EQ, NumType::INT>;
+template class JumpIfCm<JumpCond::EQ, NumType::UINT>;
+template class JumpIfCm<JumpCond::EQ, NumType::FLOAT>;
+template class JumpIfCm<JumpCond::GT, NumType::INT>;
+template class JumpIfCm<JumpCond::GT, NumType::UINT>;
+template class JumpIfCm<JumpCond::GT, NumType::FLOAT>;
+template class JumpIfCm<JumpCond::LT, NumType::INT>;
+template class JumpIfCm<JumpCond::LT, NumType::UINT>;
+template class JumpIfCm<JumpCond::LT, NumType::FLOAT>;
+template class JumpIfCm<JumpCond::NE, NumType::INT>;
+template class JumpIfCm<JumpCond::NE, NumType::UINT>;
+template class JumpIfCm<JumpCond::NE, NumType::FLOAT>;
+template class JumpIfCm<JumpCond::GE, NumType::INT>;
+template class JumpIfCm<JumpCond::GE, NumType::UINT>;
+template class JumpIfCm<JumpCond::GE, NumType::FLOAT>;
+template class JumpIfCm<JumpCond::LE, NumType::INT>;
+template class JumpIfCm<JumpCond::LE, NumType::UINT>;
+template class JumpIfCm<JumpCond::LE, NumType::FLOAT>;
+template class ReadValueCm<NumType::INT>;
+template class ReadValueCm<NumType::UINT>;
+template class ReadValueCm<NumType::FLOAT>;
+
+void BreakCm::operator()(Word, Processor& proc) const noexcept
+{
+    proc.trap = Processor::Trap::BREAKPOINT;
+}
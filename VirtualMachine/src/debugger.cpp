@@ -0,0 +1,391 @@
+#include "debugger.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include "cfg.h"
+
+// Debugger whose pages are protected, for the fault handler
+static Debugger* active = nullptr;
+
+static const char* const FLAG_NAMES[] = { "zero", "parity", "equal", "greater", "equal unsigned",
+    "greater unsigned", "equal fraction", "greater fraction", "sign", "overflow", "carry",
+    "fraction overflow", "division by zero" };
+
+Debugger::Debugger(Processor& proc, uint16_t entry) noexcept : proc(proc), page_size(Memory::isolated_size())
+{
+    proc.set_ip(entry);
+    proc.trap = Processor::Trap::NONE;
+}
+
+void Debugger::add_label(const std::string& name, uint16_t address)
+{
+    labels[name] = address;
+    label_at.emplace(address, name); // The first label of the address is shown
+}
+
+bool Debugger::set_breakpoint(uint16_t address)
+{
+    return breakpoints.emplace(address, Word()).second;
+}
+
+bool Debugger::remove_breakpoint(uint16_t address)
+{
+    return breakpoints.erase(address) != 0;
+}
+
+// Both cells of the word may be in different pages
+bool Debugger::watch(uint16_t address)
+{
+    for (uint16_t cell : { address, uint16_t(address + 1) })
+    {
+        uint16_t first = cell / Memory::PAGE_SIZE * Memory::PAGE_SIZE;
+        if (std::any_of(pages.begin(), pages.end(), [first](const WatchedPage& page) { return page.first == first; }))
+            continue;
+        Memory::Page* host = proc.memory.isolate_page(cell);
+        if (!host) return false;
+        pages.push_back(WatchedPage { host, first });
+    }
+    watched[address] = proc.memory.get_word(address).uval;
+    return true;
+}
+
+// The pages stay in their own mappings, only the ones without watched words are no longer protected
+bool Debugger::unwatch(uint16_t address)
+{
+    if (!watched.erase(address)) return false;
+    pages.erase(std::remove_if(pages.begin(), pages.end(), [this](const WatchedPage& page) {
+        return std::none_of(watched.begin(), watched.end(), [&page](const std::pair<const uint16_t, uint32_t>& word) {
+            return uint16_t(word.first - page.first) < Memory::PAGE_SIZE ||
+                   uint16_t(word.first + 1 - page.first) < Memory::PAGE_SIZE;
+        });
+    }), pages.end());
+    return true;
+}
+
+// Stepping stops at a breakpoint too
+Debugger::Stop Debugger::step(size_t count)
+{
+    Stop stop = halted ? finished() : Stop::STEP;
+    for (size_t i = 0; i < count && stop == Stop::STEP; i++)
+    {
+        stop = execute(true);
+        if (stop == Stop::STEP && i + 1 < count && breakpoints.count(proc.get_ip())) stop = Stop::BREAKPOINT;
+    }
+    return stop;
+}
+
+Debugger::Stop Debugger::resume()
+{
+    if (halted) return finished();
+    // The instruction under a breakpoint runs once before the BREAK commands are written
+    if (breakpoints.count(proc.get_ip()))
+    {
+        Stop stop = execute(true);
+        if (stop != Stop::STEP) return stop;
+    }
+    return execute(false);
+}
+
+// Running one command or up to a stop with the pages protected. A write into a watched page
+// that changes no watched word is completed and the run goes on
+Debugger::Stop Debugger::execute(bool single)
+{
+    if (!single) insert_breakpoints();
+    protect(true);
+    Stop stop;
+    for (;;)
+    {
+        bool more = false;
+        if (single) more = proc.step();
+        else proc.run(proc.get_ip());
+
+        if (proc.trap == Processor::Trap::WATCHPOINT)
+        {
+            // Commands writing into memory aren't jumps, so the next one follows
+            proc.trap = Processor::Trap::NONE;
+            proc.executed++;
+            proc.set_ip(proc.get_ip() + 2);
+            protect(true); // The fault handler opened the page
+            if (watched_changed()) stop = Stop::WATCHPOINT;
+            else if (single) stop = Stop::STEP;
+            else continue;
+        }
+        else if (proc.trap == Processor::Trap::BREAKPOINT)
+        {
+            proc.trap = Processor::Trap::NONE;
+            stop = Stop::BREAKPOINT;
+        }
+        else if (more) stop = Stop::STEP;
+        else
+        {
+            halted = true;
+            stop = finished();
+        }
+        break;
+    }
+    protect(false);
+    if (!single) remove_breakpoints();
+    if (single && proc.fast_float()) proc.collect_float_exceptions();
+    return stop;
+}
+
+// The program halted or stopped on a trap, and can't continue
+Debugger::Stop Debugger::finished() const noexcept
+{
+    return proc.trap == Processor::Trap::NONE ? Stop::HALT : Stop::TRAP;
+}
+
+// Finding the first watched word with a new value, all of them get their new values
+bool Debugger::watched_changed()
+{
+    bool found = false;
+    for (std::pair<const uint16_t, uint32_t>& word : watched)
+    {
+        uint32_t value = proc.memory.get_word(word.first).uval;
+        if (value == word.second) continue;
+        if (!found)
+        {
+            changed = word.first;
+            previous = word.second;
+            found = true;
+        }
+        word.second = value;
+    }
+    return found;
+}
+
+void Debugger::insert_breakpoints()
+{
+    for (std::pair<const uint16_t, Word>& breakpoint : breakpoints)
+    {
+        breakpoint.second = proc.memory.get_word(breakpoint.first);
+        Word patched = breakpoint.second;
+        patched.cmd3ops.cmd = OP_BREAK;
+        proc.memory.set_word(breakpoint.first, patched);
+    }
+}
+
+// An instruction the program wrote over its breakpoint is kept
+void Debugger::remove_breakpoints()
+{
+    for (const std::pair<const uint16_t, Word>& breakpoint : breakpoints)
+    {
+        Word patched = breakpoint.second;
+        patched.cmd3ops.cmd = OP_BREAK;
+        if (proc.memory.get_word(breakpoint.first).uval == patched.uval)
+            proc.memory.set_word(breakpoint.first, breakpoint.second);
+    }
+}
+
+void Debugger::protect(bool enabled)
+{
+    if (pages.empty() && active != this) return;
+    if (enabled && active != this)
+    {
+        struct sigaction action;
+        action.sa_sigaction = on_fault;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_SIGINFO;
+        sigaction(SIGSEGV, &action, &previous_action);
+        active = this;
+    }
+    for (const WatchedPage& page : pages)
+        mprotect(page.host, page_size, enabled ? PROT_READ : PROT_READ | PROT_WRITE);
+    if (!enabled && active == this)
+    {
+        sigaction(SIGSEGV, &previous_action, nullptr);
+        active = nullptr;
+    }
+}
+
+// A write into a protected page: the page is opened for the rest of the command, and the
+// processor stops after it. Any other fault gets the default action when the instruction repeats
+void Debugger::on_fault(int, siginfo_t* info, void*)
+{
+    char* address = static_cast<char*>(info->si_addr);
+    if (active)
+        for (const WatchedPage& page : active->pages)
+        {
+            char* host = reinterpret_cast<char*>(page.host);
+            if (address < host || address >= host + active->page_size) continue;
+            mprotect(host, active->page_size, PROT_READ | PROT_WRITE);
+            active->proc.trap = Processor::Trap::WATCHPOINT;
+            return;
+        }
+    signal(SIGSEGV, SIG_DFL);
+}
+
+bool Debugger::parse_address(const std::string& text, uint16_t& address) const
+{
+    if (!text.empty() && text.size() <= 5 && std::all_of(text.begin(), text.end(), ::isdigit))
+    {
+        unsigned long value = std::stoul(text);
+        address = uint16_t(value);
+        return value < Memory::MEM_SIZE;
+    }
+    std::map<std::string, uint16_t>::const_iterator label = labels.find(text);
+    if (label == labels.end()) return false;
+    address = label->second;
+    return true;
+}
+
+std::string Debugger::describe(uint16_t address) const
+{
+    std::map<uint16_t, std::string>::const_iterator label = label_at.find(address);
+    return label == label_at.end() ? std::to_string(address) : std::to_string(address) + " <" + label->second + '>';
+}
+
+void Debugger::report(Stop stop, std::ostream& out) const
+{
+    uint16_t ip = proc.get_ip();
+    if (stop == Stop::HALT)
+    {
+        out << "The program has halted after " << proc.executed << " commands.\n";
+        return;
+    }
+    if (stop == Stop::TRAP)
+    {
+        if (proc.trap == Processor::Trap::STACK_OVERFLOW) out << "Call stack overflow at address " << ip << ".\n";
+        else if (proc.trap == Processor::Trap::STACK_UNDERFLOW) out << "Return with empty call stack at address " << ip << ".\n";
+        else if (proc.trap == Processor::Trap::DATA_STACK_OVERFLOW) out << "Data stack overflow at address " << ip << ".\n";
+        else out << "Pop from empty data stack frame at address " << ip << ".\n";
+        return;
+    }
+    if (stop == Stop::BREAKPOINT) out << "Breakpoint, ";
+    else if (stop == Stop::WATCHPOINT)
+    {
+        Word before, after = proc.memory.get_word(changed);
+        before.uval = previous;
+        out << "Word " << describe(changed) << " changed from " << before.ival << " to " << after.ival << ", ";
+    }
+    out << describe(ip) << ": " << disassemble(proc.memory.get_word(ip)) << '\n';
+}
+
+// Registers point to the words they are used with
+void Debugger::print_registers(std::ostream& out, int first, int last) const
+{
+    bool all = first >= 0;
+    if (!all)
+    {
+        first = 0;
+        last = Processor::START_STACK - 1;
+    }
+    for (int reg = first; reg <= last && reg < Processor::ADDRESS_REGS; reg++)
+    {
+        uint16_t address = proc.address_regs[reg];
+        if (!all && !address) continue;
+        out << 'r' << std::left << std::setw(4) << reg << std::right << "= " << std::setw(5) << address
+            << "   [" << describe(address) << "] = " << proc.memory.get_word(address).ival << '\n';
+    }
+}
+
+void Debugger::print_flags(std::ostream& out) const
+{
+    out << "Flags " << proc.flags << ':';
+    for (uint8_t flag = 0; flag < sizeof(FLAG_NAMES) / sizeof(FLAG_NAMES[0]); flag++)
+        if (proc.get_flag(flag)) out << ' ' << FLAG_NAMES[flag] << " (" << int(flag) << ')';
+    out << '\n';
+}
+
+// The CALL commands are before the return addresses. The extended call stack isn't shown
+void Debugger::print_stack(std::ostream& out) const
+{
+    out << "At " << describe(proc.get_ip()) << '\n';
+    uint16_t returns[Processor::ADDRESS_REGS - Processor::START_STACK];
+    size_t count = proc.return_addresses(returns, Processor::ADDRESS_REGS - Processor::START_STACK);
+    for (size_t i = 0; i < count; i++)
+        out << "Called from " << describe(uint16_t(returns[i] - 2)) << '\n';
+    if (proc.extended_stack()) out << "The extended call stack isn't shown.\n";
+}
+
+void Debugger::list(std::ostream& out, uint16_t address, size_t count) const
+{
+    for (size_t i = 0; i < count; i++, address += 2)
+        out << (address == proc.get_ip() ? "=> " : "   ") << (breakpoints.count(address) ? '*' : ' ') << ' '
+            << describe(address) << ": " << disassemble(proc.memory.get_word(address)) << '\n';
+}
+
+void Debugger::run(std::istream& commands, std::ostream& out)
+{
+    bool interactive = &commands == &std::cin && isatty(STDIN_FILENO);
+    report(Stop::STEP, out);
+    std::string line, last;
+    for (;;)
+    {
+        if (interactive) out << "(vm) " << std::flush;
+        if (!std::getline(commands, line)) break;
+        if (line.find_first_not_of(" \t\r") == std::string::npos) line = last;
+        else last = line;
+        if (line.empty()) continue;
+        if (!interactive) out << "(vm) " << line << '\n'; // A script is echoed
+
+        std::istringstream args(line);
+        std::string command, first, second;
+        args >> command >> first >> second;
+        uint16_t address = 0, end = 0;
+        bool has_address = parse_address(first, address);
+        if (!first.empty() && !has_address && command != "step" && command != "s" && command != "regs" &&
+            command != "r" && command != "list" && command != "l")
+        {
+            out << "Unknown address '" << first << "'.\n";
+            continue;
+        }
+
+        if (command == "quit" || command == "q") break;
+        else if (command == "break" || command == "b")
+        {
+            if (!has_address) out << "Specify the address.\n";
+            else if (!set_breakpoint(address)) out << "There is a breakpoint at " << describe(address) << ".\n";
+            else out << "Breakpoint at " << describe(address) << ".\n";
+        }
+        else if (command == "delete" || command == "d")
+        {
+            if (!has_address || !remove_breakpoint(address)) out << "No breakpoint at the address.\n";
+        }
+        else if (command == "watch" || command == "w")
+        {
+            if (!has_address) out << "Specify the address.\n";
+            else if (!watch(address)) out << "Failed to protect the page of " << describe(address) << ".\n";
+            else out << "Watching word " << describe(address) << " = " << proc.memory.get_word(address).ival << ".\n";
+        }
+        else if (command == "unwatch")
+        {
+            if (!has_address || !unwatch(address)) out << "The word isn't watched.\n";
+        }
+        else if (command == "step" || command == "s")
+            report(step(first.empty() ? 1 : std::max(std::atol(first.c_str()), 1L)), out);
+        else if (command == "continue" || command == "c")
+            report(resume(), out);
+        else if (command == "regs" || command == "r")
+        {
+            if (first.empty()) print_registers(out, -1, -1);
+            else print_registers(out, std::atoi(first.c_str()), std::atoi((second.empty() ? first : second).c_str()));
+        }
+        else if (command == "mem" || command == "m")
+        {
+            if (!has_address) out << "Specify the address.\n";
+            else if (!second.empty() && !parse_address(second, end)) out << "Unknown address '" << second << "'.\n";
+            else proc.memory.print_memory(address, second.empty() ? address : std::max(address, end), out);
+        }
+        else if (command == "word" || command == "x")
+        {
+            if (!has_address) out << "Specify the address.\n";
+            else
+            {
+                Word word = proc.memory.get_word(address);
+                out << "Word " << describe(address) << " = " << word.ival << ", unsigned " << word.uval
+                    << ", fraction " << word.fval << '\n';
+            }
+        }
+        else if (command == "flags" || command == "f") print_flags(out);
+        else if (command == "where") print_stack(out);
+        else if (command == "list" || command == "l")
+        {
+            if (!first.empty() && !has_address) out << "Unknown address '" << first << "'.\n";
+            else list(out, has_address ? address : proc.get_ip(), second.empty() ? 8 : std::atoi(second.c_str()));
+        }
+        else out << "Unknown command '" << command << "'.\n";
+    }
+}
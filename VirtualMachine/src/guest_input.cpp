@@ -0,0 +1,60 @@
+#include "guest_input.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <limits>
+
+void GuestInput::append(const char* data, size_t size)
+{
+    // Dropping the parsed part once it's bigger than the rest
+    if (position > 4096 && position * 2 > buffer.size())
+    {
+        buffer.erase(0, position);
+        position = 0;
+    }
+    buffer.append(data, size);
+}
+
+template <NumType T>
+bool GuestInput::read(Word& value) noexcept
+{
+    value = Word();
+    if (failed) return true;
+
+    size_t first = position;
+    while (first < buffer.size() && isspace(static_cast<unsigned char>(buffer[first]))) first++;
+    size_t last = first;
+    while (last < buffer.size() && !isspace(static_cast<unsigned char>(buffer[last]))) last++;
+    if (last == buffer.size() && !closed) return false;
+
+    std::string token(buffer, first, last - first);
+    const char* begin = token.c_str();
+    char* end = nullptr;
+    errno = 0;
+    if constexpr (T == NumType::INT)
+    {
+        long long number = strtoll(begin, &end, 10);
+        if (number < std::numeric_limits<int32_t>::min() || number > std::numeric_limits<int32_t>::max())
+            errno = ERANGE;
+        value.ival = int32_t(number);
+    }
+    else if constexpr (T == NumType::UINT)
+        value.uval = uint32_t(strtoul(begin, &end, 10));
+    else
+        value.fval = strtof(begin, &end);
+
+    // Like std::cin, a value is taken from the beginning of the token and the rest is read next time
+    if (end == begin || errno == ERANGE)
+    {
+        value = Word();
+        failed = true;
+        position = last;
+        return true;
+    }
+    position = first + (end - begin);
+    return true;
+}
+
+template bool GuestInput::read<NumType::INT>(Word&) noexcept;
+template bool GuestInput::read<NumType::UINT>(Word&) noexcept;
+template bool GuestInput::read<NumType::FLOAT>(Word&) noexcept;
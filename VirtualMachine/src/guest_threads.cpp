@@ -0,0 +1,66 @@
+#include "guest_threads.h"
+#include <algorithm>
+
+GuestThreads::~GuestThreads()
+{
+    join_all();
+}
+
+// Starting a thread with the registers and the modes of the parent
+uint32_t GuestThreads::spawn(const Processor& parent, uint16_t address)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (threads.size() >= MAX_THREADS) return 0;
+
+    std::unique_ptr<Thread> thread(new Thread());
+    Processor* proc = new Processor(parent.memory);
+    thread->proc.reset(proc);
+    std::copy(parent.address_regs, parent.address_regs + Processor::ADDRESS_REGS, proc->address_regs);
+    proc->set_extended_stack(parent.extended_stack());
+    proc->set_fast_float(parent.fast_float());
+    proc->output = parent.output;
+    proc->threads = this;
+    uint32_t stack = Memory::MEM_SIZE - (threads.size() + 1) * THREAD_STACK;
+    proc->set_data_stack(stack, stack - THREAD_STACK);
+
+    Thread* started = thread.get();
+    thread->host = std::thread([this, started, address] {
+        started->proc->run(address);
+        std::lock_guard<std::mutex> lock(mutex);
+        started->done = true;
+        finished.notify_all();
+    });
+    threads.push_back(std::move(thread));
+    return threads.size();
+}
+
+void GuestThreads::join(uint32_t id)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (id == 0 || id > threads.size()) return;
+    Thread* thread = threads[id - 1].get();
+    finished.wait(lock, [thread] { return thread->done; });
+}
+
+void GuestThreads::join_all()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] {
+            return std::all_of(threads.begin(), threads.end(), [](const std::unique_ptr<Thread>& thread) {
+                return thread->done;
+            });
+        });
+    }
+    // No thread is running, so no new ones are started
+    for (const std::unique_ptr<Thread>& thread : threads)
+        if (thread->host.joinable()) thread->host.join();
+}
+
+size_t GuestThreads::failed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::count_if(threads.begin(), threads.end(), [](const std::unique_ptr<Thread>& thread) {
+        return thread->done && thread->proc->trap != Processor::Trap::NONE;
+    });
+}
@@ -0,0 +1,143 @@
+#include "lexer.h"
+#include "command.h"
+#include <charconv>
+
+static bool is_space(char c) noexcept
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// A token ends with a space, a comment or the end of the line
+static bool is_token_end(char c) noexcept
+{
+    return is_space(c) || c == '#' || c == '\n';
+}
+
+Lexer::Lexer(const char* begin, const char* end) noexcept
+    : pos(begin), end(end), line_start(begin), line_number(1), has_error(false), error_()
+{
+}
+
+bool Lexer::fail(const char* at, const char* message) noexcept
+{
+    has_error = true;
+    error_ = ParseError { line_number, size_t(at - line_start) + 1, message };
+    return false;
+}
+
+bool Lexer::fail_field(const BytecodeLine& line, int field, const char* message) noexcept
+{
+    has_error = true;
+    error_ = ParseError { line.line, line.columns[field], message };
+    return false;
+}
+
+// Moving to the beginning of the next line
+void Lexer::skip_line() noexcept
+{
+    while (pos < end && *pos != '\n')
+        pos++;
+    if (pos < end)
+    {
+        pos++;
+        line_number++;
+        line_start = pos;
+    }
+}
+
+// Checking the number of fields and their ranges for the mark
+bool Lexer::check_fields(const BytecodeLine& line) noexcept
+{
+    auto in_range = [&](int field, int64_t min, int64_t max) {
+        return line.values[field] >= min && line.values[field] <= max;
+    };
+
+    if (line.mark == 'k')
+    {
+        if (line.count == 0) return fail_field(line, 0, "command code expected");
+        if (!in_range(0, 0, OPCODES_COUNT - 1)) return fail_field(line, 0, "unknown command code");
+
+        // Same layouts as in parse_command: a register or the CALL address, a register and
+        // an address, or three registers
+        bool is_call = line.values[0] == 51;
+        for (int i = 1; i < line.count; i++)
+        {
+            bool is_address = (line.count == 2 && is_call) || (line.count == 3 && i == 2);
+            if (is_address && !in_range(i, -32768, 65535)) return fail_field(line, i, "address out of range");
+            if (!is_address && !in_range(i, 0, 255)) return fail_field(line, i, "register out of range");
+        }
+        return true;
+    }
+
+    if (line.count == 0)
+        return fail(pos, "value expected");
+    if (line.count > 1)
+        return fail_field(line, 1, "unexpected field");
+    if ((line.mark == 'a' || line.mark == 'e') && !in_range(0, 0, 65535))
+        return fail_field(line, 0, "address out of range");
+    if ((line.mark == 'i' || line.mark == 'u') && !in_range(0, INT32_MIN, UINT32_MAX))
+        return fail_field(line, 0, "value out of range");
+    return true;
+}
+
+// Reading the next line with a mark. Returns false at the end of the text or on an error
+bool Lexer::next(BytecodeLine& line) noexcept
+{
+    if (has_error) return false;
+
+    while (pos < end)
+    {
+        while (pos < end && is_space(*pos))
+            pos++;
+        if (pos == end) break;
+        if (*pos == '\n' || *pos == '#')
+        {
+            skip_line();
+            continue;
+        }
+
+        // The mark is a single letter
+        const char* mark = pos++;
+        if (pos < end && !is_token_end(*pos))
+            return fail(mark, "unknown mark");
+        if (*mark != 'a' && *mark != 'e' && *mark != 'i' && *mark != 'u' && *mark != 'f' && *mark != 'k')
+            return fail(mark, "unknown mark");
+
+        line.mark = *mark;
+        line.count = 0;
+        line.line = line_number;
+        line.fval = 0;
+
+        while (true)
+        {
+            while (pos < end && is_space(*pos))
+                pos++;
+            if (pos == end || *pos == '\n' || *pos == '#') break;
+
+            if (line.count == BytecodeLine::MAX_VALUES)
+                return fail(pos, "too many fields");
+
+            const char* token = pos;
+            while (pos < end && !is_token_end(*pos))
+                pos++;
+            const char* first = token;
+            if (*first == '+' && first + 1 < pos && first[1] != '-') first++;
+
+            std::from_chars_result result;
+            if (line.mark == 'f')
+                result = std::from_chars(first, pos, line.fval);
+            else
+                result = std::from_chars(first, pos, line.values[line.count]);
+            if (result.ec != std::errc() || result.ptr != pos)
+                return fail(token, "invalid number");
+
+            line.columns[line.count] = token - line_start + 1;
+            line.count++;
+        }
+
+        if (!check_fields(line)) return false;
+        skip_line();
+        return true;
+    }
+    return false;
+}
@@ -1,67 +1,56 @@
 #include "loader.h"
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
 
-// Splitting a string into pieces separated by a space
-std::vector<std::string> split(const std::string& line) noexcept
-{
-    std::stringstream ss(line);
-    std::string line_part;
-    std::vector<std::string> splitted = std::vector<std::string>();
-    while (std::getline(ss, line_part, ' '))
-    {
-        if (line_part == "#")
-            return splitted;
-        if (line_part != "")
-            splitted.push_back(line_part);
-    }
-    return splitted;
-}
-
-// Parsing a string with memory allocation for a variable
-void parse_variable(std::vector<std::string>& parts, uint16_t adrs, Processor& cpu) noexcept
+// Parsing a line with memory allocation for a variable
+void parse_variable(const BytecodeLine& line, uint16_t adrs, Processor& cpu) noexcept
 {
     Word word = Word();
-    if (parts[0] == "i") word.ival = stoi(parts[1]);
-    else if (parts[0] == "u") word.uval = stoi(parts[1]);
-    else if (parts[0] == "f") word.fval = stof(parts[1]);
+    if (line.mark == 'i') word.ival = line.values[0];
+    else if (line.mark == 'u') word.uval = line.values[0];
+    else if (line.mark == 'f') word.fval = line.fval;
     cpu.memory.set_word(adrs, word);
 }
 
-// Parsing strings of code
-Word parse_command(std::vector<std::string>& parts, Processor& cpu) noexcept
+// Parsing lines of code
+Word parse_command(const BytecodeLine& line) noexcept
 {
     Word command = Word();
-    command.cmd3ops.cmd = std::stoi(parts[1]);
-    if (parts.size() == 3) // 3 parts per line
+    command.cmd3ops.cmd = line.values[0];
+    if (line.count == 2) // 3 parts per line
     {
-        if (command.cmd3ops.cmd == 51) command.cmd2ops.adrs = std::stoi(parts[2]);
-        else command.cmd3ops.regs[2] = std::stoi(parts[2]);
+        if (command.cmd3ops.cmd == 51) command.cmd2ops.adrs = line.values[1];
+        else command.cmd3ops.regs[2] = line.values[1];
     }
-    else if (parts.size() == 4) // 4 pieces per line
+    else if (line.count == 3) // 4 pieces per line
     {
-        command.cmd2ops.reg = std::stoi(parts[2]);
-        command.cmd2ops.adrs = std::stoi(parts[3]);
+        command.cmd2ops.reg = line.values[1];
+        command.cmd2ops.adrs = line.values[2];
     }
-    else if (parts.size() > 4) // 5 pieces per line
+    else if (line.count == 4) // 5 pieces per line
         for (int i = 0; i < 3; i++)
-            command.cmd3ops.regs[i] = std::stoi(parts[i + 2]);
+            command.cmd3ops.regs[i] = line.values[i + 1];
     return command;
 }
 
-// Parsing all strings
-bool parse_line_parts(std::vector<std::string>& parts, uint16_t address, Processor& cpu) noexcept
+// Writing a line into memory
+bool parse_line_parts(const BytecodeLine& line, uint16_t address, Processor& cpu) noexcept
 {
     Word command = Word();
 
-    if (parts[0] == "i" || parts[0] == "u" || parts[0] == "f")
-        parse_variable(parts, address, cpu);
-    else if (parts[0] == "e")
+    if (line.mark == 'i' || line.mark == 'u' || line.mark == 'f')
+        parse_variable(line, address, cpu);
+    else if (line.mark == 'e')
     {
         command.uval = 0;
         cpu.memory.set_word(address, command);
     }
-    else if (parts[0] == "k")
+    else if (line.mark == 'k')
     {
-        command = parse_command(parts, cpu);
+        command = parse_command(line);
         cpu.memory.set_word(address, command);
     }
     else return false; // The command is not written to memory
@@ -69,36 +58,257 @@ bool parse_line_parts(std::vector<std::string>& parts, uint16_t address, Process
     return true; // The command is written to memory
 }
 
-// Function that implements the bootloader
-void load(Processor& cpu, char* filename) noexcept
+// Texts from this size are loaded in parallel chunks of at least MIN_CHUNK_SIZE bytes
+static constexpr size_t PARALLEL_TEXT_SIZE = 1 << 20;
+static constexpr size_t MIN_CHUNK_SIZE = 256 << 10;
+static size_t load_threads = 0;
+
+void set_load_threads(size_t threads) noexcept
+{
+    load_threads = threads;
+}
+
+// Lines of a chunk written one after another: from the start of the chunk or from an 'a' line
+struct TextSegment
 {
-    std::string line;
-    std::vector<std::string> line_parts;
-    std::ifstream fin;
-    fin.open(filename);
-    uint16_t code_address = 0, run_address = 0;
-    if (fin)
+    bool absolute; // Starts at the 'a' address, otherwise where the previous chunk ends
+    uint32_t address; // The 'a' address, then the resolved start
+    uint32_t words;
+};
+
+// Whole lines of the text, scanned without writing memory
+struct TextChunk
+{
+    const char* begin;
+    const char* end;
+    std::vector<TextSegment> segments;
+    bool has_entry = false;
+    int64_t entry = 0; // Value of the last 'e' line
+    bool failed = false;
+};
+
+// Running the task for every chunk, on the calling thread and a host thread per other chunk
+template <class Task>
+static void run_chunks(size_t count, const Task& task) noexcept
+{
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; i++)
     {
-        // Loading commands and variables into memory
-        while (std::getline(fin, line))
+        try
+        {
+            threads.emplace_back(task, i);
+        }
+        catch (const std::system_error&)
         {
-            line_parts = split(line);
+            task(i); // No more host threads
+        }
+    }
+    task(0);
+    for (std::thread& thread : threads)
+        thread.join();
+}
 
-            if (line_parts.size() > 0)
+// Loading a large text in two passes over the chunks in parallel. The first one counts the words
+// of the segments and finds the 'a' and 'e' lines, then the start addresses of the segments are
+// summed up in order and the second pass writes the words. Returns false without writing anything
+// if the text is invalid, doesn't fit into memory or has overlapping segments, where the result
+// depends on the order of the lines, so the sequential load gives the same result and errors
+static bool load_text_parallel(Processor& cpu, const char* begin, const char* end, uint16_t& run_address) noexcept
+{
+    size_t threads = load_threads ? load_threads : std::thread::hardware_concurrency();
+    size_t count = std::min<size_t>(threads, (end - begin) / MIN_CHUNK_SIZE);
+    if (count < 2) return false;
+
+    // Chunk borders are moved to the line starts
+    std::vector<TextChunk> chunks(count);
+    const char* pos = begin;
+    for (size_t i = 0; i < count; i++)
+    {
+        chunks[i].begin = pos;
+        if (i + 1 < count)
+        {
+            pos = std::max(pos, begin + (end - begin) / count * (i + 1));
+            pos = std::find(pos, end, '\n');
+            if (pos != end) pos++;
+        }
+        else pos = end;
+        chunks[i].end = pos;
+    }
+
+    run_chunks(count, [&chunks](size_t i) {
+        TextChunk& chunk = chunks[i];
+        Lexer lexer(chunk.begin, chunk.end);
+        BytecodeLine line;
+        chunk.segments.push_back(TextSegment { false, 0, 0 });
+        while (lexer.next(line))
+        {
+            if (line.mark == 'a')
             {
-                if (line_parts[0] == "a")
-                    code_address = std::stoi(line_parts[1]);
-                else
-                {
-                    if (line_parts[0] == "e")
-                        run_address = std::stoi(line_parts[1]) - 2;
-                    if (parse_line_parts(line_parts, code_address, cpu))
-                        code_address += 2;
-                }
+                chunk.segments.push_back(TextSegment { true, uint32_t(line.values[0]), 0 });
+                continue;
             }
+            if (line.mark == 'e')
+            {
+                chunk.has_entry = true;
+                chunk.entry = line.values[0];
+            }
+            chunk.segments.back().words++;
         }
+        chunk.failed = lexer.failed();
+    });
 
-        cpu.run(run_address);
+    // Start addresses, with the checks of the sequential load for the last word of every segment
+    std::vector<std::pair<uint32_t, uint32_t>> spans; // Cells written by the segments
+    uint32_t address = 0;
+    for (TextChunk& chunk : chunks)
+    {
+        if (chunk.failed) return false;
+        for (TextSegment& segment : chunk.segments)
+        {
+            if (segment.absolute) address = segment.address;
+            segment.address = address;
+            if (!segment.words) continue;
+            address += segment.words * 2;
+            if (address - 1 >= Memory::MEM_SIZE) return false;
+            spans.emplace_back(segment.address, address);
+        }
     }
-    else std::cout << "Failed to open file.\n";
+    std::sort(spans.begin(), spans.end());
+    for (size_t i = 1; i < spans.size(); i++)
+        if (spans[i].first < spans[i - 1].second) return false;
+
+    run_chunks(count, [&chunks, &cpu](size_t i) {
+        const TextChunk& chunk = chunks[i];
+        Lexer lexer(chunk.begin, chunk.end);
+        BytecodeLine line;
+        size_t segment = 0;
+        uint32_t address = chunk.segments[0].address;
+        while (lexer.next(line))
+        {
+            if (line.mark == 'a') address = chunk.segments[++segment].address;
+            else if (parse_line_parts(line, address, cpu)) address += 2;
+        }
+    });
+
+    run_address = 0;
+    for (const TextChunk& chunk : chunks)
+        if (chunk.has_entry) run_address = chunk.entry - 2;
+    return true;
+}
+
+// Loading a program from the bytecode text
+bool load_text(Processor& cpu, const char* begin, const char* end, uint16_t& run_address, ParseError& error) noexcept
+{
+    if (size_t(end - begin) >= PARALLEL_TEXT_SIZE && load_text_parallel(cpu, begin, end, run_address)) return true;
+
+    Lexer lexer(begin, end);
+    BytecodeLine line;
+    uint32_t code_address = 0;
+    run_address = 0;
+
+    // Loading commands and variables into memory
+    while (lexer.next(line))
+    {
+        if (line.mark == 'a')
+        {
+            code_address = line.values[0];
+            continue;
+        }
+        if (code_address + 1 >= Memory::MEM_SIZE)
+        {
+            error = ParseError { line.line, 1, "program does not fit into memory" };
+            return false;
+        }
+        if (line.mark == 'e')
+            run_address = line.values[0] - 2;
+        if (parse_line_parts(line, code_address, cpu))
+            code_address += 2;
+    }
+
+    if (lexer.failed())
+    {
+        error = lexer.error();
+        return false;
+    }
+    return true;
+}
+
+// Loading a program from a binary image written by the assembler
+bool load_image(Processor& cpu, const char* begin, const char* end, uint16_t& run_address, ParseError& error) noexcept
+{
+    const char* pos = begin + 4; // After "VM9B"
+    auto read = [&](uint16_t& value) {
+        if (end - pos < 2) return false;
+        value = uint8_t(pos[0]) | uint8_t(pos[1]) << 8;
+        pos += 2;
+        return true;
+    };
+    auto fail = [&](const char* message) {
+        error = ParseError { 0, size_t(pos - begin), message };
+        return false;
+    };
+
+    uint16_t version, segments;
+    if (!read(version) || !read(run_address) || !read(segments)) return fail("truncated image");
+    if (version != 1) return fail("unsupported image version");
+
+    for (uint16_t s = 0; s < segments; s++)
+    {
+        uint16_t address, cells;
+        if (!read(address) || !read(cells)) return fail("truncated image");
+        if (cells % 2 || uint32_t(address) + cells > Memory::MEM_SIZE) return fail("segment does not fit into memory");
+        for (uint16_t i = 0; i < cells; i += 2)
+        {
+            uint16_t low, high;
+            if (!read(low) || !read(high)) return fail("truncated image");
+            cpu.memory.set_word(address + i, low, high);
+        }
+    }
+    return pos == end || fail("unexpected data after the last segment");
+}
+
+// Reading a whole file. A directory opens too, but has no contents to read
+bool read_file(const char* filename, std::string& contents) noexcept
+{
+    struct stat info;
+    std::ifstream fin(filename, std::ios::binary);
+    if (!fin || stat(filename, &info) != 0 || !S_ISREG(info.st_mode)) return false;
+    contents.resize(info.st_size);
+    return bool(fin.read(&contents[0], contents.size()));
+}
+
+// Loading a program into memory without running it
+bool load_program(Processor& cpu, const char* filename, uint16_t& run_address) noexcept
+{
+    std::string text;
+    if (!read_file(filename, text))
+    {
+        std::cout << "Failed to open file.\n";
+        return false;
+    }
+
+    ParseError error;
+    bool is_image = text.size() >= 4 && memcmp(text.data(), "VM9B", 4) == 0;
+    if (!(is_image ? load_image : load_text)(cpu, &text[0], &text[0] + text.size(), run_address, error))
+    {
+        std::cout << filename << ':' << error.line << ':' << error.column << ": " << error.message << '\n';
+        return false;
+    }
+    return true;
+}
+
+// The cells are scanned down from the end of memory
+uint32_t program_end(const Memory& memory) noexcept
+{
+    for (uint32_t address = Memory::MEM_SIZE - 1; address > 0; address--)
+        if (memory.get_word(address).cells[0]) return address + 1;
+    return memory.get_word(0).cells[0] ? 1 : 0;
+}
+
+// Function that implements the bootloader
+void load(Processor& cpu, char* filename) noexcept
+{
+    uint16_t run_address = 0;
+    if (load_program(cpu, filename, run_address))
+        cpu.run(run_address);
 }
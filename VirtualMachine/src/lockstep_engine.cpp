@@ -0,0 +1,492 @@
+#include "lockstep_engine.h"
+#include <algorithm>
+#include <cstring>
+
+// Flags set by the integer and fraction results (zero, parity and sign)
+static constexpr uint16_t INT_FLAGS = 1 << 0 | 1 << 1 | 1 << 8;
+static constexpr uint16_t FLOAT_FLAGS = 1 << 0 | 1 << 8;
+static constexpr uint16_t OVERFLOW_FLAGS = 1 << 9 | 1 << 10;
+
+static inline uint16_t int_flags(Word result) noexcept
+{
+    return (result.ival == 0) | ((result.uval & 1) == 0) << 1 | (result.ival < 0) << 8;
+}
+
+static inline uint16_t float_flags(Word result) noexcept
+{
+    return (result.fval == 0) | (result.fval < 0) << 8;
+}
+
+LockstepEngine::LockstepEngine(const Memory& image) : image(image), cells(size_t(Memory::MEM_SIZE) * LANES)
+{
+}
+
+// Words at the address in all lanes
+void LockstepEngine::load(uint16_t address, Word (&values)[LANES]) const noexcept
+{
+    const uint16_t* low = &cells[size_t(address) * LANES];
+    const uint16_t* high = &cells[size_t(uint16_t(address + 1)) * LANES];
+    for (int lane = 0; lane < LANES; lane++)
+        values[lane].uval = low[lane] | uint32_t(high[lane]) << 16;
+}
+
+// Writing the words of the lanes of the current group
+void LockstepEngine::store(uint16_t address, const Word (&values)[LANES]) noexcept
+{
+    uint16_t* low = &cells[size_t(address) * LANES];
+    for (int lane = 0; lane < LANES; lane++)
+        low[lane] = (uint16_t(values[lane].uval) & active[lane]) | (low[lane] & ~active[lane]);
+    uint16_t* high = &cells[size_t(uint16_t(address + 1)) * LANES];
+    for (int lane = 0; lane < LANES; lane++)
+        high[lane] = (uint16_t(values[lane].uval >> 16) & active[lane]) | (high[lane] & ~active[lane]);
+}
+
+// Replacing the changed flags of the lanes of the current group with the values
+void LockstepEngine::set_flags(uint16_t changed, const uint16_t (&values)[LANES]) noexcept
+{
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        uint16_t mask = changed & active[lane];
+        flags[lane] = (flags[lane] & ~mask) | (values[lane] & mask);
+    }
+}
+
+// Command reg1 = reg2 op reg3, op returns the flags of the result
+template <class Op>
+void LockstepEngine::binary(Word word, uint16_t changed, Op op) noexcept
+{
+    Word values1[LANES], values2[LANES], results[LANES];
+    uint16_t result_flags[LANES];
+    load(current.regs[word.cmd3ops.regs[1]], values1);
+    load(current.regs[word.cmd3ops.regs[2]], values2);
+    for (int lane = 0; lane < LANES; lane++)
+        result_flags[lane] = op(values1[lane], values2[lane], results[lane]);
+    store(current.regs[word.cmd3ops.regs[0]], results);
+    set_flags(changed, result_flags);
+}
+
+// Command target = op reg3
+template <class Op>
+void LockstepEngine::unary(Word word, uint8_t target, uint16_t changed, Op op) noexcept
+{
+    Word values[LANES], results[LANES];
+    uint16_t result_flags[LANES];
+    load(current.regs[word.cmd3ops.regs[2]], values);
+    for (int lane = 0; lane < LANES; lane++)
+        result_flags[lane] = op(values[lane], results[lane]);
+    store(current.regs[target], results);
+    set_flags(changed, result_flags);
+}
+
+// Running the program in the lanes until all of them halt
+void LockstepEngine::run(uint16_t start_address, const std::vector<Lane>& lanes)
+{
+    for (uint32_t address = 0; address < Memory::MEM_SIZE; address += 2)
+    {
+        Word word = image.get_word(address);
+        for (int lane = 0; lane < LANES; lane++)
+        {
+            cells[address * LANES + lane] = word.cells[0];
+            cells[(address + 1) * LANES + lane] = word.cells[1];
+        }
+    }
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        flags[lane] = 0;
+        lane_io[lane] = lane < int(lanes.size()) ? lanes[lane] : Lane { nullptr, nullptr };
+    }
+    if (lanes.empty()) return;
+
+    current.ip = start_address;
+    current.sp = Processor::START_STACK;
+    current.data_sp = current.frame = 0;
+    memset(current.saved_frames, 0, sizeof(current.saved_frames));
+    current.lanes = lanes.size() >= LANES ? (1u << LANES) - 1 : (1u << lanes.size()) - 1;
+    memset(current.regs, 0, sizeof(current.regs));
+    waiting.clear();
+    schedule(true);
+
+    for (;;)
+    {
+        Word word;
+        if (!fetch(word)) continue; // The lanes have different code at the Instruction Pointer
+        uint8_t cmd = word.cmd3ops.cmd;
+        if (cmd == OP_HALT || cmd >= OPCODES_COUNT)
+        {
+            if (!schedule(false)) break; // All lanes halted
+            continue;
+        }
+
+        steps++;
+        lane_steps += __builtin_popcount(current.lanes);
+        execute(word);
+        if (current.ip >= stop) schedule(true);
+    }
+}
+
+// Command at the Instruction Pointer of the current group. Returns false if the lanes
+// have different commands there, they are split into groups by the command
+bool LockstepEngine::fetch(Word& word)
+{
+    Word values[LANES];
+    load(current.ip, values);
+    word = values[__builtin_ctz(current.lanes)];
+
+    uint32_t same = 0;
+    for (int lane = 0; lane < LANES; lane++)
+        same |= uint32_t(values[lane].uval == word.uval) << lane;
+    if ((current.lanes & same) == current.lanes) return true;
+
+    uint32_t keys[LANES];
+    for (int lane = 0; lane < LANES; lane++)
+        keys[lane] = values[lane].uval;
+    split(keys, false);
+    schedule(true);
+    return false;
+}
+
+// Executing the command in the lanes of the current group
+void LockstepEngine::execute(Word word)
+{
+    uint16_t* regs = current.regs;
+    uint8_t* ops = word.cmd3ops.regs;
+
+    switch (word.cmd3ops.cmd)
+    {
+    case OP_PRINT: case OP_PRINTU: case OP_PRINTF:
+    {
+        Word values[LANES];
+        load(regs[ops[2]], values);
+        for (uint32_t lanes = current.lanes; lanes; lanes &= lanes - 1)
+        {
+            int lane = __builtin_ctz(lanes);
+            std::ostream& out = *lane_io[lane].output;
+            if (word.cmd3ops.cmd == OP_PRINT) out << values[lane].ival << std::endl;
+            else if (word.cmd3ops.cmd == OP_PRINTU) out << values[lane].uval << std::endl;
+            else out << values[lane].fval << std::endl;
+        }
+        break;
+    }
+    case OP_READ: case OP_READU: case OP_READF:
+    {
+        Word values[LANES] = {};
+        for (uint32_t lanes = current.lanes; lanes; lanes &= lanes - 1)
+        {
+            int lane = __builtin_ctz(lanes);
+            std::istream& in = *lane_io[lane].input;
+            if (word.cmd3ops.cmd == OP_READ) in >> values[lane].ival;
+            else if (word.cmd3ops.cmd == OP_READU) in >> values[lane].uval;
+            else in >> values[lane].fval;
+        }
+        store(regs[ops[2]], values);
+        break;
+    }
+    case OP_LOAD:
+        regs[word.cmd2ops.reg] = word.cmd2ops.adrs;
+        break;
+    case OP_NEG:
+        unary(word, ops[2], INT_FLAGS, [](Word value, Word& result) {
+            result.uval = 0u - value.uval;
+            return int_flags(result);
+        });
+        break;
+    case OP_NEGF:
+        unary(word, ops[2], FLOAT_FLAGS, [](Word value, Word& result) {
+            result.fval = -value.fval;
+            return float_flags(result);
+        });
+        break;
+    case OP_CMP: case OP_CMPU: case OP_CMPF:
+    {
+        Word values1[LANES], values2[LANES];
+        uint16_t result_flags[LANES];
+        load(regs[ops[0]], values1);
+        load(regs[ops[1]], values2);
+        int flag = 2 + 2 * (word.cmd3ops.cmd - OP_CMP);
+        for (int lane = 0; lane < LANES; lane++)
+        {
+            bool equal, greater;
+            if (word.cmd3ops.cmd == OP_CMP)
+                equal = values1[lane].ival == values2[lane].ival, greater = values1[lane].ival > values2[lane].ival;
+            else if (word.cmd3ops.cmd == OP_CMPU)
+                equal = values1[lane].uval == values2[lane].uval, greater = values1[lane].uval > values2[lane].uval;
+            else
+                equal = values1[lane].fval == values2[lane].fval, greater = values1[lane].fval > values2[lane].fval;
+            result_flags[lane] = (equal | greater << 1) << flag;
+        }
+        set_flags(3 << flag, result_flags);
+        break;
+    }
+    case OP_ADD: case OP_SUB:
+    {
+        bool sub = word.cmd3ops.cmd == OP_SUB;
+        binary(word, INT_FLAGS | OVERFLOW_FLAGS, [sub](Word value1, Word value2, Word& result) {
+            if (sub) value2.uval = 0u - value2.uval;
+            result.uval = value1.uval + value2.uval;
+            int64_t wide = int64_t(value1.ival) + value2.ival;
+            return uint16_t(int_flags(result) | (wide != result.ival) << 9 | (wide != int64_t(result.uval)) << 10);
+        });
+        break;
+    }
+    case OP_MUL:
+        binary(word, INT_FLAGS | OVERFLOW_FLAGS, [](Word value1, Word value2, Word& result) {
+            result.uval = value1.uval * value2.uval;
+            int64_t wide = int64_t(value1.ival) * value2.ival;
+            return uint16_t(int_flags(result) | (wide != result.ival) << 9 | (wide != int64_t(result.uval)) << 10);
+        });
+        break;
+    case OP_ADDF: case OP_SUBF: case OP_MULF:
+    {
+        uint8_t cmd = word.cmd3ops.cmd;
+        binary(word, FLOAT_FLAGS | 1 << 11, [cmd](Word value1, Word value2, Word& result) {
+            if (cmd == OP_SUBF) value2.fval = -value2.fval;
+            double wide;
+            if (cmd == OP_MULF)
+            {
+                result.fval = value1.fval * value2.fval;
+                wide = double(value1.fval) * double(value2.fval);
+            }
+            else
+            {
+                result.fval = value1.fval + value2.fval;
+                wide = double(value1.fval) + double(value2.fval);
+            }
+            return uint16_t(float_flags(result) | (wide != result.fval) << 11);
+        });
+        break;
+    }
+    case OP_DIVU: case OP_MODU:
+    {
+        bool mod = word.cmd3ops.cmd == OP_MODU;
+        binary(word, INT_FLAGS | 1 << 12, [mod](Word value1, Word value2, Word& result) {
+            if (!value2.uval) result.uval = 0;
+            else result.uval = mod ? value1.uval % value2.uval : value1.uval / value2.uval;
+            return uint16_t(int_flags(result) | (value2.uval == 0) << 12);
+        });
+        break;
+    }
+    case OP_DIV: case OP_MOD:
+    {
+        bool mod = word.cmd3ops.cmd == OP_MOD;
+        binary(word, INT_FLAGS | 1 << 12, [mod](Word value1, Word value2, Word& result) {
+            if (!value2.ival) result.uval = 0;
+            else if (value2.ival == -1) result.uval = mod ? 0 : 0u - value1.uval; // No trap on the minimal value
+            else result.ival = mod ? value1.ival % value2.ival : value1.ival / value2.ival;
+            return uint16_t(int_flags(result) | (value2.ival == 0) << 12);
+        });
+        break;
+    }
+    case OP_DIVF:
+        binary(word, FLOAT_FLAGS | 1 << 12, [](Word value1, Word value2, Word& result) {
+            result.fval = value1.fval / value2.fval;
+            return uint16_t(float_flags(result) | (value2.fval == 0) << 12);
+        });
+        break;
+    case OP_INC:
+        unary(word, ops[2], OVERFLOW_FLAGS, [](Word value, Word& result) {
+            result.uval = value.uval + 1;
+            return uint16_t((result.ival < value.ival) << 9 | (result.uval < value.uval) << 10);
+        });
+        break;
+    case OP_DEC:
+        unary(word, ops[2], OVERFLOW_FLAGS, [](Word value, Word& result) {
+            result.uval = value.uval - 1;
+            return uint16_t((result.ival > value.ival) << 9 | (result.uval > value.uval) << 10);
+        });
+        break;
+    case OP_AND:
+        binary(word, INT_FLAGS, [](Word value1, Word value2, Word& result) {
+            result.uval = value1.uval & value2.uval;
+            return int_flags(result);
+        });
+        break;
+    case OP_OR:
+        binary(word, INT_FLAGS, [](Word value1, Word value2, Word& result) {
+            result.uval = value1.uval | value2.uval;
+            return int_flags(result);
+        });
+        break;
+    case OP_XOR:
+        binary(word, INT_FLAGS, [](Word value1, Word value2, Word& result) {
+            result.uval = value1.uval ^ value2.uval;
+            return int_flags(result);
+        });
+        break;
+    case OP_NOT:
+        unary(word, ops[0], INT_FLAGS, [](Word value, Word& result) {
+            result.uval = ~value.uval;
+            return int_flags(result);
+        });
+        break;
+    case OP_LOADR:
+        regs[ops[0]] = regs[ops[1]];
+        break;
+    case OP_LOADRV:
+    {
+        Word values[LANES];
+        load(regs[ops[1]], values);
+        store(regs[ops[0]], values);
+        break;
+    }
+    case OP_LOADF:
+    {
+        Word values[LANES];
+        uint8_t flag = ops[1];
+        for (int lane = 0; lane < LANES; lane++)
+            values[lane].uval = flag < 16 ? (flags[lane] >> flag) & 1 : 0;
+        store(regs[ops[0]], values);
+        break;
+    }
+    case OP_SETF:
+    {
+        Word values[LANES];
+        uint16_t result_flags[LANES];
+        uint8_t flag = ops[0];
+        if (flag >= 16) break; // Not a flag of the processor
+        load(regs[ops[1]], values);
+        for (int lane = 0; lane < LANES; lane++)
+            result_flags[lane] = uint16_t(values[lane].uval != 0) << flag;
+        set_flags(1 << flag, result_flags);
+        break;
+    }
+    case OP_PUSHV:
+    {
+        Word values[LANES];
+        load(regs[ops[2]], values);
+        current.data_sp -= 2;
+        store(current.data_sp, values);
+        break;
+    }
+    case OP_POPV:
+    {
+        Word values[LANES];
+        load(current.data_sp, values);
+        current.data_sp += 2;
+        store(regs[ops[2]], values);
+        break;
+    }
+    case OP_FRAME:
+        regs[word.cmd2ops.reg] = current.frame + word.cmd2ops.adrs;
+        break;
+    case OP_CALL:
+        // The stack simulated by registers 240-255 (see Processor::push)
+        regs[current.sp] = current.ip + 2;
+        current.saved_frames[current.sp - Processor::START_STACK] = current.frame;
+        current.frame = current.data_sp;
+        if (++current.sp < Processor::START_STACK) current.sp = Processor::START_STACK;
+        current.ip = word.cmd2ops.adrs;
+        return;
+    case OP_ENDP:
+        if (--current.sp < Processor::START_STACK) current.sp = Processor::ADDRESS_REGS - 1;
+        current.data_sp = current.frame;
+        current.frame = current.saved_frames[current.sp - Processor::START_STACK];
+        current.ip = regs[current.sp];
+        return;
+    default:
+        jump(word);
+        return;
+    }
+    current.ip += 2;
+}
+
+// Jump in every lane of the current group, the lanes going to different addresses are split
+void LockstepEngine::jump(Word word)
+{
+    JumpMask mask = JUMP_MASKS[word.cmd3ops.cmd];
+    uint16_t next = current.ip + 2;
+    uint16_t target;
+    switch (word.cmd3ops.regs[0])
+    {
+    case JUMP_DIRECT: target = word.cmd2ops.adrs; break;
+    case JUMP_MEMORY: target = 0; break; // Taken from the memory of each lane
+    case JUMP_REGISTERS: target = current.regs[word.cmd3ops.regs[2]] + current.regs[word.cmd3ops.regs[1]]; break;
+    default: target = current.ip + word.cmd2ops.adrs; break;
+    }
+
+    uint32_t targets[LANES];
+    if (word.cmd3ops.regs[0] == JUMP_MEMORY)
+    {
+        Word values[LANES];
+        load(word.cmd2ops.adrs, values);
+        for (int lane = 0; lane < LANES; lane++)
+            targets[lane] = jump_taken(mask, flags[lane]) ? uint16_t(values[lane].uval) : next;
+    }
+    else
+    {
+        for (int lane = 0; lane < LANES; lane++)
+            targets[lane] = jump_taken(mask, flags[lane]) ? target : next;
+    }
+    if (split(targets, true)) schedule(true);
+}
+
+// Moving the lanes with another key than the first lane of the current group into new groups,
+// one for every key. The key of a jump is the target of the lane. Returns false if all lanes
+// have the same key
+bool LockstepEngine::split(const uint32_t (&keys)[LANES], bool jump)
+{
+    uint32_t first = keys[__builtin_ctz(current.lanes)];
+    uint32_t rest = 0;
+    for (int lane = 0; lane < LANES; lane++)
+        rest |= uint32_t(keys[lane] != first) << lane;
+    rest &= current.lanes;
+    if (jump) current.ip = uint16_t(first);
+    if (!rest) return false;
+
+    Group group = current;
+    current.lanes &= ~rest;
+    while (rest)
+    {
+        uint32_t key = keys[__builtin_ctz(rest)];
+        group.lanes = 0;
+        for (uint32_t lanes = rest; lanes; lanes &= lanes - 1)
+            if (keys[__builtin_ctz(lanes)] == key) group.lanes |= lanes & -lanes;
+        rest &= ~group.lanes;
+        if (jump) group.ip = uint16_t(key);
+        waiting.push_back(group);
+    }
+    return true;
+}
+
+// Making the group with the lowest Instruction Pointer current and merging the groups at the same
+// command with the same registers into it. Without keep_current the current group has halted.
+// Returns false if there are no groups left
+bool LockstepEngine::schedule(bool keep_current)
+{
+    if (keep_current) waiting.push_back(current);
+    if (waiting.empty()) return false;
+
+    size_t lowest = 0;
+    for (size_t i = 1; i < waiting.size(); i++)
+        if (waiting[i].ip < waiting[lowest].ip) lowest = i;
+    current = waiting[lowest];
+    waiting[lowest] = waiting.back();
+    waiting.pop_back();
+
+    auto cell = [this](uint16_t address, uint32_t lanes) {
+        return cells[size_t(address) * LANES + __builtin_ctz(lanes)];
+    };
+    stop = Memory::MEM_SIZE;
+    for (size_t i = 0; i < waiting.size(); )
+    {
+        Group& group = waiting[i];
+        if (group.ip == current.ip && group.sp == current.sp
+            && group.data_sp == current.data_sp && group.frame == current.frame
+            && cell(group.ip, group.lanes) == cell(current.ip, current.lanes)
+            && cell(group.ip + 1, group.lanes) == cell(current.ip + 1, current.lanes)
+            && memcmp(group.regs, current.regs, sizeof(current.regs)) == 0
+            && memcmp(group.saved_frames, current.saved_frames, sizeof(current.saved_frames)) == 0)
+        {
+            current.lanes |= group.lanes;
+            group = waiting.back();
+            waiting.pop_back();
+            continue;
+        }
+        // A group left at the same command runs after the current one moves on
+        stop = std::min<uint32_t>(stop, group.ip > current.ip ? group.ip : current.ip + 1u);
+        i++;
+    }
+
+    for (int lane = 0; lane < LANES; lane++)
+        active[lane] = (current.lanes >> lane) & 1 ? 0xFFFF : 0;
+    return true;
+}
@@ -0,0 +1,175 @@
+#include "memoizer.h"
+#include <algorithm>
+
+Memoizer::Memoizer(Memory& memory, uint16_t entry, bool fast_float)
+    : by_entry(Memory::MEM_SIZE, -1), fixed_cells(Memory::MEM_SIZE)
+{
+    for (SubroutineEffects& effects : analyze_subroutines(memory, entry, fast_float))
+    {
+        Subroutine sub;
+        sub.key_size = 1 + effects.inputs.size();
+        for (const RegisterEffect& reg : effects.registers)
+            sub.key_size += reg.kept;
+        sub.stride = 1 + sub.key_size + effects.outputs.size() + 1 + effects.registers.size();
+        for (uint32_t location : effects.accessed)
+        {
+            if (location & FRAME_RELATIVE) sub.frame_words.push_back(location);
+            else if (effects.pure) fixed_cells[location] = fixed_cells[uint16_t(location + 1)] = true;
+        }
+        for (const std::pair<uint16_t, uint16_t>& range : effects.code)
+        {
+            memory.watch_code(range.first, range.second);
+            for (uint32_t address = range.first; address <= range.second; address++)
+                code.emplace_back(address, memory.get_word(address).cells[0]);
+        }
+        sub.effects = std::move(effects);
+        if (sub.effects.pure) by_entry[sub.effects.entry] = subroutines.size();
+        subroutines.push_back(std::move(sub));
+    }
+    code_writes = memory.code_writes;
+}
+
+// After a write into the watched cells: if the code of a pure subroutine differs, the calls
+// running now aren't stored and no subroutine is cached anymore
+void Memoizer::check_code(const Memory& memory) noexcept
+{
+    code_writes = memory.code_writes;
+    for (const std::pair<uint16_t, uint16_t>& cell : code)
+        if (memory.get_word(cell.first).cells[0] != cell.second)
+        {
+            code_changed = true;
+            break;
+        }
+    if (!code_changed) return;
+    std::fill(by_entry.begin(), by_entry.end(), -1);
+    for (Running& call : running)
+        call.stored = false;
+    for (Subroutine& sub : subroutines)
+        std::vector<uint32_t>().swap(sub.slots);
+}
+
+// Value of a register set by the subroutine, relative to its frame if the subroutine sets it by FRAME
+static uint32_t register_value(const RegisterEffect& reg, const Processor& proc, uint16_t frame) noexcept
+{
+    return uint16_t(proc.address_regs[reg.reg] - (reg.frame_relative ? frame : 0));
+}
+
+// Whether a word of the subroutine relative to the frame overlaps a word at a fixed address
+bool Memoizer::overlaps(const Subroutine& sub, uint16_t frame) const noexcept
+{
+    for (uint16_t offset : sub.frame_words)
+        if (fixed_cells[uint16_t(frame + offset)] || fixed_cells[uint16_t(frame + offset + 1)]) return true;
+    return false;
+}
+
+// Slot of the key in the cache of a subroutine
+static size_t slot_of(const uint32_t* key, size_t size) noexcept
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ key[i]) * 16777619u;
+    return (hash ^ hash >> 15) % Memoizer::CACHE_SLOTS;
+}
+
+bool Memoizer::call(Processor& proc, uint16_t target) noexcept
+{
+    if (proc.memory.code_writes != code_writes && !code_changed) check_code(proc.memory);
+    int index = by_entry[target];
+    if (index < 0)
+    {
+        depth++;
+        return false;
+    }
+
+    // The frame of the subroutine is the top of the data stack at the call
+    Subroutine& sub = subroutines[index];
+    const SubroutineEffects& effects = sub.effects;
+    uint16_t frame = proc.data_stack_top();
+    sub.calls++;
+    if (overlaps(sub, frame))
+    {
+        for (Running& call : running)
+            call.stored = false;
+        depth++;
+        return false;
+    }
+    size_t key = keys.size();
+    keys.push_back(proc.flags & effects.flag_inputs);
+    for (uint32_t input : effects.inputs)
+        keys.push_back(proc.memory.get_word(location_address(input, frame)).uval);
+    for (const RegisterEffect& reg : effects.registers)
+        if (reg.kept) keys.push_back(register_value(reg, proc, frame));
+    size_t slot = slot_of(&keys[key], sub.key_size);
+
+    const uint32_t* cached = sub.slots.empty() ? nullptr : &sub.slots[slot * sub.stride];
+    if (cached && cached[0] && std::equal(keys.begin() + key, keys.end(), cached + 1))
+    {
+        const uint32_t* outputs = cached + 1 + sub.key_size;
+        for (size_t i = 0; i < effects.outputs.size(); i++)
+        {
+            Word value = Word();
+            value.uval = outputs[i];
+            proc.memory.set_word(location_address(effects.outputs[i], frame), value);
+        }
+        proc.flags = (proc.flags & ~effects.flag_outputs) | outputs[effects.outputs.size()];
+        const uint32_t* regs = outputs + effects.outputs.size() + 1;
+        for (size_t i = 0; i < effects.registers.size(); i++)
+            proc.address_regs[effects.registers[i].reg] = regs[i] + (effects.registers[i].frame_relative ? frame : 0);
+        keys.resize(key);
+        sub.hits++;
+        return true;
+    }
+
+    running.push_back(Running { index, frame, depth, key, slot, true });
+    depth++;
+    return false;
+}
+
+void Memoizer::returned(Processor& proc) noexcept
+{
+    if (depth) depth--;
+    if (running.empty() || running.back().depth != depth) return;
+
+    // The outputs of the call that just returned
+    Running call = running.back();
+    running.pop_back();
+    Subroutine& sub = subroutines[call.subroutine];
+    const SubroutineEffects& effects = sub.effects;
+    if (!call.stored)
+    {
+        keys.resize(call.key);
+        return;
+    }
+    if (sub.slots.empty()) sub.slots.assign(CACHE_SLOTS * sub.stride, 0);
+    uint32_t* slot = &sub.slots[call.slot * sub.stride];
+    slot[0] = 1;
+    std::copy(keys.begin() + call.key, keys.begin() + call.key + sub.key_size, slot + 1);
+    uint32_t* outputs = slot + 1 + sub.key_size;
+    for (size_t i = 0; i < effects.outputs.size(); i++)
+        outputs[i] = proc.memory.get_word(location_address(effects.outputs[i], call.frame)).uval;
+    outputs[effects.outputs.size()] = proc.flags & effects.flag_outputs;
+    uint32_t* regs = outputs + effects.outputs.size() + 1;
+    for (size_t i = 0; i < effects.registers.size(); i++)
+        regs[i] = register_value(effects.registers[i], proc, call.frame);
+    keys.resize(call.key);
+}
+
+void Memoizer::print(std::ostream& out) const
+{
+    uint64_t calls = 0, hits = 0;
+    for (const Subroutine& sub : subroutines)
+    {
+        out << "Subroutine " << sub.effects.entry << ": ";
+        if (!sub.effects.pure)
+        {
+            out << "not pure, " << sub.effects.reason << '\n';
+            continue;
+        }
+        out << sub.effects.inputs.size() << " input words, " << sub.effects.outputs.size() << " output words, "
+            << sub.calls << " calls, " << sub.hits << " from the cache\n";
+        calls += sub.calls;
+        hits += sub.hits;
+    }
+    out << "Calls of pure subroutines: " << calls << ", answered from the cache: " << hits << '\n';
+    if (code_changed) out << "The code of a pure subroutine was changed, the cache was turned off\n";
+}
@@ -1,46 +1,271 @@
 #include "memory.h"
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <new>
 
-Memory::Memory()
+static constexpr Memory::PageTable zero_table(Memory::Page* zero_page) noexcept
 {
-    memory = new uint16_t[MEM_SIZE]();
+    Memory::PageTable table {};
+    for (Memory::Page*& page : table.pages)
+        page = zero_page;
+    return table;
+}
+
+Memory::Page Memory::ZERO_PAGE {};
+Memory::PageTable Memory::ZERO_TABLE = zero_table(&Memory::ZERO_PAGE);
+
+Memory::Memory(PageArena* arena) noexcept : arena(arena)
+{
+    for (PageTable*& table : tables)
+        table = &ZERO_TABLE;
 }
 
 Memory::~Memory()
 {
-    delete[] memory;
+    clear();
+}
+
+void Memory::clear() noexcept
+{
+    for (PageTable*& table : tables)
+    {
+        if (table == &ZERO_TABLE) continue;
+        for (Page* page : table->pages)
+            if (page != &ZERO_PAGE) free_block(page);
+        free_block(table);
+        table = &ZERO_TABLE;
+    }
+    pages_count = 0;
+    watched.clear();
+    code_written = true; // Decoded instructions are no longer valid
+}
+
+// Zeroed block from the arena or from the heap
+void* Memory::allocate_block(size_t size)
+{
+    void* block = arena ? arena->allocate() : nullptr;
+    return block ? block : memset(::operator new(size), 0, size);
+}
+
+void Memory::free_block(void* block) noexcept
+{
+    std::vector<Page*>::iterator mapped = std::find(isolated.begin(), isolated.end(), block);
+    if (mapped != isolated.end())
+    {
+        munmap(block, isolated_size());
+        isolated.erase(mapped);
+    }
+    else if (arena && arena->owns(block)) arena->release(block);
+    else ::operator delete(block);
+}
+
+// Replacing the zero page with a new one on the first write into it. Another guest thread
+// may replace the same entry at once, then its page (or table) is used and the new one freed
+Memory::Page* Memory::allocate_page(uint16_t address)
+{
+    PageTable** entry = &tables[address / (PAGE_SIZE * TABLE_SIZE)];
+    PageTable* table = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+    if (table == &ZERO_TABLE)
+    {
+        PageTable* created = new (allocate_block(sizeof(PageTable))) PageTable;
+        for (Page*& page : created->pages)
+            page = &ZERO_PAGE;
+        if (__atomic_compare_exchange_n(entry, &table, created, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            table = created;
+        else free_block(created);
+    }
+
+    Page** slot = &table->pages[address / PAGE_SIZE % TABLE_SIZE];
+    Page* page = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (page != &ZERO_PAGE) return page;
+    Page* created = new (allocate_block(sizeof(Page))) Page;
+    if (!__atomic_compare_exchange_n(slot, &page, created, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free_block(created);
+        return page;
+    }
+    __atomic_fetch_add(&pages_count, 1, __ATOMIC_RELAXED);
+    return created;
+}
+
+Memory::Page* Memory::writable_page(uint16_t address)
+{
+    Page* target = page(address);
+    return target == &ZERO_PAGE ? allocate_page(address) : target;
+}
+
+// Words at odd addresses may cross pages, their atomic operations take this lock
+static std::mutex unaligned_lock;
+
+// Host word over the two cells of a guest word, for the atomic instructions
+using HostWord = uint32_t __attribute__((may_alias));
+
+uint32_t Memory::fetch_add(uint16_t address, uint32_t value)
+{
+    if (address % 2)
+    {
+        std::lock_guard<std::mutex> lock(unaligned_lock);
+        Word word = get_word(address);
+        uint32_t previous = word.uval;
+        word.uval += value;
+        set_word(address, word);
+        return previous;
+    }
+    Page* target = writable_page(address);
+    uint32_t offset = address % PAGE_SIZE; // Even, so the word is in the page and aligned
+    uint32_t previous = __atomic_fetch_add(reinterpret_cast<HostWord*>(&target->cells[offset]), value, __ATOMIC_SEQ_CST);
+    if (is_code(target, offset) || is_code(target, offset + 1)) write_code();
+    return previous;
+}
+
+bool Memory::compare_exchange(uint16_t address, uint32_t& expected, uint32_t desired)
+{
+    if (address % 2)
+    {
+        std::lock_guard<std::mutex> lock(unaligned_lock);
+        Word word = get_word(address);
+        if (word.uval != expected)
+        {
+            expected = word.uval;
+            return false;
+        }
+        word.uval = desired;
+        set_word(address, word);
+        return true;
+    }
+    Page* target = writable_page(address);
+    uint32_t offset = address % PAGE_SIZE;
+    bool swapped = __atomic_compare_exchange_n(reinterpret_cast<HostWord*>(&target->cells[offset]), &expected,
+                                               desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if (swapped && (is_code(target, offset) || is_code(target, offset + 1))) write_code();
+    return swapped;
+}
+
+void Memory::print_memory(uint16_t first, uint16_t last, std::ostream& out) const noexcept
+{
+    out << "MEMORY:\n";
+    for (uint32_t address = first; address <= last; address++)
+    {
+        uint16_t cell = page(address)->cells[address % PAGE_SIZE];
+        out << "Cell " << address << " = " << (cell >> 8) << " - " <<  (int)(uint8_t)cell << '\n';
+    }
+}
+
+size_t Memory::isolated_size() noexcept
+{
+    size_t host_page = sysconf(_SC_PAGESIZE);
+    return (sizeof(Page) + host_page - 1) / host_page * host_page;
+}
+
+// The page is copied into an anonymous mapping, nothing else shares its host pages
+Memory::Page* Memory::isolate_page(uint16_t address)
+{
+    Page* current = writable_page(address);
+    if (std::find(isolated.begin(), isolated.end(), current) != isolated.end()) return current;
+
+    void* mapped = mmap(nullptr, isolated_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) return nullptr;
+    Page* created = static_cast<Page*>(memcpy(mapped, current, sizeof(Page)));
+    PageTable* table = tables[address / (PAGE_SIZE * TABLE_SIZE)];
+    __atomic_store_n(&table->pages[address / PAGE_SIZE % TABLE_SIZE], created, __ATOMIC_RELEASE);
+    free_block(current);
+    isolated.push_back(created);
+    return created;
+}
+
+// Marking the cells holding decoded instructions
+void Memory::mark_code(uint16_t first, uint16_t last)
+{
+    for (uint32_t address = first; address <= last; address++)
+    {
+        Page* target = writable_page(address); // The zero page has no marks
+        uint32_t offset = address % PAGE_SIZE;
+        target->code_marks[offset / 64] |= uint64_t(1) << (offset % 64);
+    }
 }
 
-void Memory::clear()
+// Marking cells kept after clear_code_marks
+void Memory::watch_code(uint16_t first, uint16_t last)
 {
-    memory = new uint16_t[MEM_SIZE]();
+    mark_code(first, last);
+    watched.emplace_back(first, last);
 }
 
-void Memory::set_word(uint16_t address, Word word)
+void Memory::clear_code_marks() noexcept
+{
+    for (PageTable* table : tables)
+    {
+        if (table == &ZERO_TABLE) continue;
+        for (Page* page : table->pages)
+            if (page != &ZERO_PAGE) memset(page->code_marks, 0, sizeof(page->code_marks));
+    }
+    // The pages of the watched cells exist already, marking them again doesn't allocate
+    for (const std::pair<uint16_t, uint16_t>& range : watched)
+        mark_code(range.first, range.second);
+    code_written = false;
+}
+
+
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+PageArena::PageArena(size_t blocks)
 {
-    memory[address] = word.cells[0];
-    memory[address + 1] = word.cells[1];
+    size = (blocks * BLOCK_SIZE + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (!size) return;
+
+    // Explicit huge pages if they are reserved, otherwise transparent ones if the kernel gives them
+    void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    huge = mapped != MAP_FAILED;
+    if (!huge)
+    {
+        mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped != MAP_FAILED) madvise(mapped, size, MADV_HUGEPAGE);
+    }
+    if (mapped == MAP_FAILED)
+    {
+        size = 0;
+        return;
+    }
+    base = static_cast<char*>(mapped); // Anonymous pages are zeroed by the kernel
+    free_list.reserve(size / BLOCK_SIZE); // Releasing never allocates
 }
 
-void Memory::set_word(uint16_t address, uint16_t word_part1, uint16_t word_part2)
+PageArena::~PageArena()
 {
-    memory[address] = word_part1;
-    memory[address + 1] = word_part2;
+    if (base) munmap(base, size);
 }
 
-Word Memory::get_word(uint16_t address) const noexcept
+bool PageArena::bind_to_node(int node) noexcept
 {
-    Word word = Word();
-    word.cells[1] = memory[address + 1];
-    word.cells[0] = memory[address];
-    return word;
+    unsigned long mask[16] = {}; // Nodes 0 to 1023
+    if (!base || node < 0 || size_t(node) >= sizeof(mask) * 8) return false;
+    mask[node / 64] |= 1ul << (node % 64);
+    return syscall(SYS_mbind, base, size, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0) == 0;
 }
 
-void Memory::print_memory(uint16_t first, uint16_t last) const noexcept
+void* PageArena::allocate() noexcept
 {
-    std::cout << "MEMORY:\n";
-    while (first <= last)
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!free_list.empty())
     {
-        std::cout << "Cell " << first << " = " << (memory[first] >> 8) << " - " <<  (int)(uint8_t)memory[first] << '\n';
-        first++;
+        void* block = free_list.back();
+        free_list.pop_back();
+        return block;
     }
+    if (used + BLOCK_SIZE > size) return nullptr;
+    void* block = base + used;
+    used += BLOCK_SIZE;
+    return block;
+}
+
+// Blocks are zeroed when they are returned, so allocation is cheap
+void PageArena::release(void* block) noexcept
+{
+    memset(block, 0, BLOCK_SIZE);
+    std::lock_guard<std::mutex> lock(mutex);
+    free_list.push_back(block);
 }
@@ -0,0 +1,327 @@
+#include "metrics.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+constexpr double ThreadMetrics::LATENCY_BOUNDS[];
+
+// Counters of all threads that ever ran a processor. The mutex is taken only
+// when a thread registers and on a scrape, never while counting
+static std::mutex registry_mutex;
+static std::vector<std::shared_ptr<ThreadMetrics>> registry;
+
+// The instruction rate is measured between two scrapes (the first one since the start)
+static uint64_t last_instructions = 0;
+static std::chrono::steady_clock::time_point last_scrape = std::chrono::steady_clock::now();
+
+void ThreadMetrics::run_finished(std::chrono::steady_clock::duration duration) noexcept
+{
+    double seconds = std::chrono::duration<double>(duration).count();
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS && seconds > LATENCY_BOUNDS[bucket]) bucket++;
+    add(latency[bucket], 1);
+    add(latency_sum_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    add(halted, 1);
+}
+
+ThreadMetrics& ThreadMetrics::local()
+{
+    thread_local std::shared_ptr<ThreadMetrics> metrics;
+    if (!metrics)
+    {
+        metrics = std::make_shared<ThreadMetrics>();
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(metrics);
+    }
+    return *metrics;
+}
+
+// Sum of the counter over all threads
+template <class Field>
+static uint64_t total(Field field)
+{
+    uint64_t sum = 0;
+    for (const std::shared_ptr<ThreadMetrics>& metrics : registry)
+        sum += field(*metrics).load(std::memory_order_relaxed);
+    return sum;
+}
+
+std::string metrics_text()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::ostringstream out;
+
+    uint64_t opcodes[OPCODES_COUNT];
+    uint64_t instructions = 0;
+    for (int cmd = 0; cmd < OPCODES_COUNT; cmd++)
+    {
+        opcodes[cmd] = total([cmd](ThreadMetrics& m) -> std::atomic<uint64_t>& { return m.opcodes[cmd]; });
+        instructions += opcodes[cmd];
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - last_scrape).count();
+    double rate = elapsed > 0 ? (instructions - last_instructions) / elapsed : 0;
+    last_instructions = instructions;
+    last_scrape = now;
+
+    out << "# HELP vm_instructions_total Guest instructions executed.\n"
+        << "# TYPE vm_instructions_total counter\n"
+        << "vm_instructions_total " << instructions << '\n'
+        << "# HELP vm_instructions_per_second Guest instructions per second since the previous scrape.\n"
+        << "# TYPE vm_instructions_per_second gauge\n"
+        << "vm_instructions_per_second " << rate << '\n';
+
+    out << "# HELP vm_opcode_executions_total Guest instructions executed by operation code.\n"
+        << "# TYPE vm_opcode_executions_total counter\n";
+    for (int cmd = 1; cmd < OPCODES_COUNT; cmd++)
+        out << "vm_opcode_executions_total{opcode=\"" << OPCODE_NAMES[cmd] << "\"} " << opcodes[cmd] << '\n';
+
+    out << "# HELP vm_reads_total READ commands executed.\n"
+        << "# TYPE vm_reads_total counter\n"
+        << "vm_reads_total " << opcodes[OP_READ] + opcodes[OP_READU] + opcodes[OP_READF] << '\n'
+        << "# HELP vm_prints_total PRINT commands executed.\n"
+        << "# TYPE vm_prints_total counter\n"
+        << "vm_prints_total " << opcodes[OP_PRINT] + opcodes[OP_PRINTU] + opcodes[OP_PRINTF] << '\n';
+
+    out << "# HELP vm_io_bytes_total Bytes read from the console and written to it.\n"
+        << "# TYPE vm_io_bytes_total counter\n"
+        << "vm_io_bytes_total{direction=\"in\"} "
+        << total([](ThreadMetrics& m) -> std::atomic<uint64_t>& { return m.input_bytes; }) << '\n'
+        << "vm_io_bytes_total{direction=\"out\"} "
+        << total([](ThreadMetrics& m) -> std::atomic<uint64_t>& { return m.output_bytes; }) << '\n';
+
+    uint64_t started = total([](ThreadMetrics& m) -> std::atomic<uint64_t>& { return m.started; });
+    uint64_t halted = total([](ThreadMetrics& m) -> std::atomic<uint64_t>& { return m.halted; });
+    out << "# HELP vm_guests Guest programs by state.\n"
+        << "# TYPE vm_guests gauge\n"
+        << "vm_guests{state=\"running\"} " << started - halted << '\n'
+        << "vm_guests{state=\"halted\"} " << halted << '\n';
+
+    out << "# HELP vm_run_duration_seconds Duration of the finished guest runs.\n"
+        << "# TYPE vm_run_duration_seconds histogram\n";
+    uint64_t cumulative = 0;
+    for (int bucket = 0; bucket <= ThreadMetrics::LATENCY_BUCKETS; bucket++)
+    {
+        cumulative += total([bucket](ThreadMetrics& m) -> std::atomic<uint64_t>& { return m.latency[bucket]; });
+        out << "vm_run_duration_seconds_bucket{le=\"";
+        if (bucket < ThreadMetrics::LATENCY_BUCKETS) out << ThreadMetrics::LATENCY_BOUNDS[bucket];
+        else out << "+Inf";
+        out << "\"} " << cumulative << '\n';
+    }
+    out << "vm_run_duration_seconds_sum "
+        << total([](ThreadMetrics& m) -> std::atomic<uint64_t>& { return m.latency_sum_ns; }) / 1e9 << '\n'
+        << "vm_run_duration_seconds_count " << cumulative << '\n';
+
+    // Placement counters of the threads pinned to NUMA nodes, summed by node
+    std::vector<int> nodes;
+    for (const std::shared_ptr<ThreadMetrics>& metrics : registry)
+    {
+        int node = metrics->node.load(std::memory_order_relaxed);
+        if (node >= 0 && std::find(nodes.begin(), nodes.end(), node) == nodes.end()) nodes.push_back(node);
+    }
+    std::sort(nodes.begin(), nodes.end());
+    if (nodes.empty()) return out.str();
+    struct NodeCounter
+    {
+        const char* name;
+        const char* help;
+        std::atomic<uint64_t> ThreadMetrics::*field;
+    };
+    static const NodeCounter NODE_COUNTERS[] = {
+        { "vm_node_runs_total", "Guest runs on the worker threads of the node.", &ThreadMetrics::runs },
+        { "vm_node_migrations_total", "Guests moved to the worker threads of the node by work stealing.",
+          &ThreadMetrics::migrations },
+        { "vm_node_remote_migrations_total", "Guests moved to the node from a worker thread of another node.",
+          &ThreadMetrics::remote_migrations },
+        { "vm_node_remote_runs_total", "Guest runs on the node with the guest memory on another node.",
+          &ThreadMetrics::remote_runs },
+        { "vm_node_remote_instructions_total", "Guest instructions executed on the node with the guest memory on another node.",
+          &ThreadMetrics::remote_instructions } };
+    for (const NodeCounter& counter : NODE_COUNTERS)
+    {
+        out << "# HELP " << counter.name << ' ' << counter.help << '\n'
+            << "# TYPE " << counter.name << " counter\n";
+        for (int node : nodes)
+        {
+            uint64_t sum = 0;
+            for (const std::shared_ptr<ThreadMetrics>& metrics : registry)
+                if (metrics->node.load(std::memory_order_relaxed) == node)
+                    sum += ((*metrics).*counter.field).load(std::memory_order_relaxed);
+            out << counter.name << "{node=\"" << node << "\"} " << sum << '\n';
+        }
+    }
+    return out.str();
+}
+
+
+// Stream buffer passing the characters to another one and counting them
+// in the counters of the thread that reads or writes
+class CountingBuf final : public std::streambuf
+{
+public:
+    explicit CountingBuf(std::streambuf* source) : source(source) {}
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (traits_type::eq_int_type(ch, traits_type::eof())) return source->pubsync() == 0 ? 0 : ch;
+        ThreadMetrics::add(ThreadMetrics::local().output_bytes, 1);
+        return source->sputc(traits_type::to_char_type(ch));
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize count) override
+    {
+        std::streamsize written = source->sputn(s, count);
+        ThreadMetrics::add(ThreadMetrics::local().output_bytes, written);
+        return written;
+    }
+
+    int sync() override { return source->pubsync(); }
+
+    // Taking what is already buffered by the source, but waiting for one character at most
+    int_type underflow() override
+    {
+        int_type ch = source->sbumpc();
+        if (traits_type::eq_int_type(ch, traits_type::eof())) return ch;
+        buffer[0] = traits_type::to_char_type(ch);
+        std::streamsize available = source->in_avail();
+        std::streamsize count = 1;
+        if (available > 0)
+            count += source->sgetn(buffer + 1, std::min<std::streamsize>(available, sizeof(buffer) - 1));
+        ThreadMetrics::add(ThreadMetrics::local().input_bytes, count);
+        setg(buffer, buffer, buffer + count);
+        return ch;
+    }
+
+private:
+    std::streambuf* source;
+    char buffer[256];
+};
+
+ConsoleIoCounter::ConsoleIoCounter()
+    : input(new CountingBuf(std::cin.rdbuf())), output(new CountingBuf(std::cout.rdbuf()))
+{
+    std::cout.flush();
+    original_input = std::cin.rdbuf(input.get());
+    original_output = std::cout.rdbuf(output.get());
+}
+
+ConsoleIoCounter::~ConsoleIoCounter()
+{
+    std::cout.flush();
+    std::cin.rdbuf(original_input);
+    std::cout.rdbuf(original_output);
+}
+
+
+std::unique_ptr<MetricsExporter> MetricsExporter::serve_socket(const std::string& path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) return nullptr;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return nullptr;
+    unlink(path.c_str()); // Socket left by a previous run
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 16) != 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<MetricsExporter> exporter(new MetricsExporter());
+    exporter->path = path;
+    exporter->listen_fd = fd;
+    exporter->thread = std::thread(&MetricsExporter::socket_loop, exporter.get());
+    return exporter;
+}
+
+std::unique_ptr<MetricsExporter> MetricsExporter::write_file(const std::string& path, std::chrono::milliseconds interval)
+{
+    std::unique_ptr<MetricsExporter> exporter(new MetricsExporter());
+    exporter->path = path;
+    exporter->interval = std::max(interval, std::chrono::milliseconds(10));
+    if (!exporter->write_snapshot()) return nullptr;
+    exporter->thread = std::thread(&MetricsExporter::file_loop, exporter.get());
+    return exporter;
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (thread.joinable()) thread.join();
+
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+    else write_snapshot(); // The final values
+}
+
+// Answering the connections, checking for the stop several times a second
+void MetricsExporter::socket_loop()
+{
+    pollfd listener { listen_fd, POLLIN, 0 };
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return;
+        }
+        if (poll(&listener, 1, 200) <= 0) continue;
+        int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) continue;
+
+        // A client that sends a request gets it answered as HTTP, a silent one gets the plain text
+        char request[512];
+        pollfd connection { client, POLLIN, 0 };
+        ssize_t received = poll(&connection, 1, 100) > 0 ? recv(client, request, sizeof(request), 0) : 0;
+        std::string response = metrics_text();
+        if (received >= 3 && memcmp(request, "GET", 3) == 0)
+            response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                + std::to_string(response.size()) + "\r\n\r\n" + response;
+
+        for (size_t sent = 0; sent < response.size();)
+        {
+            ssize_t count = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0) break;
+            sent += count;
+        }
+        close(client);
+    }
+}
+
+void MetricsExporter::file_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!wake.wait_for(lock, interval, [this] { return stopping; }))
+        write_snapshot();
+}
+
+// Writing into a temporary file and renaming it, so readers never see a half written file
+bool MetricsExporter::write_snapshot() const
+{
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream fout(temporary);
+        if (!fout) return false;
+        fout << metrics_text();
+        if (!fout) return false;
+    }
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
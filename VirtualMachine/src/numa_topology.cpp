@@ -0,0 +1,92 @@
+#include "numa_topology.h"
+#include <dirent.h>
+#include <sched.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+// CPU list in the sysfs format, e.g. "0-3,8-11"
+static std::vector<int> parse_cpu_list(const std::string& text)
+{
+    std::vector<int> cpus;
+    size_t position = 0;
+    while (position < text.size())
+    {
+        size_t end = text.find(',', position);
+        if (end == std::string::npos) end = text.size();
+        std::string range = text.substr(position, end - position);
+        size_t dash = range.find('-');
+        if (!range.empty() && range[0] >= '0' && range[0] <= '9')
+        {
+            int first = std::atoi(range.c_str());
+            int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+            for (int cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        }
+        position = end + 1;
+    }
+    return cpus;
+}
+
+NumaTopology::NumaTopology()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &allowed);
+
+    if (DIR* dir = opendir("/sys/devices/system/node"))
+    {
+        while (dirent* entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+                name.find_first_not_of("0123456789", 4) != std::string::npos)
+                continue;
+            std::ifstream list("/sys/devices/system/node/" + name + "/cpulist");
+            std::string text;
+            std::getline(list, text);
+            std::vector<int> cpus;
+            for (int cpu : parse_cpu_list(text))
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+            if (cpus.empty()) continue;
+            ids.push_back(std::atoi(name.c_str() + 4));
+            node_cpus.push_back(cpus);
+        }
+        closedir(dir);
+    }
+
+    if (ids.empty())
+    {
+        ids.push_back(0);
+        node_cpus.emplace_back();
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed)) node_cpus[0].push_back(cpu);
+    }
+
+    // Ordered by the node number
+    std::vector<size_t> order(ids.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return ids[a] < ids[b]; });
+    std::vector<int> sorted_ids;
+    std::vector<std::vector<int>> sorted_cpus;
+    for (size_t i : order)
+    {
+        sorted_ids.push_back(ids[i]);
+        sorted_cpus.push_back(node_cpus[i]);
+    }
+    ids.swap(sorted_ids);
+    node_cpus.swap(sorted_cpus);
+}
+
+bool NumaTopology::pin_thread(const std::vector<int>& cpus) noexcept
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    return !cpus.empty() && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
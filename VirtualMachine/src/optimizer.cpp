@@ -0,0 +1,779 @@
+#include "optimizer.h"
+#include "cfg.h"
+#include <array>
+#include <bitset>
+#include <memory>
+#include <map>
+#include <iomanip>
+#include <algorithm>
+
+static constexpr uint32_t WORDS = Memory::MEM_SIZE / 2;
+static constexpr int REGS = 256;
+static constexpr int START_STACK = 240; // Registers used by CALL and ENDP
+static constexpr int32_t VARYING = -1;  // Register holds different addresses on different paths
+
+static constexpr uint16_t ALL_FLAGS = 0xFFFF;
+static constexpr uint16_t INT_FLAGS = 1 << 0 | 1 << 1 | 1 << 8;   // Zero, parity and sign (set_flags_int)
+static constexpr uint16_t FLOAT_FLAGS = 1 << 0 | 1 << 8;          // Zero and sign (set_flags_float)
+static constexpr uint16_t CARRY_FLAGS = 1 << 9 | 1 << 10;         // Signed overflow and carry
+static constexpr int MAX_ROUNDS = 8;
+
+// Flags set by the command
+static uint16_t flags_written(Word word) noexcept
+{
+    switch (word.cmd3ops.cmd)
+    {
+    case OP_CMP: return 1 << 2 | 1 << 3;
+    case OP_CMPU: return 1 << 4 | 1 << 5;
+    case OP_CMPF: return 1 << 6 | 1 << 7;
+    case OP_ADD: case OP_SUB: case OP_MUL: return INT_FLAGS | CARRY_FLAGS;
+    case OP_ADDF: case OP_SUBF: case OP_MULF: return FLOAT_FLAGS | 1 << 11;
+    case OP_DIVU: case OP_DIV: case OP_MODU: case OP_MOD: return INT_FLAGS | 1 << 12;
+    case OP_DIVF: return FLOAT_FLAGS | 1 << 12;
+    case OP_NEG: case OP_AND: case OP_OR: case OP_XOR: case OP_NOT: return INT_FLAGS;
+    case OP_NEGF: return FLOAT_FLAGS;
+    case OP_INC: case OP_DEC: return CARRY_FLAGS;
+    case OP_SETF: return word.cmd3ops.regs[0] < 16 ? 1 << word.cmd3ops.regs[0] : 0;
+    default: return 0;
+    }
+}
+
+// Flags read by the command
+static uint16_t flags_read(Word word) noexcept
+{
+    uint8_t cmd = word.cmd3ops.cmd;
+    if (is_jump(cmd)) return jump_flags(JUMP_MASKS[cmd]);
+    if (cmd == OP_LOADF) return word.cmd3ops.regs[1] < 16 ? 1 << word.cmd3ops.regs[1] : 0;
+    return 0;
+}
+
+// Registers pointing to the memory operands of the command. Returns their number,
+// written is the index of the operand the result goes to (-1 if none)
+static int memory_operands(Word word, uint8_t regs[3], int& written) noexcept
+{
+    const uint8_t* r = word.cmd3ops.regs;
+    written = -1;
+    switch (word.cmd3ops.cmd)
+    {
+    case OP_PRINT: case OP_PRINTU: case OP_PRINTF:
+        regs[0] = r[2];
+        return 1;
+    case OP_NEG: case OP_NEGF: case OP_INC: case OP_DEC: case OP_READ: case OP_READU: case OP_READF:
+        regs[0] = r[2];
+        written = 0;
+        return 1;
+    case OP_CMP: case OP_CMPU: case OP_CMPF:
+        regs[0] = r[0];
+        regs[1] = r[1];
+        return 2;
+    case OP_ADD: case OP_ADDF: case OP_SUB: case OP_SUBF: case OP_MUL: case OP_MULF: case OP_DIVU:
+    case OP_DIV: case OP_DIVF: case OP_MODU: case OP_MOD: case OP_AND: case OP_OR: case OP_XOR:
+        regs[0] = r[0];
+        regs[1] = r[1];
+        regs[2] = r[2];
+        written = 0;
+        return 3;
+    case OP_NOT:
+        regs[0] = r[0];
+        regs[1] = r[2];
+        written = 0;
+        return 2;
+    case OP_LOADRV:
+        regs[0] = r[0];
+        regs[1] = r[1];
+        written = 0;
+        return 2;
+    case OP_LOADF:
+        regs[0] = r[0];
+        written = 0;
+        return 1;
+    case OP_SETF:
+        regs[0] = r[1];
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Jump target known before execution (modes 0 and 3)
+static bool direct_target(Word word, uint16_t address, uint16_t& target) noexcept
+{
+    uint8_t mode = word.cmd3ops.regs[0];
+    if (mode == 0) target = word.cmd2ops.adrs;
+    else if (mode == 3) target = address + word.cmd2ops.adrs;
+    else return false;
+    return true;
+}
+
+namespace
+{
+// Values of the address registers before an instruction
+struct RegState
+{
+    std::array<int32_t, REGS> value;  // Address or VARYING
+    std::bitset<REGS> initial;        // Register may still hold its initial zero
+
+    // Joining the state coming from another path. Returns true if it changed
+    bool join(const RegState& other) noexcept
+    {
+        bool changed = false;
+        for (int r = 0; r < REGS; r++)
+            if (value[r] != other.value[r] && value[r] != VARYING)
+            {
+                value[r] = VARYING;
+                changed = true;
+            }
+        std::bitset<REGS> joined = initial | other.initial;
+        changed |= joined != initial;
+        initial = joined;
+        return changed;
+    }
+
+    void apply(Word word) noexcept
+    {
+        uint8_t cmd = word.cmd3ops.cmd;
+        if (cmd == OP_LOAD)
+        {
+            value[word.cmd2ops.reg] = word.cmd2ops.adrs;
+            initial[word.cmd2ops.reg] = false;
+        }
+        else if (cmd == OP_LOADR)
+        {
+            value[word.cmd3ops.regs[0]] = value[word.cmd3ops.regs[1]];
+            initial[word.cmd3ops.regs[0]] = initial[word.cmd3ops.regs[1]];
+        }
+        else if (cmd == OP_CALL) // The return address is pushed into one of the stack registers
+            for (int r = START_STACK; r < REGS; r++)
+            {
+                value[r] = VARYING;
+                initial[r] = false;
+            }
+    }
+};
+
+class Optimizer final
+{
+public:
+    Optimizer(Memory& memory, uint16_t& entry, OptimizerReport& report)
+        : memory(memory), entry(entry), report(report)
+    {
+    }
+
+    bool run();
+
+private:
+    Memory& memory;
+    uint16_t& entry;
+    OptimizerReport& report;
+
+    std::vector<Word> words;          // Image by word index (address / 2)
+    std::vector<bool> removed;        // Words to squeeze out of the image
+    std::vector<bool> code;           // Word holds a reachable instruction
+    std::vector<bool> written;        // Cell may be changed by a command
+    std::vector<bool> referenced;     // Cell may be pointed to by a register
+    std::unique_ptr<ControlFlowGraph> cfg;
+    std::vector<RegState> regs_in;    // Register values at the block entries
+    std::vector<uint16_t> flags_out;  // Flags read after the block
+    std::vector<uint8_t> free_regs;   // Registers not used by the program
+    uint32_t image_end = 0;           // Address after the last used cell
+    int chain_reg = -1;               // Register pointing to the constants of INC/DEC chains
+
+    bool analyze();
+    size_t instructions() const noexcept;
+    void find_register_values();
+    void find_live_flags();
+    void find_memory_operands();
+    uint16_t live_after(int block, uint16_t address) const;
+    void compact();
+
+    void thread_jumps(PassStats& stats);
+    void fold_compares(PassStats& stats);
+    void merge_chains(PassStats& stats);
+    void remove_loads(PassStats& stats);
+    void remove_dead_words(PassStats& stats);
+
+    Word word_at(uint32_t address) const noexcept { return words[address / 2]; }
+    bool is_code(uint32_t address) const noexcept { return address / 2 < WORDS && code[address / 2]; }
+
+    bool fail(const char* reason)
+    {
+        report.reason = reason;
+        return false;
+    }
+};
+}
+
+// Building the graph and the facts the passes rely on. Returns false if the program is not closed
+bool Optimizer::analyze()
+{
+    words.resize(WORDS);
+    image_end = 0;
+    for (uint32_t i = 0; i < WORDS; i++)
+    {
+        words[i] = memory.get_word(i * 2);
+        if (words[i].uval != 0) image_end = (i + 1) * 2;
+    }
+    removed.assign(WORDS, false);
+    code.assign(WORDS, false);
+
+    cfg.reset(new ControlFlowGraph(memory, entry));
+    const std::vector<BasicBlock>& blocks = cfg->blocks();
+    if (blocks.empty()) return fail("no instructions at the entry address");
+
+    bool has_call = false;
+    for (const BasicBlock& block : blocks)
+    {
+        if (block.start % 2) return fail("instructions at odd addresses");
+        if (block.unknown_target || block.leaves_image) return fail("jumps with targets unknown before execution");
+        uint8_t last = word_at(block.last).cmd3ops.cmd;
+        if (last >= OPCODES_COUNT) return fail("unknown operation codes");
+        if (last == OP_ENDP && block.proc == 0) return fail("ENDP outside subroutines");
+        has_call |= last == OP_CALL;
+        for (uint32_t address = block.start; address <= block.last; address += 2)
+            code[address / 2] = true;
+    }
+    for (const CfgEdge& edge : cfg->succs())
+    {
+        if (edge.kind == EdgeKind::INDIRECT) return fail("memory-indirect jumps");
+        if ((edge.kind == EdgeKind::JUMP || edge.kind == EdgeKind::FALLTHROUGH)
+            && blocks[edge.from].proc != blocks[edge.to].proc)
+            return fail("jumps between subroutines");
+    }
+
+    // Registers used by the commands and the addresses they are loaded with
+    std::bitset<REGS> used;
+    for (uint32_t i = 0; i < WORDS; i++)
+    {
+        if (!code[i]) continue;
+        image_end = std::max(image_end, (i + 1) * 2);
+
+        Word word = words[i];
+        if (is_concurrent_command(word.cmd3ops.cmd)) return fail("guest threads or channels");
+        if (is_stack_command(word.cmd3ops.cmd)) return fail("data stack");
+        uint8_t regs[3];
+        int written_operand;
+        int count = memory_operands(word, regs, written_operand);
+        for (int k = 0; k < count; k++)
+            used[regs[k]] = true;
+        if (word.cmd3ops.cmd == OP_LOAD)
+        {
+            used[word.cmd2ops.reg] = true;
+            if (word.cmd2ops.adrs % 2) return fail("variables at odd addresses");
+            if (word.cmd2ops.adrs + 1u >= Memory::MEM_SIZE) return fail("addresses outside memory");
+        }
+        else if (word.cmd3ops.cmd == OP_LOADR)
+            used[word.cmd3ops.regs[0]] = used[word.cmd3ops.regs[1]] = true;
+    }
+    if (has_call)
+        for (int r = START_STACK; r < REGS; r++)
+            if (used[r]) return fail("stack registers used as pointers");
+
+    free_regs.clear();
+    for (int r = START_STACK - 1; r > 0; r--)
+        if (!used[r]) free_regs.push_back(r);
+
+    find_register_values();
+    find_memory_operands();
+    for (uint32_t i = 0; i < WORDS; i++)
+    {
+        if (code[i] && (written[i * 2] || written[i * 2 + 1])) return fail("writes into the code");
+        if (referenced[i * 2] || referenced[i * 2 + 1]) image_end = std::max(image_end, (i + 1) * 2);
+    }
+    find_live_flags();
+    return true;
+}
+
+// Forward propagation of the register values over the graph
+void Optimizer::find_register_values()
+{
+    const std::vector<BasicBlock>& blocks = cfg->blocks();
+    const std::vector<CfgEdge>& succs = cfg->succs();
+
+    RegState varying;
+    varying.value.fill(VARYING);
+    varying.initial.set();
+    regs_in.assign(blocks.size(), varying);
+    std::vector<bool> reached(blocks.size(), false);
+
+    int start = cfg->block_at(entry);
+    regs_in[start].value.fill(0); // Processor() sets all registers to zero
+    regs_in[start].initial.set();
+    reached[start] = true;
+
+    std::vector<int> work = { start };
+    std::vector<bool> queued(blocks.size(), false);
+    queued[start] = true;
+    while (!work.empty())
+    {
+        int b = work.back();
+        work.pop_back();
+        queued[b] = false;
+
+        RegState state = regs_in[b];
+        for (uint32_t address = blocks[b].start; address <= blocks[b].last; address += 2)
+            state.apply(word_at(address));
+
+        for (int e = blocks[b].first_succ; e < blocks[b].first_succ + blocks[b].succ_count; e++)
+        {
+            int to = succs[e].to;
+            bool changed = !reached[to];
+            if (!reached[to]) regs_in[to] = state;
+            else changed = regs_in[to].join(state);
+            reached[to] = true;
+            if (changed && !queued[to])
+            {
+                queued[to] = true;
+                work.push_back(to);
+            }
+        }
+    }
+}
+
+// Cells that commands may read or write through the registers. A register holding
+// different addresses may point to any address it is loaded with through LOAD and LOADR
+void Optimizer::find_memory_operands()
+{
+    // Registers copied into each other share their addresses
+    std::array<int, REGS> group;
+    for (int r = 0; r < REGS; r++)
+        group[r] = r;
+    auto find = [&](int r) {
+        while (group[r] != r)
+            r = group[r] = group[group[r]];
+        return r;
+    };
+    std::vector<std::vector<uint16_t>> loads(REGS);
+    for (uint32_t i = 0; i < WORDS; i++)
+    {
+        if (!code[i]) continue;
+        Word word = words[i];
+        if (word.cmd3ops.cmd == OP_LOAD)
+            loads[word.cmd2ops.reg].push_back(word.cmd2ops.adrs);
+        else if (word.cmd3ops.cmd == OP_LOADR)
+            group[find(word.cmd3ops.regs[0])] = find(word.cmd3ops.regs[1]);
+    }
+    std::vector<std::vector<uint16_t>> addresses(REGS);
+    for (int r = 0; r < REGS; r++)
+    {
+        std::vector<uint16_t>& to = addresses[find(r)];
+        to.insert(to.end(), loads[r].begin(), loads[r].end());
+    }
+
+    written.assign(Memory::MEM_SIZE, false);
+    referenced.assign(Memory::MEM_SIZE, false);
+    auto mark = [&](std::vector<bool>& cells, uint32_t address) {
+        if (address + 1 < Memory::MEM_SIZE) cells[address] = cells[address + 1] = true;
+    };
+    for (int r = 0; r < REGS; r++)
+        for (uint16_t address : loads[r])
+            mark(referenced, address);
+
+    const std::vector<BasicBlock>& blocks = cfg->blocks();
+    for (size_t b = 0; b < blocks.size(); b++)
+    {
+        RegState state = regs_in[b];
+        for (uint32_t address = blocks[b].start; address <= blocks[b].last; address += 2)
+        {
+            Word word = word_at(address);
+            uint8_t regs[3];
+            int written_operand;
+            int count = memory_operands(word, regs, written_operand);
+            for (int k = 0; k < count; k++)
+            {
+                uint8_t r = regs[k];
+                if (state.initial[r]) mark(referenced, 0);
+                if (k == written_operand)
+                {
+                    if (state.value[r] != VARYING) mark(written, state.value[r]);
+                    else
+                    {
+                        for (uint16_t target : addresses[find(r)])
+                            mark(written, target);
+                        if (state.initial[r]) mark(written, 0);
+                    }
+                }
+            }
+            state.apply(word);
+        }
+    }
+}
+
+// Backward propagation of the flags that are read before being set again
+void Optimizer::find_live_flags()
+{
+    const std::vector<BasicBlock>& blocks = cfg->blocks();
+    const std::vector<CfgEdge>& succs = cfg->succs();
+    std::vector<uint16_t> flags_in(blocks.size(), 0);
+    flags_out.assign(blocks.size(), 0);
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t b = blocks.size(); b-- > 0;)
+        {
+            const BasicBlock& block = blocks[b];
+            uint16_t live = 0;
+            for (int e = block.first_succ; e < block.first_succ + block.succ_count; e++)
+                live |= flags_in[succs[e].to];
+            // ENDP of a subroutine that is never called may return anywhere
+            if (block.succ_count == 0 && word_at(block.last).cmd3ops.cmd != OP_HALT)
+                live = ALL_FLAGS;
+            flags_out[b] = live;
+
+            for (uint32_t address = block.last + 2; address-- > block.start;)
+            {
+                if (address % 2) continue;
+                Word word = word_at(address);
+                live = (live & ~flags_written(word)) | flags_read(word);
+            }
+            if (live != flags_in[b])
+            {
+                flags_in[b] = live;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Flags read after the instruction at the address, taking the rewrites of the current pass into account
+uint16_t Optimizer::live_after(int block, uint16_t address) const
+{
+    uint16_t live = flags_out[block];
+    for (uint32_t a = cfg->blocks()[block].last; a > address; a -= 2)
+    {
+        if (removed[a / 2]) continue;
+        Word word = word_at(a);
+        live = (live & ~flags_written(word)) | flags_read(word);
+    }
+    return live;
+}
+
+// Squeezing the removed words out of the image and moving all addresses in the commands
+void Optimizer::compact()
+{
+    std::vector<uint16_t> before(WORDS + 1, 0); // Number of removed words before the index
+    for (uint32_t i = 0; i < WORDS; i++)
+        before[i + 1] = before[i] + removed[i];
+    auto move = [&](uint32_t address) -> uint16_t {
+        return address - 2 * before[std::min(address / 2, WORDS)];
+    };
+
+    uint32_t out = 0;
+    for (uint32_t i = 0; i < WORDS; i++)
+    {
+        if (removed[i]) continue;
+        Word word = words[i];
+        uint16_t address = i * 2;
+        if (code[i])
+        {
+            uint8_t cmd = word.cmd3ops.cmd;
+            uint16_t target;
+            if (is_jump(cmd) && direct_target(word, address, target))
+                word.cmd2ops.adrs = word.cmd3ops.regs[0] == 0 ? move(target) : uint16_t(move(target) - move(address));
+            else if (cmd == OP_CALL || cmd == OP_LOAD)
+                word.cmd2ops.adrs = move(word.cmd2ops.adrs);
+        }
+        memory.set_word(out * 2, word);
+        out++;
+    }
+    for (; out < WORDS; out++)
+        memory.set_word(out * 2, Word());
+    entry = move(entry);
+}
+
+// Jumps and calls to an unconditional jump go straight to its target
+void Optimizer::thread_jumps(PassStats& stats)
+{
+    for (uint32_t i = 0; i < WORDS; i++)
+    {
+        if (!code[i]) continue;
+        Word& word = words[i];
+        uint8_t cmd = word.cmd3ops.cmd;
+        uint16_t address = i * 2, target;
+        if (cmd == OP_CALL) target = word.cmd2ops.adrs;
+        else if (!is_jump(cmd) || !direct_target(word, address, target)) continue;
+
+        uint16_t threaded = target;
+        for (int steps = 0; steps < 16 && is_code(threaded); steps++)
+        {
+            Word next = word_at(threaded);
+            uint16_t next_target;
+            if (next.cmd3ops.cmd != OP_JMP || !direct_target(next, threaded, next_target) || next_target == threaded)
+                break;
+            threaded = next_target;
+        }
+
+        if (is_jump(cmd) && threaded == address + 2)
+        {
+            removed[i] = true; // Both ways lead to the next instruction
+            stats.removed++;
+        }
+        else if (threaded != target)
+        {
+            if (is_jump(cmd)) word.cmd3ops.regs[0] = 0;
+            word.cmd2ops.adrs = threaded;
+            stats.rewritten++;
+        }
+    }
+}
+
+// A compare of cells that are never written decides the conditional jump ending the block
+void Optimizer::fold_compares(PassStats& stats)
+{
+    const std::vector<BasicBlock>& blocks = cfg->blocks();
+    for (size_t b = 0; b < blocks.size(); b++)
+    {
+        uint16_t last = blocks[b].last;
+        Word& jump = words[last / 2];
+        uint8_t cmd = jump.cmd3ops.cmd;
+        if (cmd < OP_JE || cmd > OP_JLEF) continue;
+
+        // The nearest instruction setting the flags of the jump
+        uint16_t uses = jump_flags(JUMP_MASKS[cmd]);
+        uint32_t at = last;
+        while (at > blocks[b].start && !(flags_written(word_at(at - 2)) & uses))
+            at -= 2;
+        if (at == blocks[b].start) continue;
+        at -= 2;
+        Word compare = word_at(at);
+        uint8_t compare_cmd = compare.cmd3ops.cmd;
+        if (compare_cmd != OP_CMP && compare_cmd != OP_CMPU && compare_cmd != OP_CMPF) continue;
+        if ((flags_written(compare) & uses) != uses) continue;
+
+        RegState state = regs_in[b];
+        for (uint32_t address = blocks[b].start; address < at; address += 2)
+            state.apply(word_at(address));
+        uint8_t reg1 = compare.cmd3ops.regs[0], reg2 = compare.cmd3ops.regs[1];
+        auto constant = [&](uint8_t r) {
+            int32_t address = state.value[r];
+            return address != VARYING && !written[address] && !written[address + 1];
+        };
+
+        uint16_t flags;
+        if (reg1 == reg2 && compare_cmd != OP_CMPF)
+            flags = 1 << 2 | 1 << 4; // Equal, not greater
+        else if (constant(reg1) && constant(reg2))
+        {
+            Word val1 = word_at(state.value[reg1]), val2 = word_at(state.value[reg2]);
+            bool equal, greater;
+            if (compare_cmd == OP_CMP) equal = val1.ival == val2.ival, greater = val1.ival > val2.ival;
+            else if (compare_cmd == OP_CMPU) equal = val1.uval == val2.uval, greater = val1.uval > val2.uval;
+            else equal = val1.fval == val2.fval, greater = val1.fval > val2.fval;
+            flags = equal << 2 | greater << 3 | equal << 4 | greater << 5 | equal << 6 | greater << 7;
+        }
+        else continue;
+
+        if (jump_taken(JUMP_MASKS[cmd], flags))
+        {
+            jump.cmd3ops.cmd = OP_JMP;
+            stats.rewritten++;
+        }
+        else
+        {
+            removed[last / 2] = true;
+            stats.removed++;
+        }
+
+        if (!(live_after(b, at) & flags_written(compare)))
+        {
+            removed[at / 2] = true;
+            stats.removed++;
+        }
+    }
+}
+
+// Three or more INC and DEC of the same register become LOAD of a constant and ADD
+void Optimizer::merge_chains(PassStats& stats)
+{
+    std::map<int32_t, uint16_t> constants; // Cells added after the image by value
+    uint32_t pool = image_end;
+
+    const std::vector<BasicBlock>& blocks = cfg->blocks();
+    for (size_t b = 0; b < blocks.size(); b++)
+    {
+        uint32_t address = blocks[b].start;
+        while (address <= blocks[b].last)
+        {
+            Word first = word_at(address);
+            uint8_t cmd = first.cmd3ops.cmd;
+            if (cmd != OP_INC && cmd != OP_DEC)
+            {
+                address += 2;
+                continue;
+            }
+
+            uint8_t reg = first.cmd3ops.regs[2];
+            int32_t delta = 0;
+            uint32_t end = address;
+            for (; end <= blocks[b].last; end += 2)
+            {
+                Word word = word_at(end);
+                if ((word.cmd3ops.cmd != OP_INC && word.cmd3ops.cmd != OP_DEC) || word.cmd3ops.regs[2] != reg)
+                    break;
+                delta += word.cmd3ops.cmd == OP_INC ? 1 : -1;
+            }
+            uint32_t count = (end - address) / 2;
+            uint32_t chain = address;
+            address = end;
+            if (count < 3 || (live_after(b, end - 2) & (INT_FLAGS | CARRY_FLAGS))) continue;
+
+            uint32_t keep = 0;
+            if (delta != 0)
+            {
+                if (chain_reg < 0)
+                {
+                    if (free_regs.empty()) continue;
+                    chain_reg = free_regs.front();
+                }
+                auto found = constants.find(delta);
+                if (found == constants.end())
+                {
+                    if (pool + 1 >= Memory::MEM_SIZE) continue;
+                    found = constants.emplace(delta, pool).first;
+                    words[pool / 2].ival = delta;
+                    pool += 2;
+                }
+
+                Word load = Word(), add = Word();
+                load.cmd2ops.cmd = OP_LOAD;
+                load.cmd2ops.reg = chain_reg;
+                load.cmd2ops.adrs = found->second;
+                add.cmd3ops.cmd = OP_ADD;
+                add.cmd3ops.regs[0] = add.cmd3ops.regs[1] = reg;
+                add.cmd3ops.regs[2] = chain_reg;
+                words[chain / 2] = load;
+                words[chain / 2 + 1] = add;
+                keep = 2;
+                stats.rewritten += 2;
+            }
+            for (uint32_t i = keep; i < count; i++)
+                removed[chain / 2 + i] = true;
+            stats.removed += count - keep;
+        }
+    }
+}
+
+// LOAD and LOADR setting a register to the address it already holds
+void Optimizer::remove_loads(PassStats& stats)
+{
+    const std::vector<BasicBlock>& blocks = cfg->blocks();
+    for (size_t b = 0; b < blocks.size(); b++)
+    {
+        RegState state = regs_in[b];
+        for (uint32_t address = blocks[b].start; address <= blocks[b].last; address += 2)
+        {
+            Word word = word_at(address);
+            bool redundant = false;
+            if (word.cmd3ops.cmd == OP_LOAD)
+                redundant = state.value[word.cmd2ops.reg] == word.cmd2ops.adrs;
+            else if (word.cmd3ops.cmd == OP_LOADR)
+            {
+                uint8_t to = word.cmd3ops.regs[0], from = word.cmd3ops.regs[1];
+                redundant = to == from || (state.value[to] != VARYING && state.value[to] == state.value[from]);
+            }
+            if (redundant)
+            {
+                removed[address / 2] = true;
+                stats.removed++;
+            }
+            state.apply(word);
+        }
+    }
+}
+
+// Words that are neither instructions nor pointed to by a register: code after
+// unconditional jumps that nothing jumps to and unused variables
+void Optimizer::remove_dead_words(PassStats& stats)
+{
+    for (uint32_t i = 0; i < image_end / 2; i++)
+        if (!code[i] && !referenced[i * 2] && !referenced[i * 2 + 1])
+        {
+            removed[i] = true;
+            stats.removed++;
+        }
+}
+
+// Instructions reachable in the graph of the last analysis, also when it failed
+size_t Optimizer::instructions() const noexcept
+{
+    size_t count = 0;
+    for (const BasicBlock& block : cfg->blocks())
+        count += (block.last - block.start) / 2 + 1;
+    return count;
+}
+
+bool Optimizer::run()
+{
+    if (!analyze()) return false;
+    report.instructions_before = instructions();
+    report.cells_before = image_end;
+
+    typedef void (Optimizer::*Pass)(PassStats&);
+    static const std::pair<const char*, Pass> PASSES[] = {
+        { "jump threading", &Optimizer::thread_jumps },
+        { "constant compares", &Optimizer::fold_compares },
+        { "INC/DEC chains", &Optimizer::merge_chains },
+        { "redundant loads", &Optimizer::remove_loads },
+        { "dead code", &Optimizer::remove_dead_words },
+    };
+    report.passes.clear();
+    for (const auto& pass : PASSES)
+        report.passes.push_back(PassStats { pass.first, 0, 0 });
+
+    bool changed = true;
+    for (int round = 0; round < MAX_ROUNDS && changed; round++)
+    {
+        changed = false;
+        for (size_t p = 0; p < report.passes.size(); p++)
+        {
+            // Every pass works on a fresh analysis of the image left by the previous one.
+            // The passes keep the program closed, otherwise the optimization stops with the reason
+            if (!analyze())
+            {
+                changed = false;
+                break;
+            }
+            PassStats stats = PassStats();
+            (this->*PASSES[p].second)(stats);
+            if (stats.rewritten + stats.removed == 0) continue;
+
+            report.passes[p].rewritten += stats.rewritten;
+            report.passes[p].removed += stats.removed;
+            changed = true;
+            compact();
+        }
+    }
+
+    if (!report.reason) analyze();
+    report.instructions_after = instructions();
+    report.cells_after = image_end;
+    return true;
+}
+
+// Peephole optimization of the program loaded into memory
+bool optimize(Memory& memory, uint16_t& entry, OptimizerReport& report)
+{
+    report = OptimizerReport();
+    Optimizer optimizer(memory, entry, report);
+    report.optimized = optimizer.run();
+    return report.optimized;
+}
+
+void OptimizerReport::print(std::ostream& out) const
+{
+    if (!optimized)
+    {
+        out << "Program not optimized: " << (reason ? reason : "unknown reason") << '\n';
+        return;
+    }
+
+    out << std::left << std::setw(20) << "Pass" << std::right << std::setw(10) << "Rewritten"
+        << std::setw(10) << "Removed" << '\n';
+    for (const PassStats& pass : passes)
+        out << std::left << std::setw(20) << pass.name << std::right << std::setw(10) << pass.rewritten
+            << std::setw(10) << pass.removed << '\n';
+    out << "Instructions: " << instructions_before << " -> " << instructions_after
+        << ", image cells: " << cells_before << " -> " << cells_after << '\n';
+    if (reason) out << "Optimization stopped early: " << reason << '\n';
+}
@@ -0,0 +1,101 @@
+#include "perf_counters.h"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+
+static const char* const EVENT_NAMES[PerfCounters::EVENTS_COUNT] = {
+    "cycles", "instructions", "branch-misses", "L1d-read-misses", "LLC-read-misses", "iTLB-read-misses" };
+
+// Cache event code: the cache, the read operation and the miss result
+static constexpr uint64_t cache_miss(uint64_t cache) noexcept
+{
+    return cache | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+}
+
+static int open_event(uint32_t type, uint64_t config) noexcept
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+PerfCounters::PerfCounters() noexcept
+{
+    static const uint32_t TYPES[EVENTS_COUNT] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE };
+    static const uint64_t CONFIGS[EVENTS_COUNT] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES, cache_miss(PERF_COUNT_HW_CACHE_L1D), cache_miss(PERF_COUNT_HW_CACHE_LL),
+        cache_miss(PERF_COUNT_HW_CACHE_ITLB) };
+
+    for (int i = 0; i < EVENTS_COUNT; i++)
+    {
+        fds[i] = open_event(TYPES[i], CONFIGS[i]);
+        errors[i] = fds[i] < 0 ? errno : 0;
+        counts[i] = 0;
+        running[i] = 0;
+    }
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int fd : fds)
+        if (fd >= 0) close(fd);
+}
+
+void PerfCounters::start() noexcept
+{
+    for (int fd : fds)
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+void PerfCounters::stop() noexcept
+{
+    for (int fd : fds)
+        if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    for (int i = 0; i < EVENTS_COUNT; i++)
+    {
+        uint64_t values[3]; // Count, time enabled, time running
+        if (fds[i] < 0 || read(fds[i], values, sizeof(values)) != sizeof(values)) continue;
+
+        // The kernel shares the hardware counters between events when there are too few of them
+        running[i] = values[1] ? double(values[2]) / values[1] : 0;
+        counts[i] = running[i] > 0 ? uint64_t(values[0] / running[i]) : values[0];
+    }
+}
+
+void PerfCounters::print(std::ostream& out, uint64_t guest_instructions) const
+{
+    out << "Host counters for " << guest_instructions << " guest instructions:\n";
+    for (int i = 0; i < EVENTS_COUNT; i++)
+    {
+        out << "    " << std::left << std::setw(18) << EVENT_NAMES[i] << std::right;
+        if (fds[i] < 0)
+        {
+            out << "not available (" << strerror(errors[i]) << ")\n";
+            continue;
+        }
+        out << std::setw(16) << counts[i];
+        if (guest_instructions)
+            out << std::setw(12) << std::fixed << std::setprecision(3)
+                << double(counts[i]) / guest_instructions << " per instruction" << std::defaultfloat;
+        if (running[i] > 0 && running[i] < 1)
+            out << " (scaled, counted " << std::setprecision(3) << running[i] * 100 << "% of the time)";
+        out << '\n';
+    }
+}
@@ -0,0 +1,29 @@
+#include "pipeline.h"
+#include <thread>
+
+// Connecting the stage to the previous one
+void Pipeline::add_stage(Processor& proc, uint16_t entry)
+{
+    if (!stages.empty())
+    {
+        channels.emplace_back(new Channel(CHANNEL_WORDS));
+        stages.back().proc->ports[OUTPUT_PORT] = channels.back().get();
+        proc.ports[INPUT_PORT] = channels.back().get();
+    }
+    stages.push_back(Stage { &proc, entry });
+}
+
+// A halted stage closes its channels: the next stage gets the end after the words left,
+// the previous one stops waiting to send
+void Pipeline::run()
+{
+    std::vector<std::thread> hosts;
+    for (const Stage& stage : stages)
+        hosts.emplace_back([stage] {
+            stage.proc->run(stage.entry);
+            for (Channel* channel : stage.proc->ports)
+                if (channel) channel->close();
+        });
+    for (std::thread& host : hosts)
+        host.join();
+}
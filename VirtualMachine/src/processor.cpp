@@ -1,4 +1,36 @@
 #include "processor.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cfenv>
+#include <type_traits>
+
+// The commands keep no state, so one instance of each serves all processors
+template <class C>
+static const C HANDLER {};
+
+// Table of the commands with the checked fraction arithmetic or the one of the fast float mode
+template <bool FastFloat>
+static constexpr std::array<const Command*, Processor::AMOUNT_COMMANDS> command_table() noexcept
+{
+    return { nullptr, &HANDLER<JumpCm>, &HANDLER<JEqCm>, &HANDLER<JEqUCm>, &HANDLER<JEqFCm>, &HANDLER<JGrCm>,
+        &HANDLER<JGrUCm>, &HANDLER<JGrFCm>, &HANDLER<JLsCm>, &HANDLER<JLsUCm>, &HANDLER<JLsFCm>, &HANDLER<JNEqCm>,
+        &HANDLER<JNEqUCm>, &HANDLER<JNEqFCm>, &HANDLER<JGEqCm>, &HANDLER<JGEqUCm>, &HANDLER<JGEqFCm>,
+        &HANDLER<JLEqCm>, &HANDLER<JLEqUCm>, &HANDLER<JLEqFCm>, &HANDLER<PrintCm>, &HANDLER<PrintUCm>,
+        &HANDLER<PrintFCm>, &HANDLER<LoadCm>, &HANDLER<NegCm>, &HANDLER<NegFCm>, &HANDLER<CmpCm>, &HANDLER<CmpUCm>,
+        &HANDLER<CmpFCm>, &HANDLER<AddCm>, &HANDLER<std::conditional_t<FastFloat, FastAddFCm, AddFCm>>,
+        &HANDLER<SubCm>, &HANDLER<std::conditional_t<FastFloat, FastSubFCm, SubFCm>>,
+        &HANDLER<MulCm>, &HANDLER<std::conditional_t<FastFloat, FastMulFCm, MulFCm>>,
+        &HANDLER<DivUCm>, &HANDLER<DivCm>, &HANDLER<std::conditional_t<FastFloat, FastDivFCm, DivFCm>>,
+        &HANDLER<ModUCm>, &HANDLER<ModCm>, &HANDLER<IncCm>, &HANDLER<DecCm>, &HANDLER<ReadCm>, &HANDLER<ReadUCm>,
+        &HANDLER<ReadFCm>, &HANDLER<AndCm>, &HANDLER<OrCm>, &HANDLER<XorCm>, &HANDLER<NotCm>, &HANDLER<LoadRCm>,
+        &HANDLER<LoadRVCm>, &HANDLER<CallCm>, &HANDLER<LoadF>, &HANDLER<SetF>, &HANDLER<EndpCm>,
+        &HANDLER<SpawnCm>, &HANDLER<JoinCm>, &HANDLER<FetchAddCm>, &HANDLER<CompareSwapCm>, &HANDLER<FenceCm>,
+        &HANDLER<SendCm>, &HANDLER<RecvCm>,
+        &HANDLER<PushValueCm>, &HANDLER<PopValueCm>, &HANDLER<FrameCm>, &HANDLER<BreakCm> };
+}
+
+constexpr std::array<const Command*, Processor::AMOUNT_COMMANDS> Processor::COMMANDS = command_table<false>();
+constexpr std::array<const Command*, Processor::AMOUNT_COMMANDS> Processor::FAST_FLOAT_COMMANDS = command_table<true>();
 
 Processor::Processor()
 {
@@ -9,22 +41,67 @@ Processor::Processor()
     sp = START_STACK;
 }
 
+Processor::Processor(PageArena* arena) noexcept : own_memory(arena)
+{
+    for (size_t i = 0; i < ADDRESS_REGS; i++)
+        address_regs[i] = 0;
+
+    flags = 0;
+    sp = START_STACK;
+}
+
+Processor::Processor(Memory& shared) noexcept : memory(shared)
+{
+    for (size_t i = 0; i < ADDRESS_REGS; i++)
+        address_regs[i] = 0;
+
+    flags = 0;
+    sp = START_STACK;
+}
+
 // Resetting values ​​in memory and registers
 void Processor::reset() noexcept
 {
     memory.clear();
     for (size_t i = 0; i < ADDRESS_REGS; i++)
         address_regs[i] = 0;
+    flags = 0;
+    sp = START_STACK;
+    call_stack.clear();
+    set_data_stack(0, 0);
+    trap = Trap::NONE;
+    executed = 0;
 }
 
 // Starting the processor
 void Processor::run(uint16_t start_address)
 {
     ip = start_address;
+    trap = Trap::NONE;
+    if (fast_float()) feclearexcept(FE_ALL_EXCEPT); // Only the exceptions of the run are collected
+    if (!metrics) run_loop<false>();
+    else
+    {
+        metrics->run_started();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        run_loop<true>();
+        metrics->run_finished(std::chrono::steady_clock::now() - start);
+    }
+    if (fast_float()) collect_float_exceptions();
+}
+
+// Executing commands from the Instruction Pointer up to a halt command or a trap.
+// The counting version also counts the commands by operation code
+template <bool Counted>
+void Processor::run_loop() noexcept
+{
     Word word = memory.get_word(ip);
     while (word.cmd3ops.cmd != 0)
     {
         (*commands[word.cmd3ops.cmd])(word, *this); // Run CPU command
+        if (trap != Trap::NONE) break; // The Instruction Pointer stays at the failed command
+        executed++;
+        if (Counted) metrics->count(word.cmd3ops.cmd);
 
         // If processed command isnt a jump command, then increase the Instraction Pointer
         if (word.cmd3ops.cmd > 19) ip += 2;
@@ -33,6 +110,26 @@ void Processor::run(uint16_t start_address)
     }
 }
 
+bool Processor::step() noexcept
+{
+    Word word = memory.get_word(ip);
+    if (word.cmd3ops.cmd == 0) return false;
+    (*commands[word.cmd3ops.cmd])(word, *this);
+    if (trap != Trap::NONE) return false;
+    executed++;
+    if (word.cmd3ops.cmd > 19) ip += 2;
+    return true;
+}
+
+// Turning the IEEE exceptions raised by the fast float commands into the flags
+void Processor::collect_float_exceptions() noexcept
+{
+    int raised = fetestexcept(FE_OVERFLOW | FE_INVALID | FE_DIVBYZERO);
+    if (raised & (FE_OVERFLOW | FE_INVALID)) set_flag(11, true); // Fractional overflow flag
+    if (raised & FE_DIVBYZERO) set_flag(12, true); // Flag indicating division by zero
+    feclearexcept(FE_ALL_EXCEPT);
+}
+
 // Setting a Flag Value
 void Processor::set_flag(uint8_t flag_index, bool is_true) noexcept
 {
@@ -58,18 +155,74 @@ void Processor::set_ip(uint16_t instruction_pointer) noexcept
     ip = instruction_pointer;
 }
 
-// Loading an address onto the stack
+// Loading an address onto the stack. The frame pointer of the caller is saved with it,
+// the frame of the subroutine starts at the top of the data stack
 void Processor::push(uint16_t adrs) noexcept
 {
+    if (call_stack_limit)
+    {
+        if (call_stack.size() >= call_stack_limit) trap = Trap::STACK_OVERFLOW;
+        else
+        {
+            call_stack.push_back(CallRecord { adrs, frame });
+            frame = data_sp;
+        }
+        return;
+    }
+
     address_regs[sp] = adrs;
+    saved_frames[sp - START_STACK] = frame;
+    frame = data_sp;
     sp++;
-    if (sp >= ADDRESS_REGS) sp = START_STACK;
+    if (sp < START_STACK) sp = START_STACK; // sp wraps to zero after the last register
 }
 
-// Unloading an address from the stack
+// Unloading an address from the stack. The values pushed in the frame are dropped
+// and the frame pointer of the caller is restored
 uint16_t Processor::pop() noexcept
 {
+    if (call_stack_limit)
+    {
+        if (call_stack.empty())
+        {
+            trap = Trap::STACK_UNDERFLOW;
+            return 0;
+        }
+        CallRecord record = call_stack.back();
+        call_stack.pop_back();
+        data_sp = frame;
+        frame = record.frame;
+        return record.return_to;
+    }
+
     sp--;
     if (sp < START_STACK) sp = ADDRESS_REGS - 1;
+    data_sp = frame;
+    frame = saved_frames[sp - START_STACK];
     return address_regs[sp];
 }
+
+// After a wrap of sp only the addresses below it are known
+size_t Processor::return_addresses(uint16_t* out, size_t max) const noexcept
+{
+    size_t count = 0;
+    for (int reg = sp - 1; reg >= START_STACK && count < max; reg--)
+        out[count++] = address_regs[reg];
+    return count;
+}
+
+// The stack can't take all memory, as its depth is counted in 16 bits
+void Processor::set_data_stack(uint16_t top, uint32_t limit) noexcept
+{
+    data_sp = frame = data_start = top;
+    uint32_t start = top ? top : Memory::MEM_SIZE;
+    data_room = start > limit ? std::min(start - limit, Memory::MEM_SIZE - 2) : 0;
+}
+
+// Switching between the stack simulated by registers and the extended call stack
+void Processor::set_extended_stack(size_t limit) noexcept
+{
+    call_stack_limit = limit;
+    call_stack.clear();
+    sp = START_STACK;
+}
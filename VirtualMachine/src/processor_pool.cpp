@@ -0,0 +1,40 @@
+#include "processor_pool.h"
+
+ProcessorPool::ProcessorPool(size_t capacity, int node) : arena(capacity * PAGES_PER_PROCESSOR), node_id(node)
+{
+    if (node >= 0) arena.bind_to_node(node); // Otherwise the first touch by the threads of the node places them
+    processors.reserve(capacity);
+    free_list.reserve(capacity);
+    for (size_t i = 0; i < capacity; i++)
+    {
+        processors.emplace_back(new Processor(&arena));
+        free_list.push_back(processors.back().get());
+    }
+}
+
+ProcessorPool::~ProcessorPool()
+{
+    processors.clear(); // The memories return their pages before the arena is unmapped
+}
+
+Processor* ProcessorPool::acquire() noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free_list.empty()) return nullptr;
+    Processor* proc = free_list.back();
+    free_list.pop_back();
+    return proc;
+}
+
+void ProcessorPool::release(Processor* proc) noexcept
+{
+    proc->reset();
+    proc->set_extended_stack(0);
+    proc->set_fast_float(false);
+    proc->metrics = nullptr;
+    proc->input = nullptr;
+    proc->output = &std::cout;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    free_list.push_back(proc);
+}
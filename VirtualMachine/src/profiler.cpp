@@ -0,0 +1,175 @@
+#include "profiler.h"
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+#include "cfg.h"
+
+// Older C libraries name only the union member
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// The signal handler finds the profiler here
+static std::atomic<SamplingProfiler*> active { nullptr };
+static struct sigaction previous_action;
+
+SamplingProfiler::SamplingProfiler(const Processor& proc, unsigned rate) noexcept
+    : proc(proc), rate(rate ? rate : 1), samples(new Sample[MAX_SAMPLES])
+{
+}
+
+SamplingProfiler::~SamplingProfiler()
+{
+    stop();
+}
+
+// Only atomics and reads of the processor and its memory, all safe in a signal handler
+void SamplingProfiler::on_signal(int) noexcept
+{
+    SamplingProfiler* profiler = active.load(std::memory_order_acquire);
+    if (!profiler) return;
+    size_t index = profiler->taken.fetch_add(1, std::memory_order_relaxed);
+    if (index >= MAX_SAMPLES) return;
+    Sample& sample = profiler->samples[index];
+    sample.ip = profiler->proc.get_ip();
+    sample.cmd = profiler->proc.memory.get_word(sample.ip).cmd3ops.cmd;
+    sample.depth = uint8_t(profiler->proc.return_addresses(sample.returns, SAMPLED_RETURNS));
+}
+
+// The timer signals the calling thread only, so the handler never runs beside the processor
+bool SamplingProfiler::start() noexcept
+{
+    SamplingProfiler* none = nullptr;
+    if (!active.compare_exchange_strong(none, this)) return false;
+
+    struct sigaction action;
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART; // READ waiting for the console isn't interrupted
+    sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = pid_t(syscall(SYS_gettid));
+    if (sigaction(SIGPROF, &action, &previous_action) != 0)
+    {
+        active.store(nullptr);
+        return false;
+    }
+    if (timer_create(CLOCK_MONOTONIC, &event, &timer) != 0)
+    {
+        sigaction(SIGPROF, &previous_action, nullptr);
+        active.store(nullptr);
+        return false;
+    }
+
+    long period = std::max(1000000000L / rate, 1L); // Nanoseconds
+    itimerspec interval;
+    interval.it_interval.tv_sec = period / 1000000000L;
+    interval.it_interval.tv_nsec = period % 1000000000L;
+    interval.it_value = interval.it_interval;
+    timer_settime(timer, 0, &interval, nullptr);
+    return true;
+}
+
+// Deleting the timer also discards its pending signal
+void SamplingProfiler::stop() noexcept
+{
+    if (active.load() != this) return;
+    timer_delete(timer);
+    active.store(nullptr);
+    sigaction(SIGPROF, &previous_action, nullptr);
+}
+
+size_t SamplingProfiler::samples_taken() const noexcept
+{
+    return std::min(taken.load(), MAX_SAMPLES);
+}
+
+size_t SamplingProfiler::samples_dropped() const noexcept
+{
+    return taken.load() - samples_taken();
+}
+
+static double percent(size_t part, size_t whole)
+{
+    return whole ? 100.0 * part / whole : 0;
+}
+
+// Index of the subroutine containing the instruction, the last index if it isn't known code
+static size_t procedure_at(const ControlFlowGraph& cfg, uint16_t address)
+{
+    int block = cfg.block_at(address);
+    return block < 0 ? cfg.procedures().size() : size_t(cfg.blocks()[block].proc);
+}
+
+void SamplingProfiler::print(std::ostream& out, uint16_t entry) const
+{
+    size_t count = samples_taken();
+    out << "Profile: " << count << " samples at " << rate << " Hz";
+    if (samples_dropped()) out << ", " << samples_dropped() << " dropped";
+    out << '\n';
+    if (!count) return;
+
+    // A subroutine is counted once per sample in the total, however many of its calls are on the stack
+    ControlFlowGraph cfg(proc.memory, entry);
+    size_t procs = cfg.procedures().size();
+    std::vector<uint32_t> by_address(Memory::MEM_SIZE), by_command(OPCODES_COUNT);
+    std::vector<uint32_t> self(procs + 1), total(procs + 1);
+    std::vector<size_t> counted_in(procs + 1, count); // Last sample counted in the total
+    for (size_t i = 0; i < count; i++)
+    {
+        const Sample& sample = samples[i];
+        by_address[sample.ip]++;
+        if (sample.cmd < OPCODES_COUNT) by_command[sample.cmd]++;
+        size_t running = procedure_at(cfg, sample.ip);
+        self[running]++;
+        total[running]++;
+        counted_in[running] = i;
+        for (size_t r = 0; r < sample.depth; r++)
+        {
+            size_t caller = procedure_at(cfg, uint16_t(sample.returns[r] - 2)); // The CALL before the return address
+            if (counted_in[caller] == i) continue;
+            total[caller]++;
+            counted_in[caller] = i;
+        }
+    }
+
+    std::vector<uint16_t> hot;
+    for (uint32_t address = 0; address < Memory::MEM_SIZE; address++)
+        if (by_address[address]) hot.push_back(uint16_t(address));
+    size_t listed = std::min(hot.size(), HOT_ADDRESSES);
+    std::partial_sort(hot.begin(), hot.begin() + listed, hot.end(), [&by_address](uint16_t a, uint16_t b) {
+        return by_address[a] != by_address[b] ? by_address[a] > by_address[b] : a < b;
+    });
+
+    out << std::fixed << std::setprecision(1);
+    out << "Hot addresses:\n" << "     address  samples       %  command\n";
+    for (size_t i = 0; i < listed; i++)
+        out << std::setw(12) << hot[i] << std::setw(9) << by_address[hot[i]]
+            << std::setw(8) << percent(by_address[hot[i]], count) << "  " << disassemble(proc.memory.get_word(hot[i])) << '\n';
+
+    out << "Subroutines:\n" << "       entry     self       %    total       %\n";
+    std::vector<size_t> order;
+    for (size_t p = 0; p <= procs; p++)
+        if (total[p]) order.push_back(p);
+    std::sort(order.begin(), order.end(), [&total](size_t a, size_t b) {
+        return total[a] != total[b] ? total[a] > total[b] : a < b;
+    });
+    for (size_t p : order)
+    {
+        if (p < procs) out << std::setw(12) << cfg.procedures()[p].entry;
+        else out << std::setw(12) << "(unknown)";
+        out << std::setw(9) << self[p] << std::setw(8) << percent(self[p], count)
+            << std::setw(9) << total[p] << std::setw(8) << percent(total[p], count) << '\n';
+    }
+
+    out << "Commands:";
+    for (size_t cmd = 0; cmd < OPCODES_COUNT; cmd++)
+        if (by_command[cmd] * 100 >= count) // 1% or more
+            out << ' ' << OPCODE_NAMES[cmd] << ' ' << percent(by_command[cmd], count) << '%';
+    out << '\n' << std::defaultfloat;
+}
@@ -0,0 +1,560 @@
+#include "purity.h"
+#include "cfg.h"
+#include <array>
+#include <bitset>
+#include <iterator>
+#include <map>
+#include <set>
+
+static constexpr int REGS = 256;
+static constexpr int START_STACK = 240; // Registers used by CALL and ENDP
+static constexpr int MAX_ROUNDS = 16; // Of the analysis of recursive subroutines
+static constexpr size_t MAX_INPUTS = 32; // Words of a cached call, more make the subroutine not worth caching
+static constexpr size_t MAX_OUTPUTS = 64;
+
+static constexpr uint16_t INT_FLAGS = 1 << 0 | 1 << 1 | 1 << 8;   // Zero, parity and sign (set_flags_int)
+static constexpr uint16_t FLOAT_FLAGS = 1 << 0 | 1 << 8;          // Zero and sign (set_flags_float)
+static constexpr uint16_t CARRY_FLAGS = 1 << 9 | 1 << 10;         // Signed overflow and carry
+
+// Flags set by the command
+static uint16_t flags_written(Word word) noexcept
+{
+    switch (word.cmd3ops.cmd)
+    {
+    case OP_CMP: return 1 << 2 | 1 << 3;
+    case OP_CMPU: return 1 << 4 | 1 << 5;
+    case OP_CMPF: return 1 << 6 | 1 << 7;
+    case OP_ADD: case OP_SUB: case OP_MUL: return INT_FLAGS | CARRY_FLAGS;
+    case OP_ADDF: case OP_SUBF: case OP_MULF: return FLOAT_FLAGS | 1 << 11;
+    case OP_DIVU: case OP_DIV: case OP_MODU: case OP_MOD: return INT_FLAGS | 1 << 12;
+    case OP_DIVF: return FLOAT_FLAGS | 1 << 12;
+    case OP_NEG: case OP_AND: case OP_OR: case OP_XOR: case OP_NOT: return INT_FLAGS;
+    case OP_NEGF: return FLOAT_FLAGS;
+    case OP_INC: case OP_DEC: return CARRY_FLAGS;
+    case OP_SETF: return word.cmd3ops.regs[0] < 16 ? 1 << word.cmd3ops.regs[0] : 0;
+    default: return 0;
+    }
+}
+
+// Flags read by the command
+static uint16_t flags_read(Word word) noexcept
+{
+    uint8_t cmd = word.cmd3ops.cmd;
+    if (is_jump(cmd)) return jump_flags(JUMP_MASKS[cmd]);
+    if (cmd == OP_LOADF) return word.cmd3ops.regs[1] < 16 ? 1 << word.cmd3ops.regs[1] : 0;
+    return 0;
+}
+
+// Location of a subroutine as seen by its caller, whose data stack top is stack cells from its frame
+static uint32_t relocate(uint32_t location, int stack) noexcept
+{
+    return location & FRAME_RELATIVE ? FRAME_RELATIVE | uint16_t(location + stack) : location;
+}
+
+// Words below the frame, dropped by ENDP. A word at offset -1 has its second cell in the frame
+static bool own_word(uint32_t location) noexcept
+{
+    return (location & FRAME_RELATIVE) && int16_t(uint16_t(location)) <= -2;
+}
+
+// Registers the command reads, the address operands included, and the ones it loads
+static void registers_used(Word word, std::bitset<REGS>& used, std::bitset<REGS>& loaded) noexcept
+{
+    const uint8_t* r = word.cmd3ops.regs;
+    uint8_t cmd = word.cmd3ops.cmd;
+    switch (cmd)
+    {
+    case OP_LOAD: case OP_FRAME: case OP_SPAWN:
+        loaded[word.cmd2ops.reg] = true;
+        if (cmd == OP_SPAWN) used.set(); // The new thread gets all registers
+        break;
+    case OP_LOADR:
+        loaded[r[0]] = r[0] != r[1];
+        used[r[1]] = true;
+        break;
+    case OP_PRINT: case OP_PRINTU: case OP_PRINTF: case OP_NEG: case OP_NEGF: case OP_INC: case OP_DEC:
+    case OP_READ: case OP_READU: case OP_READF: case OP_JOIN: case OP_PUSHV: case OP_POPV:
+        used[r[2]] = true;
+        break;
+    case OP_CMP: case OP_CMPU: case OP_CMPF: case OP_LOADRV:
+        used[r[0]] = used[r[1]] = true;
+        break;
+    case OP_LOADF:
+        used[r[0]] = true;
+        break;
+    case OP_SETF:
+        used[r[1]] = true;
+        break;
+    case OP_NOT:
+        used[r[0]] = used[r[2]] = true;
+        break;
+    case OP_SEND: case OP_RECV:
+        used[r[1]] = used[r[2]] = true;
+        break;
+    default:
+        if ((cmd >= OP_ADD && cmd <= OP_MOD) ||
+            (cmd >= OP_AND && cmd <= OP_XOR) || cmd == OP_XADD || cmd == OP_CAS)
+            used[r[0]] = used[r[1]] = used[r[2]] = true;
+        else if (is_jump(cmd) && r[0] == JUMP_REGISTERS)
+            used[r[1]] = used[r[2]] = true;
+        break;
+    }
+}
+
+namespace
+{
+// Address register during the analysis of a subroutine
+struct RegValue
+{
+    enum Set : uint8_t { ABSOLUTE = 1, RELATIVE = 2 };
+
+    bool entry; // May still have the value from the CALL
+    uint8_t set; // Kinds of the locations it may have been set to, both if it isn't known at all
+    bool known; // Has been set to the location on every path
+    uint32_t location;
+
+    static RegValue at(uint32_t location) noexcept
+    {
+        return RegValue { false, uint8_t(location & FRAME_RELATIVE ? RELATIVE : ABSOLUTE), true, location };
+    }
+
+    bool operator==(const RegValue& other) const noexcept
+    {
+        return entry == other.entry && set == other.set && known == other.known &&
+            (!known || location == other.location);
+    }
+    bool operator!=(const RegValue& other) const noexcept { return !(*this == other); }
+
+    RegValue joined(const RegValue& other) const noexcept
+    {
+        bool same = known && other.known && location == other.location;
+        return RegValue { entry || other.entry, uint8_t(set | other.set), same, same ? location : 0 };
+    }
+};
+
+// Register after a call of a subroutine leaving it with the value, the caller's one is before
+static RegValue after_call(const RegValue& callee, const RegValue& before, int stack) noexcept
+{
+    RegValue value = callee;
+    if (value.known) value.location = relocate(value.location, stack);
+    if (!callee.entry) return value;
+    if (!callee.set) return before;
+    value.entry = false;
+    return before.joined(value);
+}
+
+// State before an instruction
+struct State
+{
+    bool reached = false;
+    std::array<RegValue, START_STACK> regs;
+    int stack = 0; // Top of the data stack relative to the frame
+    std::set<uint32_t> written; // Locations written on every path
+    uint16_t flags_set = 0; // Flags set on every path
+
+    // Joining the state coming from another path. Returns true if it changed,
+    // conflict if the data stack has different tops on the paths
+    bool join(const State& other, bool& conflict)
+    {
+        if (!reached)
+        {
+            *this = other;
+            return true;
+        }
+        conflict |= stack != other.stack;
+        bool changed = false;
+        for (int r = 0; r < START_STACK; r++)
+        {
+            RegValue value = regs[r].joined(other.regs[r]);
+            changed |= value != regs[r];
+            regs[r] = value;
+        }
+        for (auto it = written.begin(); it != written.end(); )
+            if (!other.written.count(*it))
+            {
+                it = written.erase(it);
+                changed = true;
+            }
+            else ++it;
+        changed |= (flags_set & other.flags_set) != flags_set;
+        flags_set &= other.flags_set;
+        return changed;
+    }
+};
+
+// Effects of a subroutine found by one round of the analysis
+struct Summary
+{
+    bool pure = true;
+    std::string reason;
+    std::set<uint32_t> inputs, outputs;
+    std::set<uint32_t> written; // Outputs written on every path
+    std::set<uint32_t> accessed; // By the commands of the subroutine
+    std::map<uint8_t, RegValue> registers; // Registers the subroutine may set
+    uint16_t flags_read = 0, flags_may = 0, flags_must = 0;
+
+    bool operator==(const Summary& other) const
+    {
+        return pure == other.pure && inputs == other.inputs && outputs == other.outputs &&
+            written == other.written && accessed == other.accessed && registers == other.registers &&
+            flags_read == other.flags_read && flags_may == other.flags_may && flags_must == other.flags_must;
+    }
+};
+
+class Analysis final
+{
+public:
+    Analysis(const Memory& memory, uint16_t entry, bool fast_float)
+        : memory(memory), cfg(memory, entry), fast_float(fast_float)
+    {
+    }
+
+    std::vector<SubroutineEffects> run();
+
+private:
+    const Memory& memory;
+    ControlFlowGraph cfg;
+    bool fast_float;
+    std::vector<Summary> summaries; // By procedure of the graph
+
+    // Registers and flags read after the returns of the subroutines before they're loaded and set again
+    std::vector<std::bitset<REGS>> live_regs;
+    std::vector<uint16_t> live_flags;
+
+    void find_live_after_returns();
+    Summary analyze(int proc) const;
+    bool execute(uint16_t address, State& state, Summary& summary) const;
+    bool writes_code(uint16_t address) const noexcept;
+};
+
+// Effects of the subroutines are found in rounds until they stop changing:
+// a recursive call in a round uses the effects found in the previous one
+std::vector<SubroutineEffects> Analysis::run()
+{
+    const std::vector<Procedure>& procs = cfg.procedures();
+    summaries.assign(procs.size(), Summary());
+    if (!summaries.empty())
+    {
+        summaries[0].pure = false; // The program itself
+        summaries[0].reason = "program entry";
+    }
+
+    // The registers and flags nobody reads after the return aren't worth caching
+    find_live_after_returns();
+    bool settled = false;
+    for (int round = 0; round < MAX_ROUNDS && !settled; round++)
+    {
+        settled = true;
+        for (size_t p = 1; p < procs.size(); p++)
+        {
+            Summary summary = analyze(p);
+            if (!(summary == summaries[p])) settled = false;
+            summaries[p] = summary;
+        }
+    }
+
+    std::vector<SubroutineEffects> effects;
+    for (size_t p = 1; p < procs.size(); p++)
+    {
+        Summary& summary = summaries[p];
+        if (!settled && summary.pure)
+        {
+            summary.pure = false;
+            summary.reason = "effects not settled";
+        }
+        SubroutineEffects sub { procs[p].entry, summary.pure, summary.reason, {}, {}, {}, {}, {}, 0, 0 };
+        if (summary.pure)
+        {
+            sub.inputs.assign(summary.inputs.begin(), summary.inputs.end());
+            sub.outputs.assign(summary.outputs.begin(), summary.outputs.end());
+            sub.accessed.assign(summary.accessed.begin(), summary.accessed.end());
+            for (const std::pair<const uint8_t, RegValue>& reg : summary.registers)
+                sub.registers.push_back(RegisterEffect { reg.first, reg.second.set == RegValue::RELATIVE,
+                    reg.second.entry });
+            // A flag set on some paths only keeps its value from before the call on the others
+            sub.flag_outputs = summary.flags_may & live_flags[p];
+            sub.flag_inputs = summary.flags_read | (sub.flag_outputs & ~summary.flags_must);
+            for (const BasicBlock& block : cfg.blocks())
+                if (block.proc == int(p))
+                    sub.code.emplace_back(block.start, uint32_t(block.last) + 1 < Memory::MEM_SIZE ? block.last + 1 : block.last);
+        }
+        effects.push_back(sub);
+    }
+    return effects;
+}
+
+// Liveness over the whole program, the ENDPs lead to the commands following the CALLs.
+// Unknown jump targets may read anything
+void Analysis::find_live_after_returns()
+{
+    const std::vector<BasicBlock>& blocks = cfg.blocks();
+    const std::vector<CfgEdge>& succs = cfg.succs();
+    std::vector<std::bitset<REGS>> regs_in(blocks.size());
+    std::vector<uint16_t> flags_in(blocks.size(), 0);
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (size_t b = blocks.size(); b-- > 0; )
+        {
+            const BasicBlock& block = blocks[b];
+            std::bitset<REGS> regs;
+            uint16_t flags = 0;
+            if (block.unknown_target || block.leaves_image)
+            {
+                regs.set();
+                flags = 0xFFFF;
+            }
+            for (int e = block.first_succ; e < block.first_succ + block.succ_count; e++)
+            {
+                regs |= regs_in[succs[e].to];
+                flags |= flags_in[succs[e].to];
+            }
+            for (uint32_t address = block.last + 2; address > block.start; )
+            {
+                address -= 2;
+                Word word = memory.get_word(address);
+                std::bitset<REGS> used, loaded;
+                registers_used(word, used, loaded);
+                regs = (regs & ~loaded) | used;
+                flags = (flags & ~flags_written(word)) | flags_read(word);
+            }
+            if (regs != regs_in[b] || flags != flags_in[b])
+            {
+                regs_in[b] = regs;
+                flags_in[b] = flags;
+                changed = true;
+            }
+        }
+    }
+
+    live_regs.assign(cfg.procedures().size(), std::bitset<REGS>());
+    live_flags.assign(cfg.procedures().size(), 0);
+    for (const CfgEdge& edge : succs)
+        if (edge.kind == EdgeKind::RETURN)
+        {
+            int proc = blocks[edge.from].proc;
+            live_regs[proc] |= regs_in[edge.to];
+            live_flags[proc] |= flags_in[edge.to];
+        }
+}
+
+// One round for the subroutine: its blocks are visited until the states before them stop changing
+Summary Analysis::analyze(int proc) const
+{
+    const std::vector<BasicBlock>& blocks = cfg.blocks();
+    const std::vector<CfgEdge>& succs = cfg.succs();
+    Summary summary;
+    auto fail = [&](const std::string& reason) {
+        summary = Summary();
+        summary.pure = false;
+        summary.reason = reason;
+        return summary;
+    };
+
+    std::map<int, State> states;
+    State& start = states[cfg.procedures()[proc].block];
+    start.reached = true;
+    for (RegValue& reg : start.regs)
+        reg = RegValue { true, 0, false, 0 };
+
+    State exit;
+    std::vector<int> work { cfg.procedures()[proc].block };
+    while (!work.empty())
+    {
+        int b = work.back();
+        work.pop_back();
+        const BasicBlock& block = blocks[b];
+        State state = states[b];
+        for (uint32_t address = block.start; address <= block.last; address += 2)
+            if (!execute(address, state, summary)) return summary;
+
+        if (block.unknown_target || block.leaves_image)
+            return fail("jump outside the known code at " + std::to_string(block.last));
+        bool conflict = false, dropped = false; // ENDP drops the values pushed on any path
+        if (memory.get_word(block.last).cmd3ops.cmd == OP_ENDP)
+            exit.join(state, dropped);
+        for (int e = block.first_succ; e < block.first_succ + block.succ_count; e++)
+        {
+            const CfgEdge& edge = succs[e];
+            if (edge.kind == EdgeKind::CALL || edge.kind == EdgeKind::RETURN) continue;
+            if (edge.kind == EdgeKind::INDIRECT)
+                return fail("indirect jump at " + std::to_string(block.last));
+            if (blocks[edge.to].proc != proc)
+                return fail("jump into another subroutine at " + std::to_string(block.last));
+            if (states[edge.to].join(state, conflict)) work.push_back(edge.to);
+        }
+        if (conflict)
+            return fail("data stack differs on the paths after " + std::to_string(block.last));
+    }
+
+    if (!exit.reached) return fail("no ENDP");
+    for (int r = 0; r < START_STACK; r++)
+    {
+        // A register set by LOAD on some paths and by FRAME on others can't be cached
+        const RegValue& value = exit.regs[r];
+        if (!live_regs[proc][r]) continue;
+        if (value.set == (RegValue::ABSOLUTE | RegValue::RELATIVE))
+            return fail("register " + std::to_string(r) + " differs at the ENDPs");
+        if (value.set) summary.registers[r] = value;
+    }
+
+    // The words below the frame are dropped by ENDP
+    for (auto it = summary.outputs.begin(); it != summary.outputs.end(); )
+        it = own_word(*it) ? summary.outputs.erase(it) : std::next(it);
+    for (uint32_t location : exit.written)
+        if (!own_word(location)) summary.written.insert(location);
+    // A word written on some paths only keeps its value from before the call on the others
+    for (uint32_t location : summary.outputs)
+        if (!summary.written.count(location)) summary.inputs.insert(location);
+    summary.flags_must = exit.flags_set;
+
+    if (summary.inputs.size() > MAX_INPUTS) return fail("too many input words");
+    if (summary.outputs.size() > MAX_OUTPUTS) return fail("too many output words");
+    return summary;
+}
+
+// Effects of the instruction at the address on the state and the summary.
+// Returns false if the subroutine isn't pure
+bool Analysis::execute(uint16_t address, State& state, Summary& summary) const
+{
+    Word word = memory.get_word(address);
+    uint8_t cmd = word.cmd3ops.cmd;
+    const uint8_t* r = word.cmd3ops.regs;
+    auto fail = [&](const std::string& what) {
+        summary = Summary();
+        summary.pure = false;
+        summary.reason = what + " at " + std::to_string(address);
+        return false;
+    };
+    // Location the register points to
+    auto location = [&](uint8_t reg, uint32_t& location) {
+        if (reg >= START_STACK || state.regs[reg].entry || !state.regs[reg].known) return false;
+        location = state.regs[reg].location;
+        return true;
+    };
+    auto read = [&](uint32_t location) {
+        if (!state.written.count(location)) summary.inputs.insert(location);
+        summary.accessed.insert(location);
+    };
+    auto write = [&](uint32_t location) {
+        if (!(location & FRAME_RELATIVE) && writes_code(location)) return false;
+        summary.outputs.insert(location);
+        summary.accessed.insert(location);
+        state.written.insert(location);
+        return true;
+    };
+
+    if (cmd >= OPCODES_COUNT) return fail("unknown command");
+    if (cmd == OP_HALT || (cmd >= OP_PRINT && cmd <= OP_PRINTF) || (cmd >= OP_READ && cmd <= OP_READF) ||
+        is_concurrent_command(cmd))
+        return fail(OPCODE_NAMES[cmd]);
+    if (fast_float && (cmd == OP_ADDF || cmd == OP_SUBF || cmd == OP_MULF || cmd == OP_DIVF ||
+                       cmd == OP_LOADF || cmd == OP_SETF))
+        return fail(std::string(OPCODE_NAMES[cmd]) + " in the fast float mode");
+
+    summary.flags_read |= flags_read(word) & ~state.flags_set;
+    uint16_t flags = flags_written(word);
+    summary.flags_may |= flags;
+    state.flags_set |= flags;
+
+    uint32_t source = 0, target = 0;
+    switch (cmd)
+    {
+    case OP_LOAD:
+    case OP_FRAME:
+        if (word.cmd2ops.reg >= START_STACK) return fail("stack register");
+        state.regs[word.cmd2ops.reg] = RegValue::at(cmd == OP_FRAME ? FRAME_RELATIVE | word.cmd2ops.adrs :
+            word.cmd2ops.adrs);
+        return true;
+    case OP_LOADR:
+        if (r[0] >= START_STACK || r[1] >= START_STACK) return fail("stack register");
+        if (r[0] != r[1])
+            state.regs[r[0]] = !state.regs[r[1]].entry ? state.regs[r[1]] : // The caller's register isn't known
+                RegValue { false, RegValue::ABSOLUTE | RegValue::RELATIVE, false, 0 };
+        return true;
+    case OP_NEG: case OP_NEGF: case OP_INC: case OP_DEC:
+        if (!location(r[2], source)) break;
+        read(source);
+        return write(source) || fail("write into the code");
+    case OP_CMP: case OP_CMPU: case OP_CMPF:
+        if (!location(r[0], source) || !location(r[1], target)) break;
+        read(source);
+        read(target);
+        return true;
+    case OP_ADD: case OP_ADDF: case OP_SUB: case OP_SUBF: case OP_MUL: case OP_MULF: case OP_DIVU:
+    case OP_DIV: case OP_DIVF: case OP_MODU: case OP_MOD: case OP_AND: case OP_OR: case OP_XOR:
+        if (!location(r[1], source) || !location(r[0], target)) break;
+        read(source);
+        if (!location(r[2], source)) break;
+        read(source);
+        return write(target) || fail("write into the code");
+    case OP_NOT:
+        if (!location(r[2], source) || !location(r[0], target)) break;
+        read(source);
+        return write(target) || fail("write into the code");
+    case OP_LOADRV:
+        if (!location(r[1], source) || !location(r[0], target)) break;
+        read(source);
+        return write(target) || fail("write into the code");
+    case OP_LOADF:
+        if (!location(r[0], target)) break;
+        return write(target) || fail("write into the code");
+    case OP_SETF:
+        if (!location(r[1], source)) break;
+        read(source);
+        return true;
+    case OP_PUSHV:
+        if (!location(r[2], source)) break;
+        read(source);
+        state.stack -= 2;
+        return write(FRAME_RELATIVE | uint16_t(state.stack));
+    case OP_POPV:
+        if (!location(r[2], target)) break;
+        read(FRAME_RELATIVE | uint16_t(state.stack));
+        state.stack += 2;
+        return write(target) || fail("write into the code");
+    case OP_CALL:
+    {
+        int callee = cfg.block_at(word.cmd2ops.adrs);
+        callee = callee >= 0 && cfg.blocks()[callee].start == word.cmd2ops.adrs ? cfg.blocks()[callee].proc : -1;
+        if (callee < 0 || cfg.procedures()[callee].entry != word.cmd2ops.adrs || !summaries[callee].pure)
+            return fail("CALL of a subroutine that isn't pure");
+        if (state.stack > 0) return fail("CALL above the frame");
+
+        // The effects of the callee seen from its frame at the top of the data stack
+        const Summary& effects = summaries[callee];
+        for (uint32_t input : effects.inputs)
+        {
+            uint32_t location = relocate(input, state.stack);
+            if (!state.written.count(location)) summary.inputs.insert(location);
+        }
+        summary.flags_read |= effects.flags_read & ~state.flags_set;
+        for (uint32_t output : effects.outputs)
+            summary.outputs.insert(relocate(output, state.stack));
+        for (uint32_t output : effects.written)
+            state.written.insert(relocate(output, state.stack));
+        summary.flags_may |= effects.flags_may;
+        state.flags_set |= effects.flags_must;
+        for (const std::pair<const uint8_t, RegValue>& reg : effects.registers)
+            state.regs[reg.first] = after_call(reg.second, state.regs[reg.first], state.stack);
+        return true;
+    }
+    default:
+        if (is_jump(cmd) && (r[0] == JUMP_MEMORY || r[0] == JUMP_REGISTERS)) return fail("indirect jump");
+        return true; // Jumps, ENDP
+    }
+    return fail("register not loaded by the subroutine");
+}
+
+// Whether the word at the address overlaps an instruction
+bool Analysis::writes_code(uint16_t address) const noexcept
+{
+    return cfg.block_at(address) >= 0 || cfg.block_at(uint16_t(address - 1)) >= 0 ||
+        cfg.block_at(uint16_t(address + 1)) >= 0;
+}
+}
+
+std::vector<SubroutineEffects> analyze_subroutines(const Memory& memory, uint16_t entry, bool fast_float)
+{
+    return Analysis(memory, entry, fast_float).run();
+}
@@ -0,0 +1,6 @@
+# Addresses are 16 bits, a larger one isn't cut down
+# run:
+.entry main
+.text
+main:   LOAD r1, 70000
+        HALT
@@ -0,0 +1,6 @@
+# A label can be defined only once
+# run:
+.entry main
+.text
+main:   HALT
+main:   HALT
@@ -0,0 +1,32 @@
+# Labels with offsets, .equ, .org, .align and relative jumps
+# run:
+# run: --engine=block
+# assembled:
+.entry main
+.equ third 204
+.data
+.org 200
+table:  .int 10
+        .int 20
+        .int 30
+.align 8
+last:   .int 7
+where:  .uint last
+zero:   .int 0
+three:  .int 3
+.text
+main:   LOAD r1, table+4    # the third value
+        PRINT r1
+        LOAD r1, third      # the same value by .equ
+        PRINT r1
+        LOAD r1, where
+        PRINTU r1           # 208, aligned after 206
+        LOAD r1, zero
+        LOAD r2, three
+        JMP $+4             # over the PRINT
+        PRINT r2
+        INC r1
+        CMP r1, r2
+        JL $-4              # back to the INC
+        PRINT r1
+        HALT
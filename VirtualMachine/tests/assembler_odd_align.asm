@@ -0,0 +1,9 @@
+# Words can't be aligned after an odd .org
+# run:
+.entry main
+.data
+.org 301
+.align 4
+x:      .int 1
+.text
+main:   HALT
@@ -0,0 +1,6 @@
+# Offsets of the relative jumps are signed 16-bit numbers
+# run:
+.entry main
+.text
+main:   JMP $-32769
+        HALT
@@ -0,0 +1,6 @@
+# Jump to a label that isn't defined
+# run:
+.entry main
+.text
+main:   JMP nowhere
+        HALT
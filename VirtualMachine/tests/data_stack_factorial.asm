@@ -0,0 +1,30 @@
+# The recursive factorial of the README keeps its argument and the result on the data stack
+# run:
+# run: --engine=block
+# run: --memoize
+# assembled:
+.entry main
+.data
+n:      .int 5
+one:    .int 1
+.text
+main:   LOAD r1, n
+        PUSHV r1        # the argument, replaced by the result
+        CALL fact
+        POPV r1
+        PRINT r1
+        HALT
+fact:   FRAME r2, 0
+        LOAD r3, one
+        CMP r2, r3
+        JG rec
+        LOADRV r2, r3
+        ENDP
+rec:    PUSHV r2        # n - 1 for the recursive call
+        FRAME r4, -2
+        SUB r4, r4, r3
+        CALL fact
+        FRAME r4, -2
+        FRAME r2, 0
+        MUL r2, r2, r4
+        ENDP
@@ -0,0 +1,10 @@
+# Values are pushed until the data stack reaches the end of the program
+# run:
+# run: --engine=block
+.entry main
+.data
+a:      .int 7
+.text
+main:   LOAD r1, a
+loop:   PUSHV r1
+        JMP loop
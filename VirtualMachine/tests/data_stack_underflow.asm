@@ -0,0 +1,15 @@
+# A subroutine can't pop the values pushed by its caller
+# run:
+# run: --engine=block
+.entry main
+.data
+a:      .int 7
+.text
+main:   LOAD r1, a
+        PUSHV r1
+        CALL take
+        POPV r1
+        PRINT r1
+        HALT
+take:   POPV r1
+        ENDP
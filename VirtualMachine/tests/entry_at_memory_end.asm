@@ -0,0 +1,14 @@
+# The entry at the last word of the memory survives the text bytecode
+# run:
+# assembled:
+# assembled: --engine=block
+.entry main
+.data
+.org 100
+a:      .int 42
+.text
+body:   LOAD r1, a
+        PRINT r1
+        HALT
+.org 65534
+main:   JMP body
@@ -0,0 +1,20 @@
+# The second call of the pure subroutine runs its changed code, not the cached result
+# run:
+# run: --memoize
+# run: --memoize --engine=block
+.entry main
+.data
+a:      .int 5
+b:      .int 7
+.text
+main:   CALL get
+        PRINT r1
+        LOAD r10, get
+        LOAD r11, alt
+        LOADRV r10, r11     # get loads b from now on
+        CALL get
+        PRINT r1
+        HALT
+get:    LOAD r1, a
+        ENDP
+alt:    LOAD r1, b
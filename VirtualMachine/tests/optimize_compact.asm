@@ -0,0 +1,29 @@
+# Unreachable code and unused variables are removed after --optimize, and the moved code still
+# finds its variables, jump targets and subroutines
+# run:
+# run: --optimize
+# run: --optimize --engine=block
+# assembled:
+# assembled: --optimize
+.entry main
+.data
+unused: .int 99
+a:      .int 4
+.text
+main:   LOAD r1, a
+        JMP skip
+        PRINT r1        # unreachable
+        PRINT r1
+        HALT
+skip:   CALL twice
+        PRINT r1
+        JMP done
+        PRINT r1        # unreachable
+done:   CALL twice
+        PRINT r1
+        HALT
+dead:   PRINT r1        # never called
+        ENDP
+twice:  LOADR r3, r1
+        ADD r1, r1, r1
+        ENDP
@@ -0,0 +1,24 @@
+# Runs of INC and DEC of a register become one ADD after --optimize
+# run:
+# run: --optimize
+# run: --optimize --engine=block
+.entry main
+.data
+x:      .int 10
+limit:  .int 19
+.text
+main:   LOAD r1, x
+        LOAD r2, limit
+loop:   INC r1
+        INC r1
+        INC r1
+        INC r1
+        DEC r1
+        PRINT r1
+        CMP r1, r2
+        JL loop
+        DEC r1
+        DEC r1
+        DEC r1
+        PRINT r1
+        HALT
@@ -0,0 +1,23 @@
+# Jumps to jumps and to the next instruction and a compare of constants print the same values after --optimize
+# run:
+# run: --optimize
+# run: --optimize --engine=block
+.entry main
+.data
+a:      .int 3
+b:      .int 5
+.text
+main:   LOAD r1, a
+        LOAD r2, b
+        CMP r1, r2
+        JL hop          # always taken, a and b are never written
+        PRINT r2
+hop:    JMP next
+next:   JMP out
+out:    PRINT r1
+        CALL sub
+        PRINT r2
+        HALT
+sub:    JMP body
+body:   PRINT r2
+        ENDP
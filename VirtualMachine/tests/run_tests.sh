@@ -0,0 +1,38 @@
+#!/bin/sh
+# Running the test programs with the VM executable given as the argument. Every "# run:" line
+# of a program gives the options of one run, the printed values must match its .expected file.
+# The "# assembled:" lines run the text bytecode written by --assemble from the program instead.
+# The messages starting with the file name are compared without it
+vm=$1
+if [ -z "$vm" ]; then
+    echo "Usage: $0 path_to_VirtualMachine9"
+    exit 2
+fi
+dir=$(dirname "$0")
+runs=$(mktemp)
+text=$(mktemp)
+failed=0
+
+# Running the file with the options of every line in runs
+check() {
+    while read -r options; do
+        if "$vm" $options "$1" < /dev/null 2> /dev/null | sed "s|^$1:||" | cmp -s - "${program%.*}.expected"; then
+            echo "ok     $(basename "$program") $2$options"
+        else
+            echo "FAILED $(basename "$program") $2$options"
+            failed=1
+        fi
+    done < "$runs"
+}
+
+for program in "$dir"/*.asm "$dir"/*.txt; do
+    [ -f "$program" ] || continue
+    grep '^# run:' "$program" | cut -c8- > "$runs"
+    check "$program" ""
+    grep '^# assembled:' "$program" | cut -c14- > "$runs"
+    [ -s "$runs" ] || continue
+    "$vm" --assemble "$program" --output "$text" > /dev/null 2>&1
+    check "$text" "assembled "
+done
+rm -f "$runs" "$text"
+exit $failed